@@ -46,6 +46,20 @@
 #include "NascomFont.h"
 #include "simz80.h"
 
+#if defined(Z80_GDB) + defined(SCREEN_MIRROR) + defined(UART_BRIDGE) > 1
+#error Only one of Z80_GDB, SCREEN_MIRROR and UART_BRIDGE can use the serial port
+#endif
+#if defined(Z80_GDB) || defined(SCREEN_MIRROR) || defined(UART_BRIDGE)
+// The serial port carries the GDB protocol, the screen mirror or the Nascom UART.  The results
+// of the benchmark, lockstep and conformance runs, and the profile, then only go to their files
+#define SERIAL_TAKEN
+#undef DEBUG_PRINTF
+#define DEBUG_PRINTF(...) do { if (0) Serial.printf(__VA_ARGS__); } while (0)
+#define REPORT_PRINTF(...) do { if (0) Serial.printf(__VA_ARGS__); } while (0)
+#else
+#define REPORT_PRINTF(...) Serial.printf(__VA_ARGS__)
+#endif
+
 #define VERSION "V1.1"
 static const char *version = VERSION;
 static const char *buildDate = __DATE__;
@@ -63,6 +77,16 @@ namespace z80 {
   WORD pc;
   WORD IFF;
   BYTE ram[MEMSIZE*1024+1];  // The +1 location is for the wraparound GetWord
+  BYTE dirty[NUM_PAGES];     // Pages written since the last rewind capture
+  int  debugArmed;           // Breakpoints and watchpoints, see simz80.h
+  int  debugHit;
+  WORD debugPC;
+  BYTE debugPages[256];
+  int  features;             // Interpreter features, and their buffers (see simz80.h)
+  uint32_t *profile;
+  uint32_t (*opCounts)[256];
+  struct traceRecord *trace;
+  uint32_t traceIndex;
 };
 
 static const char *startText =
@@ -89,48 +113,240 @@ public:
 // Nascom memory
 class NascomMemory {
   uint8_t *mem;
+
+  // Binary memory image (.nmi) generated from the .nal/.nas files by tools/nas2nmi.py
+  static const uint32_t nmiMagic = 0x31494d4e; // "NMI1"
+  struct NmiHeader {
+    uint32_t magic;
+    uint16_t numRanges;
+    uint16_t reserved;
+  };
+  struct NmiRange {
+    uint16_t addr;
+    uint16_t length;
+  };
+
+  // Hex digit values, -1 for other characters
+  static int8_t hexValue[256];
+  uint32_t      loadErrors = 0;
+  uint32_t      firstErrorLine = 0;
+  uint16_t      loadStart = 0;
+
+  static void initHexValues() {
+    memset(hexValue, -1, sizeof(hexValue));
+    for (uint8_t d = 0; d < 10; d++)
+      hexValue['0' + d] = d;
+    for (uint8_t d = 0; d < 6; d++) {
+      hexValue['a' + d] = 10 + d;
+      hexValue['A' + d] = 10 + d;
+    }
+  }
+  void nasLineError(uint32_t lineNum, const char *error) {
+    DEBUG_PRINTF("Line %d: %s\n", lineNum, error);
+    if (loadErrors == 0)
+      firstErrorLine = lineNum;
+    loadErrors += 1;
+  }
+
 public:
-  NascomMemory(uint8_t *mem) : mem(mem) {}
+  NascomMemory(uint8_t *mem) : mem(mem) {
+    initHexValues();
+  }
+  static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t length) {
+    crc = ~crc;
+    while (length-- > 0) {
+      crc ^= *data++;
+      for (uint32_t bit = 0; bit < 8; bit++)
+        crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+  }
   uint8_t *getMemPtr() {
     return mem;
   }
-  bool nasFileLoad(const char *fileName) {
-    uint16_t addr;
-    File     file = LittleFS.open(fileName, "r");
+  // Boot images: Loads the .nmi image for fileName from the internal flash if there is
+  // one, otherwise parses the .nal/.nas file
+  bool load(const char *fileName) {
+    char        nmiFileName[40];
+    const char *ext = strrchr(fileName, '.');
+    size_t      baseLen = (ext == nullptr) ? strlen(fileName) : ext - fileName;
+    snprintf(nmiFileName, sizeof(nmiFileName), "%.*s.nmi", (int)baseLen, fileName);
+    if (LittleFS.exists(nmiFileName) && nmiFileLoad(&LittleFS, nmiFileName)) {
+      return true;
+    }
+    return nasFileLoad(&LittleFS, fileName);
+  }
+  static bool isMemoryImage(const char *fileName) {
+    const char *ext = strrchr(fileName, '.');
+    return ext != nullptr && (strcasecmp(ext, ".nas") == 0 || strcasecmp(ext, ".nal") == 0 || strcasecmp(ext, ".nmi") == 0);
+  }
+  // Loads a .nmi or a .nas/.nal file depending on the extension
+  bool fileLoad(FS *fs, const char *fileName, bool allowRom) {
+    const char *ext = strrchr(fileName, '.');
+    if (ext != nullptr && strcasecmp(ext, ".nmi") == 0)
+      return nmiFileLoad(fs, fileName, allowRom);
+    else
+      return nasFileLoad(fs, fileName, allowRom);
+  }
+  // The image is checked, ranges and CRC, before any of it is copied to memory
+  bool nmiFileLoad(FS *fs, const char *fileName, bool allowRom = true) {
+    File     file = fs->open(fileName, "r");
     uint32_t numBytes = 0;
+    uint32_t crc = 0;
+    uint32_t fileCrc = 0;
     if (!file) {
       DEBUG_PRINTF("Cannot open: %s\n", fileName);
       return false;
     }
     DEBUG_PRINTF("Loading %s\n", fileName);
-    const size_t bufSize = 100;
-    char buffer[bufSize];
-    while (file.available()) {
-      size_t l = file.readBytesUntil('\n', buffer, bufSize-1);
-      buffer[l] = 0;
-      if (buffer[0] == '.') {
-        break;
+    NmiHeader header;
+    bool ok = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) && header.magic == nmiMagic;
+    crc = crc32(crc, (const uint8_t *)&header, sizeof(header));
+    for (uint32_t ri = 0; ok && ri < header.numRanges; ri++) {
+      NmiRange range;
+      ok = file.read((uint8_t *)&range, sizeof(range)) == sizeof(range) &&
+           range.addr + range.length <= (allowRom ? 0x10000 : 0xe000) &&
+           (allowRom || range.addr >= 0x800);
+      crc = crc32(crc, (const uint8_t *)&range, sizeof(range));
+      uint8_t block[256];
+      for (uint32_t left = range.length; ok && left != 0; ) {
+        uint32_t len = left < sizeof(block) ? left : sizeof(block);
+        ok = file.read(block, len) == len;
+        crc = crc32(crc, block, len);
+        left -= len;
       }
-      char *p = buffer;
-      addr  = strtoul(p, &p, 16);
-      // DEBUG_PRINTF("%04x:", addr);
-      for (uint8_t b = 0; b < 8; b++) {
-        uint8_t byte = strtoul(p, &p, 16);
-        mem[addr+b] = byte;
-        if (addr + b == 0) {
-          mem[0x10000] = mem[0]; // make getWord(0xffff) work correctly
-        }
-        // DEBUG_PRINTF(" %02x", byte);
+    }
+    ok = ok && file.read((uint8_t *)&fileCrc, sizeof(fileCrc)) == sizeof(fileCrc) && fileCrc == crc;
+    if (!ok) {
+      file.close();
+      DEBUG_PRINTF("%s: Invalid image\n", fileName);
+      return false;
+    }
+    file.seek(sizeof(header));
+    for (uint32_t ri = 0; ok && ri < header.numRanges; ri++) {
+      NmiRange range;
+      ok = file.read((uint8_t *)&range, sizeof(range)) == sizeof(range) &&
+           file.read(mem + range.addr, range.length) == range.length;
+      if (ok && ri == 0) {
+        loadStart = range.addr;
       }
-      // DEBUG_PRINTF("\n");
-      numBytes += 8;
+      numBytes += range.length;
     }
     file.close();
+    mem[0x10000] = mem[0]; // make getWord(0xffff) work correctly
+    if (!ok) {
+      DEBUG_PRINTF("%s: Read error\n", fileName);
+      return false;
+    }
     DEBUG_PRINTF("%d (%04x) bytes loaded\n", numBytes, numBytes);
     return true;
   }
+  // Loads a .nas/.nal file. Each line holds an address, up to 8 data bytes and a
+  // checksum, which is the low byte of the sum of the address bytes and the data bytes.
+  // Lines with a bad checksum, and lines that would write outside RAM when allowRom is
+  // false, are skipped and reported.  The file ends at a line starting with '.'
+  bool nasFileLoad(FS *fs, const char *fileName, bool allowRom = true) {
+    File     file = fs->open(fileName, "r");
+    uint32_t numBytes = 0;
+    bool     isFirstLine = true;
+    loadErrors = 0;
+    firstErrorLine = 0;
+    if (!file) {
+      DEBUG_PRINTF("Cannot open: %s\n", fileName);
+      return false;
+    }
+    DEBUG_PRINTF("Loading %s\n", fileName);
+    static const uint32_t maxFields = 10;
+    uint8_t   buffer[512];
+    size_t    bufLen = 0;
+    size_t    bufPos = 0;
+    uint32_t  fields[maxFields];
+    uint32_t  numFields = 0;
+    uint32_t  value = 0;
+    uint32_t  digits = 0;
+    uint32_t  lineNum = 1;
+    bool      lineOk = true;
+    bool      atLineStart = true;
+    while (true) {
+      if (bufPos == bufLen) {
+        bufPos = 0;
+        bufLen = file.read(buffer, sizeof(buffer));
+      }
+      bool    atEnd = (bufLen == 0);
+      uint8_t c = atEnd ? '\n' : buffer[bufPos++];
+      if (atLineStart && c == '.')
+        break;
+      atLineStart = false;
+      int8_t hex = hexValue[c];
+      if (hex >= 0) {
+        value = (value << 4) | hex;
+        digits += 1;
+        continue;
+      }
+      if (digits != 0) {
+        if (numFields == maxFields || digits > (numFields == 0 ? 4u : 2u))
+          lineOk = false;
+        else
+          fields[numFields++] = value;
+        value = 0;
+        digits = 0;
+      }
+      if (c != ' ' && c != '\t' && c != '\b' && c != '\r' && c != '\n')
+        lineOk = false;
+      if (c != '\n')
+        continue;
+      if (numFields != 0) {
+        // Address, data bytes, checksum
+        uint32_t addr = fields[0];
+        uint32_t count = numFields - 2;
+        uint8_t  sum = (addr >> 8) + addr;
+        for (uint32_t fi = 1; fi <= count; fi++)
+          sum += fields[fi];
+        if (!lineOk || numFields < 3) {
+          nasLineError(lineNum, "syntax error");
+        }
+        else if (sum != fields[numFields - 1]) {
+          nasLineError(lineNum, "checksum error");
+        }
+        else if (addr + count > 0x10000 || (!allowRom && (addr < 0x800 || addr + count > 0xe000))) {
+          nasLineError(lineNum, "address outside RAM");
+        }
+        else {
+          for (uint32_t fi = 1; fi <= count; fi++)
+            mem[addr + fi - 1] = fields[fi];
+          numBytes += count;
+          if (isFirstLine)
+            loadStart = addr;
+          isFirstLine = false;
+        }
+      }
+      if (atEnd)
+        break;
+      numFields = 0;
+      lineOk = true;
+      atLineStart = true;
+      lineNum += 1;
+    }
+    file.close();
+    mem[0x10000] = mem[0]; // make getWord(0xffff) work correctly
+    DEBUG_PRINTF("%d (%04x) bytes loaded, %d corrupt lines\n", numBytes, numBytes, loadErrors);
+    return loadErrors == 0;
+  }
+  uint32_t getLoadErrors() {
+    return loadErrors;
+  }
+  uint32_t getFirstErrorLine() {
+    return firstErrorLine;
+  }
+  // Address of the first byte loaded, used as the entry point of a loaded program
+  uint16_t getLoadStart() {
+    return loadStart;
+  }
+
 };
 
+int8_t NascomMemory::hexValue[256];
+
 // Nascom display
 class NascomDisplay {
 private:  
@@ -144,6 +360,7 @@ private:
   uint8_t               cache[width*height];
   uint32_t              cx = 0;
   uint32_t              cy = 0;
+  uint16_t              changedRows = 0;
 public:
   VGA3Bit::Color        white;
   VGA3Bit::Color        black;
@@ -210,6 +427,7 @@ public:
   void updateFromMemory(NascomMemory &memory) {
     //DEBUG_PRINTF("NascomDisplay::updateFromMemory:\n");
     uint8_t *ram = memory.getMemPtr();
+    changedRows = 0;
     for (uint8_t *p0 = ram + 0x80A;
         p0 < ram + 0xC00;
         p0 += 64) {
@@ -228,10 +446,12 @@ public:
           if (cache[x + y*width] != *p) {
             drawCharAt(x, y, *p);
             cache[x + y*width] = *p;
+            changedRows |= 1 << y;
           }
         }
         else {
           drawCharAt(x, y, *p);
+          changedRows |= 1 << y;
         }
         //DEBUG_PRINTF(" %02x", *p);
       }
@@ -240,6 +460,159 @@ public:
     cacheInitialized = cacheUsed;
     show();
   }
+  // Bit y is set for each screen line (0 is the top line) that changed in the last
+  // updateFromMemory()
+  uint16_t getChangedRows() {
+    return changedRows;
+  }
+};
+
+// Nascom tape cache
+// Keeps recently used tape images in RAM, so reloading a tape doesn't read the file
+// again.  Entries are keyed by file system and file name, and validated against the
+// file size and modification time when a tape is selected.  The least recently used
+// entries are evicted when the cache is full.  An image is pinned from get() to release()
+// while the tape reads it, and a pinned entry that is dropped is freed on release().
+
+class NascomTapeCache {
+  static const uint32_t maxEntries     = 4;
+  static const uint32_t capacity       = 48*1024;
+  static const uint32_t maxFileNameLen = 32;
+  struct Entry {
+    FS       *fs;
+    char      fileName[maxFileNameLen+1];
+    uint32_t  size;
+    uint32_t  time;
+    uint32_t  lastUse;
+    uint32_t  pins = 0;
+    bool      stale = false;  // Dropped while pinned
+    uint8_t  *data = nullptr;
+  };
+  Entry    entries[maxEntries];
+  uint32_t used    = 0;
+  uint32_t useTick = 0;
+  uint32_t hits    = 0;
+  uint32_t misses  = 0;
+
+  Entry *find(FS *fs, const char *fileName) {
+    for (uint32_t ei = 0; ei < maxEntries; ei++) {
+      Entry &entry = entries[ei];
+      if (entry.data != nullptr && !entry.stale && entry.fs == fs && strcmp(entry.fileName, fileName) == 0)
+        return &entry;
+    }
+    return nullptr;
+  }
+  void evict(Entry &entry) {
+    if (entry.pins != 0) {
+      entry.stale = true;
+      return;
+    }
+    DEBUG_PRINTF("NascomTapeCache: Evict %s\n", entry.fileName);
+    free(entry.data);
+    entry.data = nullptr;
+    entry.stale = false;
+    used -= entry.size;
+  }
+  Entry *leastRecentlyUsed() {
+    Entry *lru = nullptr;
+    for (uint32_t ei = 0; ei < maxEntries; ei++) {
+      Entry &entry = entries[ei];
+      if (entry.data != nullptr && entry.pins == 0 && (lru == nullptr || entry.lastUse < lru->lastUse))
+        lru = &entry;
+    }
+    return lru;
+  }
+  Entry *allocate(uint32_t size) {
+    Entry *slot = nullptr;
+    while (true) {
+      for (uint32_t ei = 0; ei < maxEntries && slot == nullptr; ei++) {
+        if (entries[ei].data == nullptr)
+          slot = &entries[ei];
+      }
+      if (slot != nullptr && used + size <= capacity) {
+        slot->data = (uint8_t *)malloc(size);
+        if (slot->data != nullptr)
+          return slot;
+      }
+      Entry *lru = leastRecentlyUsed();
+      if (lru == nullptr)
+        return nullptr;
+      evict(*lru);
+    }
+  }
+
+public:
+  // Returns the cached image, reading it into the cache on a miss, and pins it until
+  // release().  Returns nullptr if the file can't be read or doesn't fit in the cache
+  const uint8_t *get(FS *fs, const char *fileName, uint32_t *size) {
+    Entry *entry = find(fs, fileName);
+    if (entry != nullptr) {
+      hits += 1;
+      entry->lastUse = ++useTick;
+      entry->pins += 1;
+      *size = entry->size;
+      return entry->data;
+    }
+    misses += 1;
+    File file = fs->open(fileName, "r");
+    if (!file)
+      return nullptr;
+    uint32_t fileSize = file.size();
+    if (fileSize == 0 || fileSize > capacity || (entry = allocate(fileSize)) == nullptr) {
+      file.close();
+      return nullptr;
+    }
+    if (file.read(entry->data, fileSize) != fileSize) {
+      DEBUG_PRINTF("NascomTapeCache: Cannot read %s\n", fileName);
+      free(entry->data);
+      entry->data = nullptr;
+      file.close();
+      return nullptr;
+    }
+    entry->fs = fs;
+    strncpy(entry->fileName, fileName, maxFileNameLen);
+    entry->fileName[maxFileNameLen] = 0;
+    entry->size = fileSize;
+    entry->time = file.getLastWrite();
+    entry->lastUse = ++useTick;
+    entry->pins = 1;
+    used += fileSize;
+    file.close();
+    DEBUG_PRINTF("NascomTapeCache: Cached %s (%d bytes, %d/%d used)\n", fileName, fileSize, used, capacity);
+    *size = fileSize;
+    return entry->data;
+  }
+  // Drops the entry if the file has changed since it was cached
+  void validate(FS *fs, const char *fileName) {
+    Entry *entry = find(fs, fileName);
+    if (entry == nullptr)
+      return;
+    File file = fs->open(fileName, "r");
+    if (!file || file.size() != entry->size || (uint32_t)file.getLastWrite() != entry->time)
+      evict(*entry);
+    if (file)
+      file.close();
+  }
+  void invalidate(FS *fs, const char *fileName) {
+    Entry *entry = find(fs, fileName);
+    if (entry != nullptr)
+      evict(*entry);
+  }
+  void release(const uint8_t *data) {
+    for (uint32_t ei = 0; ei < maxEntries; ei++) {
+      Entry &entry = entries[ei];
+      if (entry.data != nullptr && entry.data == data && entry.pins != 0) {
+        entry.pins -= 1;
+        if (entry.stale)
+          evict(entry);
+        return;
+      }
+    }
+  }
+  void getStatsText(char *text, size_t size) {
+    snprintf(text, size, "Tape cache: %dK/%dK, %d hits, %d misses",
+             (used + 1023)/1024, capacity/1024, hits, misses);
+  }
 };
 
 class NascomTape {
@@ -249,12 +622,83 @@ class NascomTape {
   char                  outFileName[maxFileNameLen+1];
   File  inFile;
   File  outFile;
-  FS   *inFs;
-  FS   *outFs;
+  FS   *inFs  = &LittleFS;
+  FS   *outFs = &LittleFS;
   bool  filesAreOpen;
   bool  inIsOpen;
   bool  outIsOpen;
+  bool  fastLoad = true;
+
+  // Read-ahead buffer for the input file.  The Z80 reads the tape one byte at a time,
+  // so the file is read in blocks and readByte() just indexes into the buffer.
+  // When the tape image is in the cache, the buffer is the whole cached image.
+  static const uint32_t inBufSize = 4096;
+  uint8_t               inBlock[inBufSize];
+  const uint8_t        *inBuf = inBlock;
+  const uint8_t        *inImage = nullptr;
+  uint32_t              inBufPos = 0;
+  uint32_t              inBufLen = 0;
+  uint32_t              inStartOffset = 0;
+  // Position of a restored snapshot.  Used instead of inStartOffset by the next open only
+  uint32_t              inRestorePosition = 0;
+  bool                  inRestorePending = false;
+
+  // Write-behind buffer for the output file.  Flushed in blocks when it is full and
+  // when the tape LED is turned off
+  static const uint32_t outBufSize = 4096;
+  uint8_t               outBuf[outBufSize];
+  uint32_t              outBufLen = 0;
+  uint32_t              outLostBytes = 0;
+
+  // Tape read throughput statistics.  Reported when the files are closed
+  uint32_t              inBytes;
+  uint32_t              inFillUs;
+  uint32_t              inStartMs;
+
+  NascomTapeCache       cache;
+
+  bool fillInBuf() {
+    if (inImage != nullptr) {
+      // Simulate a tape loop
+      inBufPos = 0;
+      return inBufLen != 0;
+    }
+    uint32_t start = micros();
+    inBufPos = 0;
+    inBufLen = inFile.read(inBlock, inBufSize);
+    if (inBufLen == 0) {
+      // Simulate a tape loop.  Start from the beginning when the end is reached
+      inFile.seek(0);
+      inBufLen = inFile.read(inBlock, inBufSize);
+      if (inBufLen != 0) {
+        DEBUG_PRINTF("fillInBuf: End of %s, rewinding\n", inFileName);
+      }
+    }
+    inFillUs += micros() - start;
+    return inBufLen != 0;
+  }
+  void flushOutBuf() {
+    if (outBufLen == 0)
+      return;
+    size_t written = outFile ? outFile.write(outBuf, outBufLen) : 0;
+    if (written != outBufLen) {
+      DEBUG_PRINTF("flushOutBuf: %s: %d of %d bytes written\n", outFileName, written, outBufLen);
+      outLostBytes += outBufLen - written;
+    }
+    outBufLen = 0;
+  }
 public:
+  // Tape state saved in machine snapshots.  The file systems are saved as 0 (Internal)
+  // or 1 (SD), and the input position is the file offset of the next byte to read
+  struct State {
+    uint8_t  led;
+    uint8_t  inSd;
+    uint8_t  outSd;
+    uint8_t  fastLoad;
+    uint32_t inPosition;
+    char     inFileName[maxFileNameLen+1];
+    char     outFileName[maxFileNameLen+1];
+  };
 //  NascomTape() : tapeLed(false), inFileIsOpen(false), outFileIsOpen(false) {}
   void init() {
     pinMode(Pins::tapeLed, OUTPUT);
@@ -282,8 +726,15 @@ public:
     outFileName[maxFileNameLen] = 0;
     DEBUG_PRINTF("setOutputFile: %s\n", outFileName);
   }
+  // File offset the next tape read starts from. Reset by setInputFile()
+  void setInputOffset(uint32_t offset) {
+    inStartOffset = offset;
+    DEBUG_PRINTF("setInputOffset: %d\n", offset);
+  }
   void setInputFile(FS *fs, const char *fileName) {
     inFs = fs;
+    inStartOffset = 0;
+    inRestorePending = false;
     if (fileName[0] != '/') {
       inFileName[0] = '/';
       strncpy(&(inFileName[1]), fileName, maxFileNameLen-1);
@@ -292,6 +743,7 @@ public:
       strncpy(inFileName, fileName, maxFileNameLen);
     inFileName[maxFileNameLen] = 0;
     DEBUG_PRINTF("setInputFile: %s\n", inFileName);
+    cache.validate(inFs, inFileName);
   }
   void closeFiles() {
     DEBUG_PRINTF("closeFiles\n");
@@ -299,8 +751,20 @@ public:
       DEBUG_PRINTF("closeFiles: Nothing to do\n");
       return;
     }
-    if (inFile) {
+    if (inFile || inImage != nullptr) {
       inFile.close();
+      uint32_t ms = millis() - inStartMs;
+      DEBUG_PRINTF("closeFiles: %d bytes read in %d ms (file i/o: %d us, %d bytes/s)\n",
+                   inBytes, ms, inFillUs, ms == 0 ? 0 : inBytes*1000/ms);
+    }
+    if (inImage != nullptr)
+      cache.release(inImage);
+    inBuf = inBlock;
+    inImage = nullptr;
+    inBufPos = 0;
+    inBufLen = 0;
+    if (outIsOpen) {
+      flushOutBuf();
     }
     if (outFile) {
       outFile.close();
@@ -310,21 +774,45 @@ public:
     outIsOpen = false;
   }
   bool hasData() {
-    return inFile && inFile.available();
+    return inBufPos < inBufLen || (inFile && inFile.available());
   }
 
   uint8_t readByte() {
     if (!tapeLed)
       return 0;
     if (!inIsOpen) {
-      inFile = inFs->open(inFileName, "r");
-      DEBUG_PRINTF("readByte: Opening %s => %s\n", inFileName, inFile ? "true" : "false");
       inIsOpen = true;
+      inBytes = 0;
+      inFillUs = 0;
+      inStartMs = millis();
+      inBufPos = 0;
+      inBufLen = 0;
+      uint32_t offset = inRestorePending ? inRestorePosition : inStartOffset;
+      inRestorePending = false;
+      uint32_t start = micros();
+      inImage = cache.get(inFs, inFileName, &inBufLen);
+      inFillUs += micros() - start;
+      if (inImage != nullptr) {
+        DEBUG_PRINTF("readByte: Reading %s from cache\n", inFileName);
+        inBuf = inImage;
+        inBufPos = offset < inBufLen ? offset : 0;
+      }
+      else {
+        inFile = inFs->open(inFileName, "r");
+        DEBUG_PRINTF("readByte: Opening %s => %s\n", inFileName, inFile ? "true" : "false");
+        if (offset != 0) {
+          inFile.seek(offset);
+        }
+      }
     }
-    if (!inFile.available()) {
-      inFile.seek(0);
+    if (inImage == nullptr && !inFile) {
+      return 0xff;
     }
-    return inFile.read();
+    if (inBufPos == inBufLen && !fillInBuf()) {
+      return 0xff;
+    }
+    inBytes += 1;
+    return inBuf[inBufPos++];
   }
   void writeByte(uint8_t b) {
   //  DEBUG_PRINTF("writeByte: %02x\n", b);
@@ -346,389 +834,1456 @@ public:
       }
       else
         outFile = outFs->open(outFileName, "w");
+      cache.invalidate(outFs, outFileName);
       DEBUG_PRINTF("writeByte: Opening %s => %s\n", outFileName, outFile ? "true" : "false");
       outIsOpen = true;
+      outBufLen = 0;
     }
-    if (outFile) {
-      outFile.write(b);
+    outBuf[outBufLen++] = b;
+    if (outBufLen == outBufSize) {
+      flushOutBuf();
     }
   }
+  void setFastLoad(bool enable) {
+    fastLoad = enable;
+  }
+  bool getFastLoad() {
+    return fastLoad;
+  }
+  bool isFastLoading() {
+    return fastLoad && tapeLed && inIsOpen;
+  }
+  NascomTapeCache &getCache() {
+    return cache;
+  }
+  uint32_t getInputPosition() {
+    if (!inIsOpen)
+      return inRestorePending ? inRestorePosition : inStartOffset;
+    if (inImage != nullptr)
+      return inBufPos;
+    if (inFile)
+      return inFile.position() - inBufLen + inBufPos;
+    return inStartOffset;
+  }
+  void getState(State &state) {
+    memset(&state, 0, sizeof(state));
+    state.led = tapeLed;
+    state.inSd = inFs == &SD;
+    state.outSd = outFs == &SD;
+    state.fastLoad = fastLoad;
+    state.inPosition = getInputPosition();
+    strcpy(state.inFileName, inFileName);
+    strcpy(state.outFileName, outFileName);
+  }
+  // Files are reopened on demand, so a restored read continues from the saved position.  The
+  // start offset of later loads is kept if the input file is the same
+  void setState(const State &state) {
+    closeFiles();
+    FS      *fs = inFs;
+    char     fileName[maxFileNameLen+1];
+    uint32_t startOffset = inStartOffset;
+    strcpy(fileName, inFileName);
+    setInputFile(state.inSd ? (FS *)&SD : (FS *)&LittleFS, state.inFileName);
+    if (inFs == fs && strcmp(inFileName, fileName) == 0)
+      inStartOffset = startOffset;
+    inRestorePosition = state.inPosition;
+    inRestorePending = true;
+    setOutputFile(state.outSd ? (FS *)&SD : (FS *)&LittleFS, state.outFileName);
+    fastLoad = state.fastLoad;
+    setLed(state.led);
+  }
+  // Number of bytes that couldn't be written to the output file since the last call
+  uint32_t takeLostBytes() {
+    uint32_t lost = outLostBytes;
+    outLostBytes = 0;
+    return lost;
+  }
 };
 
-// Nascom Control
-// UI for picking tape i/o files
-
-class NascomControl {
-  NascomDisplay        &display;
-  NascomTape           &tape;
-  static NascomControl *self;
-  bool                  isActive = false;
-  static bool           hasSd;
+// Nascom tape index
+// Catalogue of the NAS-SYS blocks in a .cas tape image.  The index is cached in a
+// hidden file next to the image (/.<name>.idx) and rebuilt when the size or the
+// modification time of the image changes.  The control screen only builds it when a
+// tape position is picked, so looking through the files does not write to the flash.
+//
+// NAS-SYS block format:
+//   00 ... 00           Leader
+//   FF FF FF FF         Sync
+//   LL HH EE DD SS      Start address, length (0 = 256), block number, header checksum
+//   EE data bytes       Block data
+//   SS                  Data checksum
+// Blocks are numbered down, so the last block of a program is block 0.
 
-  class FieldValues {
-  protected:
-    const char **values = nullptr;
-    uint32_t     numValues = 0;
-    uint32_t     current = 0;
-    bool         refreshed = false;
-  public:
-    virtual void refresh() = 0;
+class NascomTapeIndex {
+public:
+  struct Block {
+    uint32_t offset;   // File offset of the first sync byte
+    uint16_t addr;
+    uint16_t length;
+    uint8_t  number;
+    bool     dataOk;
+  };
+  static const uint32_t maxBlocks = 256;
 
-    const char *getCurrent() {
-      if (numValues == 0)
-        return "";
-      else
-        return values[current];
-    }
-    const char *getNext() {
-      current += 1;
-      if (current == numValues) {
-        current = 0;
-      }
-      return getCurrent();
-    }
-    const char *getPrev() {
-      if (current == 0) {
-        current = numValues;
-      }
-      current -= 1;
-      return getCurrent();
-    }
-    void reset() {
-      current = 0;
-    }
-    bool isRefreshed() {
-      return refreshed;
-    }
+private:
+  static const uint32_t cacheMagic     = 0x5849544e; // "NTIX"
+  static const uint32_t cacheVersion   = 1;
+  static const uint32_t maxFileNameLen = 40;
+  struct CacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t imageSize;
+    uint32_t imageTime;
+    uint32_t numBlocks;
   };
+  Block    blocks[maxBlocks];
+  uint32_t numBlocks = 0;
 
-  class TapeFsValues : public FieldValues {
+  // Buffered sequential reader used while scanning the image
+  class Reader {
+    File     &file;
+    uint8_t   buf[512];
+    uint32_t  pos = 0;
+    uint32_t  len = 0;
   public:
-    void refresh() {
-      DEBUG_PRINTF("TapeFsValues::refresh\n");
-      if (values != nullptr) {
-        free(values);
-      }
-      values = (const char **)malloc(2*sizeof(void *));
-      bool hasInternal = true; //LittleFS.begin();
-      if (hasSd) {
-        sdcard_type_t cardType = SD.cardType();
-        if (cardType == CARD_NONE || cardType == CARD_UNKNOWN) {
-          hasSd = false;
-        }
-      }
-      numValues = 0;
-      if (hasInternal) {
-        values[numValues] = "Internal Flash";
-        numValues += 1;
-      }
-      if (hasSd) {
-        values[numValues] = "SD Card";
-        numValues += 1;
+    uint32_t  offset = 0;
+    Reader(File &file) : file(file) {}
+    bool next(uint8_t *b) {
+      if (pos == len) {
+        pos = 0;
+        len = file.read(buf, sizeof(buf));
+        if (len == 0)
+          return false;
       }
-      this->reset();
-      refreshed = true;
+      *b = buf[pos++];
+      offset += 1;
+      return true;
     }
   };
-  class FileNames {
-  public:
-    static bool includeFile(File file) {
-      const char *name = file.name();
-      return (name != nullptr) && (name[0] != '.');
+
+  static void cacheName(const char *fileName, char *name) {
+    const char *base = strrchr(fileName, '/');
+    base = (base == nullptr) ? fileName : base + 1;
+    snprintf(name, maxFileNameLen, "/.%s.idx", base);
+  }
+
+  void build(File &file) {
+    Reader   reader(file);
+    uint8_t  b;
+    uint8_t  last = 0;
+    uint32_t run = 0;
+    numBlocks = 0;
+    while (numBlocks < maxBlocks && reader.next(&b)) {
+      run = (b == last) ? run + 1 : 1;
+      last = b;
+      if (run < 4 || b != 0xff)
+        continue;
+      run = 0;
+      Block   &block = blocks[numBlocks];
+      uint8_t  header[5];
+      uint32_t i;
+      block.offset = reader.offset - 4;
+      for (i = 0; i < 5 && reader.next(&header[i]); i++);
+      if (i < 5)
+        break;
+      if (((header[0] + header[1] + header[2] + header[3]) & 0xff) != header[4])
+        continue; // NAS-SYS skips blocks with a bad header
+      block.addr   = header[0] | (header[1] << 8);
+      block.length = (header[2] == 0) ? 256 : header[2];
+      block.number = header[3];
+      uint8_t sum = 0;
+      for (i = 0; i < block.length && reader.next(&b); i++)
+        sum += b;
+      if (i < block.length || !reader.next(&b))
+        break;
+      block.dataOk = (b == sum);
+      numBlocks += 1;
     }
-    static uint32_t fileCount(File dir) {
-      uint32_t count = 0;
-      dir.rewindDirectory();
-      while (File file = dir.openNextFile()) {
-        if (includeFile(file))
-          count += 1;
-        file.close();
-      }
-      return count;
+  }
+
+  bool readCache(FS *fs, const char *name, uint32_t size, uint32_t time) {
+    File file = fs->open(name, "r");
+    if (!file)
+      return false;
+    CacheHeader header;
+    bool ok = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+              header.magic == cacheMagic && header.version == cacheVersion &&
+              header.imageSize == size && header.imageTime == time &&
+              header.numBlocks <= maxBlocks;
+    if (ok) {
+      size_t bytes = header.numBlocks*sizeof(Block);
+      ok = file.read((uint8_t *)blocks, bytes) == bytes;
+      numBlocks = ok ? header.numBlocks : 0;
     }
-    static const char **makeFileNames(File dir, uint32_t *count) {
-      *count = fileCount(dir);
-      char const **names = (const char **)malloc((*count)*sizeof(char *));
-      uint32_t fileNum = 0;
-      dir.rewindDirectory();
-      while (File file = dir.openNextFile()) {
-        if (!includeFile(file))
-          continue;
-        const char *name = file.name();
-        char *nameValue = (char *)malloc(strlen(name)+1);
-        strcpy(nameValue, name);
-        names[fileNum] = nameValue;
-        fileNum += 1;
+    file.close();
+    return ok;
+  }
+
+  void writeCache(FS *fs, const char *name, uint32_t size, uint32_t time) {
+    File file = fs->open(name, "w");
+    if (!file) {
+      DEBUG_PRINTF("NascomTapeIndex: Cannot write %s\n", name);
+      return;
+    }
+    CacheHeader header = {cacheMagic, cacheVersion, size, time, numBlocks};
+    file.write((const uint8_t *)&header, sizeof(header));
+    file.write((const uint8_t *)blocks, numBlocks*sizeof(Block));
+    file.close();
+  }
+
+public:
+  // Reads the cached index, and builds and caches it if create is set.  False if there is no
+  // index
+  bool load(FS *fs, const char *fileName, bool create = true) {
+    numBlocks = 0;
+    File file = fs->open(fileName, "r");
+    if (!file)
+      return false;
+    uint32_t size = file.size();
+    uint32_t time = file.getLastWrite();
+    char     name[maxFileNameLen];
+    cacheName(fileName, name);
+    if (!readCache(fs, name, size, time)) {
+      if (!create) {
         file.close();
+        return false;
       }
-      return names;
+      uint32_t start = millis();
+      build(file);
+      DEBUG_PRINTF("NascomTapeIndex: %s: %d blocks indexed in %d ms\n", fileName, numBlocks, millis() - start);
+      writeCache(fs, name, size, time);
     }
-    static void freeFileNames(const char **names, uint32_t count) {
-      for (uint32_t vi = 0; vi < count; vi++)
-        free((void *)names[vi]);
-      free(names);
+    file.close();
+    return true;
+  }
+
+  uint32_t getNumBlocks() {
+    return numBlocks;
+  }
+  const Block &getBlock(uint32_t index) {
+    return blocks[index];
+  }
+
+  // Address range of the program that starts with block 'first'.  The program ends
+  // with block number 0
+  bool getProgramRange(uint32_t first, uint16_t *start, uint16_t *end) {
+    if (first >= numBlocks)
+      return false;
+    uint32_t lo = 0xffff;
+    uint32_t hi = 0;
+    for (uint32_t bi = first; bi < numBlocks; bi++) {
+      const Block &block = blocks[bi];
+      if (block.addr < lo)
+        lo = block.addr;
+      if (block.addr + block.length - 1u > hi)
+        hi = block.addr + block.length - 1;
+      if (block.number == 0)
+        break;
     }
+    *start = lo;
+    *end = hi > 0xffff ? 0xffff : hi;
+    return true;
+  }
+};
+
+// Nascom UART bridge
+// Connects the Nascom UART (port 1 data, port 2 status) to the serial port instead of the
+// tape, so NAS-SYS can be driven from a host (X command) and programs can be loaded (R) and
+// saved (W) over the serial line.  The bytes are buffered in both directions, and the status
+// bits come from the buffers: Data ready while a received byte is waiting, and transmit
+// buffer empty while there is room for another byte.
+//
+// In the instant mode bytes are passed on as fast as the Z80 and the serial port take them.
+// In the timed modes they move at the selected baud rate (10 bits per byte), in steps of one
+// CPU slice, so programs see the speed of a real serial line.
+//
+// Flow control: The Z80 waits on the status bits while the buffers are empty or full.  The
+// host is sent XOFF when the receive buffer and the serial port's own buffer hold xoffLevel
+// bytes, and XON when they are down to xonLevel.  A host that sends faster than the Z80
+// reads, e.g. to a timed mode, must honour XON/XOFF.
 
-  };
-  class TapeFileNamesSd : public FieldValues, public FileNames {
-  public:
-    void refresh() {
-      DEBUG_PRINTF("TapeFileNamesSd::refresh\n");
-      if (values != nullptr) {
-        freeFileNames(values, numValues);
-      }
-      if (!hasSd) {
-        values = nullptr;
-        numValues = 0;
-        return;
-      }
-      File dir = SD.open("/");
-      values = makeFileNames(dir, &numValues);
-      dir.close();
-      this->reset();
-      refreshed = true;
-    }
-  };
-
-  class TapeFileNamesInt : public FieldValues, public FileNames {
-  public:
-    void refresh() {
-      DEBUG_PRINTF("TapeFileNamesInt::refresh\n");
-      if (values != nullptr) {
-        freeFileNames(values, numValues);
-      }
-      File dir = LittleFS.open("/");
-      values = makeFileNames(dir, &numValues);
-      dir.close();
-      this->reset();
-      refreshed = true;
-    }
+class NascomUart {
+public:
+  // In the order of NascomControl::uartModes
+  enum Mode {
+    off,      // The UART is connected to the tape
+    instant,
+    baud300,
+    baud1200,
+    baud2400,
+    baud9600
   };
 
-  enum FieldNames {
-    noField         = 0,
-    tapeInFs        = 1,
-    tapeInFileName  = 2,
-    tapeOutFs       = 3,
-    tapeOutFileName = 4,
-    numFields       = 5 // pseudo field name
-  };
-  enum FieldType {
-    withValues,
-    withText
-  };
-  static const uint32_t maxTextFieldLen = 30;
-  struct Field {
-    uint32_t        x;
-    uint32_t        y;
-    uint32_t        length;
-    VGA3Bit::Color  background;
-    FieldType       type;
-    const char     *text;
-    char            textEdit[maxTextFieldLen + 1];
-    uint32_t        textLastChar;
-    FieldValues    *values = nullptr;
-  };
-  static const FieldNames firstField = tapeInFs;
-  static const FieldNames lastField  = tapeOutFileName;
+private:
+  static const uint32_t fifoSize  = 256;  // Must be a power of 2
+  static const uint32_t xoffLevel = 1024;
+  static const uint32_t xonLevel  = 256;
+  static const uint8_t  xon       = 0x11;
+  static const uint8_t  xoff      = 0x13;
+  static const uint32_t bauds[6];
 
-  enum FieldMove {
-    current,
-    next,
-    prev
+  struct Fifo {
+    uint8_t  data[fifoSize];
+    uint32_t head = 0;  // Next byte out
+    uint32_t tail = 0;  // Next byte in
+    uint32_t count() {
+      return tail - head;
+    }
+    bool full() {
+      return count() == fifoSize;
+    }
+    void put(uint8_t value) {
+      data[tail++ & (fifoSize - 1)] = value;
+    }
+    uint8_t get() {
+      return data[head++ & (fifoSize - 1)];
+    }
+    void clear() {
+      head = tail;
+    }
   };
 
-  Field            fields[numFields];
-  FieldNames       activeField = noField;
-  TapeFsValues     tapeFsValues;
-  TapeFileNamesSd  tapeFileNamesSd;
-  TapeFileNamesInt tapeFileNamesInt;
+  Stream  *port = nullptr;
+  Mode     mode = off;
+  Fifo     rx;
+  Fifo     tx;
+  uint8_t  lastRx = 0;
+  bool     hostStopped = false;  // XOFF sent
+  uint32_t slicesPerSecond;
+  // Timed modes: Bytes that may be received and sent in this slice, in 1/slicesPerSecond
+  // bytes.  Both get bauds[mode]/10 per slice, and a byte costs slicesPerSecond
+  uint32_t rxCredit = 0;
+  uint32_t txCredit = 0;
 
-  void addFieldWithValues(Field &field, uint32_t x, uint32_t y, uint32_t length, FieldValues *values) {
-    field.x = x;
-    field.y = y;
-    field.length = length;
-    field.background = display.green;
-    field.values = values;
-    field.type = withValues;
-    if (values != nullptr)
-      setFieldText(field, values->getCurrent());
-    else
-      setFieldText(field, "");
-  }
-  void addFieldWithText(Field &field, uint32_t x, uint32_t y, uint32_t length, const char *text) {
-    field.x = x;
-    field.y = y;
-    field.length = length;
-    field.background = display.green;
-    field.type = withText;
-    if (text != nullptr) {
-      strncpy(field.textEdit, text, maxTextFieldLen);
-      field.textEdit[maxTextFieldLen] = 0;
-      field.textLastChar = strlen(text);
-    }
-    else {
-      field.textEdit[0] = 0;
-      field.textLastChar = 0;
-    }
-    setFieldText(field, field.textEdit);
+  bool timed() {
+    return mode >= baud300;
   }
-
-  void setFieldText(Field &field, const char *text) {
-    field.text = text;
-    refreshField(field);
+  // Bytes the Z80 may have waiting for the serial port.  One slice worth in the timed modes
+  uint32_t txLimit() {
+    if (!timed())
+      return fifoSize;
+    uint32_t limit = bauds[mode]/10/slicesPerSecond;
+    return limit == 0 ? 1 : limit;
   }
-  void refreshField(Field &field) {
-    bool filling = false;
-    display.setTextColor(display.white, field.background);
-    for (uint32_t xi = 0; xi < field.length; xi++) {
-      if (!filling && field.text[xi] == 0)
-        filling = true;
-      if (filling)
-        display.drawCharAt(field.x + xi, field.y, ' ');
-      else
-        display.drawCharAt(field.x + xi, field.y, field.text[xi]);
+  void fill() {
+    while (!rx.full() && (!timed() || rxCredit >= slicesPerSecond) && port->available() > 0) {
+      rx.put(port->read());
+      if (timed())
+        rxCredit -= slicesPerSecond;
     }
   }
-  void setActiveField(FieldNames fieldName) {
-    if (fieldName == noField) {
-      activeField = fieldName;
+  void drain() {
+    uint8_t  block[fifoSize];
+    uint32_t len = 0;
+    int      room = port->availableForWrite();
+    while (tx.count() != 0 && (int)len < room && (!timed() || txCredit >= slicesPerSecond)) {
+      block[len++] = tx.get();
+      if (timed())
+        txCredit -= slicesPerSecond;
     }
-    else if (activeField != fieldName) {
-      fields[activeField].background = display.green;
-      refreshField(fields[activeField]);
-      activeField = fieldName;
-      fields[activeField].background = display.red;
-      refreshField(fields[activeField]);
+    if (len != 0)
+      port->write(block, len);
+  }
+  void flowControl() {
+    uint32_t backlog = rx.count() + port->available();
+    bool     stop = hostStopped ? backlog > xonLevel : backlog >= xoffLevel;
+    if (stop != hostStopped && port->availableForWrite() > 0) {
+      port->write(stop ? xoff : xon);
+      hostStopped = stop;
     }
   }
-  void gotoNextField() {
-    FieldNames nextField;
-    if (activeField == lastField)
-      nextField = firstField;
-    else
-      nextField = static_cast<FieldNames>(static_cast<uint32_t>(activeField) + 1);
-    setActiveField(nextField);
+
+public:
+  NascomUart(uint32_t slicesPerSecond) : slicesPerSecond(slicesPerSecond) {}
+
+  void begin(Stream &port, Mode mode) {
+    this->port = &port;
+    setMode(mode);
   }
-  void updateFieldValues(FieldNames fieldName, FieldValues *values) {
-    DEBUG_PRINTF("updateFieldValues: %d\n", fieldName);
-    fields[fieldName].values = values;
-    updateFieldValue(fieldName, current);
+  Mode getMode() {
+    return mode;
   }
-  void updateFieldValue(FieldNames fieldName, FieldMove move) {
-    DEBUG_PRINTF("updateFieldValue: %d\n", fieldName);
-    Field &field = fields[fieldName];
-    if (field.type != withValues)
+  void setMode(Mode mode) {
+    if (port == nullptr || mode == this->mode)
       return;
-    FieldValues *values = fields[fieldName].values;
-    const char  *newValue = nullptr; 
-    if (values != nullptr) {
-      if (move == current)
-        newValue = values->getCurrent();
-      else if (move == next)
-        newValue = values->getNext();
-      else // if (move == prev)
-        newValue = values->getPrev();
-      setFieldText(field, newValue);
-      if (fieldName == tapeInFs) {
-        if (newValue[0] == 'I') //
-          updateFieldValues(tapeInFileName, &tapeFileNamesInt);
-        else 
-          updateFieldValues(tapeInFileName, &tapeFileNamesSd);
-      }
+    DEBUG_PRINTF("NascomUart: Mode %d\n", mode);
+    if (mode == off) {
+      rx.clear();
+      tx.clear();
     }
-    else
-      setFieldText(fields[activeField], "");
+    this->mode = mode;
+    rxCredit = 0;
+    txCredit = 0;
   }
-  void updateFieldText(FieldNames fieldName, uint8_t c) {
-    Field &field = fields[fieldName];
-    if (field.type != withText)
+  bool getActive() {
+    return mode != off;
+  }
+  // Called once per CPU slice
+  void poll() {
+    if (mode == off)
       return;
-    if (c == 0x08) {
-      // backspace
-      DEBUG_PRINTF("updateFieldText: backspace\n", c);
-      if (field.textLastChar > 0) {
-        field.textLastChar -= 1;
-        field.textEdit[field.textLastChar] = 0;
-        setFieldText(field, field.textEdit);
-      }
+    if (timed()) {
+      uint32_t perSlice = bauds[mode]/10;
+      uint32_t max = perSlice > slicesPerSecond ? perSlice : slicesPerSecond;
+      rxCredit = rxCredit + perSlice < max ? rxCredit + perSlice : max;
+      txCredit = txCredit + perSlice < max ? txCredit + perSlice : max;
     }
-    else if (c > 32 && c < 127) {
-      DEBUG_PRINTF("updateFieldText: %c\n", c);
-      if (field.textLastChar < maxTextFieldLen) {
-        field.textEdit[field.textLastChar] = c;
-        field.textLastChar += 1;
-        setFieldText(field, field.textEdit);
+    drain();
+    fill();
+    flowControl();
+  }
+  // Status for port 2.  The instant mode doesn't wait for the next slice
+  bool getDataReady() {
+    if (rx.count() == 0 && !timed())
+      fill();
+    return rx.count() != 0;
+  }
+  bool getTransmitReady() {
+    if (tx.count() >= txLimit() && !timed())
+      drain();
+    return tx.count() < txLimit();
+  }
+  // Port 1.  Reading with no data ready returns the last byte again, as the UART does
+  uint8_t read() {
+    if (getDataReady())
+      lastRx = rx.get();
+    return lastRx;
+  }
+  // Port 1.  A byte written while the transmit buffer is full is lost
+  void write(uint8_t value) {
+    if (tx.full() && !timed())
+      drain();
+    if (!tx.full())
+      tx.put(value);
+  }
+};
+const uint32_t NascomUart::bauds[6] = {0, 0, 300, 1200, 2400, 9600};
+
+// Nascom fast tape load
+// Traps the NAS-SYS 3 tape read loop and does the sync search and the block data
+// transfer natively.  The header and checksum bytes are still read by NAS-SYS, so
+// it prints the usual block list and checks the checksums itself.
+//
+// Two instructions in the ROM are replaced with the ED FE trap opcode:
+//   0666: LD B,3        Start of the sync search (four equal bytes: FF=block, 1B=end)
+//   06A1: LD A,(0C2B)   Start of the block data loop. 0C2B holds the command (R or V)
+// When fast load is off, or the UART is bridged to the serial port, the trap executes the
+// replaced instruction.
+
+class NascomFastLoad {
+  static const uint16_t syncAddr     = 0x0666;
+  static const uint16_t dataAddr     = 0x06a1;
+  static const uint16_t cmdAddr      = 0x0c2b;
+  static const uint16_t cursorAddr   = 0x0c29;
+  static const uint32_t maxSyncBytes = 1024;
+  NascomTape &tape;
+  NascomUart &uart;
+  bool        installed = false;
+
+  static void setB(uint8_t b) {
+    Sethreg(z80::regs[z80::regs_sel].bc, b);
+  }
+  static void setC(uint8_t c) {
+    Setlreg(z80::regs[z80::regs_sel].bc, c);
+  }
+  static void setA(uint8_t a) {
+    Sethreg(z80::af[z80::af_sel], a);
+  }
+
+  // Continues at 066F with A = C = sync byte and B = 0, as after the last DJNZ.
+  // Gives up after maxSyncBytes, at a point where the ROM code restarts the search.
+  void sync() {
+    uint8_t  c = hreg(z80::af[z80::af_sel]);
+    uint32_t count = 3;
+    for (uint32_t n = 0; ; n++) {
+      uint8_t a = tape.readByte();
+      if (a == c && --count != 0)
+        continue;
+      if (a == c && (a == 0xff || a == 0x1b)) {
+        setA(a);
+        setB(0);
+        setC(a);
+        z80::pc = syncAddr + 9;
+        return;
+      }
+      if (n >= maxSyncBytes) {
+        setA(a);
+        z80::pc = syncAddr;
+        return;
       }
+      c = a;
+      count = 3;
     }
   }
-  const char *getFieldText(FieldNames fieldName) {
-    return fields[fieldName].text;
+
+  // Continues at 06B8 with B = 0, C = A = data checksum and HL past the block
+  void data() {
+    uint8_t  cmd    = z80::ram[cmdAddr];
+    uint16_t cursor = z80::GetWORD(cursorAddr);
+    uint16_t hl     = z80::regs[z80::regs_sel].hl;
+    uint8_t  b      = hreg(z80::regs[z80::regs_sel].bc);
+    uint8_t  sum    = lreg(z80::regs[z80::regs_sel].bc);
+    do {
+      uint8_t a = tape.readByte();
+      if (cmd == 'R')
+        z80::PutBYTE(hl, a);
+      z80::PutBYTE(cursor, a);
+      sum += a;
+      hl += 1;
+    } while (--b != 0);
+    z80::regs[z80::regs_sel].hl = hl;
+    setA(sum);
+    setB(0);
+    setC(sum);
+    z80::pc = dataAddr + 23;
   }
 
 public:
-  NascomControl (NascomDisplay &display, NascomTape &tape) : display(display), tape(tape) {
-    self = this;
-  }
+  NascomFastLoad(NascomTape &tape, NascomUart &uart) : tape(tape), uart(uart) {}
 
-  void init(bool hasSd) {
-    this->hasSd = hasSd;
+  bool install(NascomMemory &memory) {
+    static const uint8_t syncCode[] = {0x06, 0x03};
+    static const uint8_t dataCode[] = {0x3a, 0x2b, 0x0c};
+    static const uint8_t trapCode[] = {0xed, 0xfe};
+    uint8_t *mem = memory.getMemPtr();
+    if (memcmp(mem + syncAddr, trapCode, sizeof(trapCode)) == 0 &&
+        memcmp(mem + dataAddr, trapCode, sizeof(trapCode)) == 0) {
+      // Already patched, e.g. by restoring a snapshot
+      installed = true;
+      return true;
+    }
+    if (memcmp(mem + syncAddr, syncCode, sizeof(syncCode)) != 0 ||
+        memcmp(mem + dataAddr, dataCode, sizeof(dataCode)) != 0) {
+      DEBUG_PRINTF("NascomFastLoad: NAS-SYS 3 tape read routine not found\n");
+      return false;
+    }
+    mem[syncAddr]     = 0xed;
+    mem[syncAddr + 1] = 0xfe;
+    mem[dataAddr]     = 0xed;
+    mem[dataAddr + 1] = 0xfe;
+    installed = true;
+    return true;
   }
 
-  static void handleVirtualKey(fabgl::VirtualKey *vk, fabgl::Keyboard &keyboard, bool down) {
-    DEBUG_PRINTF("UI: handleVirtualKey\n");
-    if (down && (*vk == fabgl::VK_TAB))
-      self->gotoNextField();
-    else if (down && (*vk == fabgl::VK_UP))
-      self->updateFieldValue(self->activeField, prev);
-    else if (down && (*vk == fabgl::VK_DOWN))
-      self->updateFieldValue(self->activeField, next);
-    else if (down) {
-      int asc = keyboard.virtualKeyToASCII(*vk);
-      if (asc != -1)
-        self->updateFieldText(self->activeField, asc);
+  void trap(uint16_t addr) {
+    bool active = installed && tape.getFastLoad() && tape.getLed() && !uart.getActive();
+    if (addr == syncAddr) {
+      if (active) {
+        sync();
+      }
+      else {
+        setB(3);
+        z80::pc = syncAddr + 2;
+      }
+    }
+    else if (addr == dataAddr) {
+      if (active) {
+        data();
+      }
+      else {
+        setA(z80::ram[cmdAddr]);
+        z80::pc = dataAddr + 3;
+      }
+    }
+    else {
+      DEBUG_PRINTF("NascomFastLoad: Unexpected trap at %04x\n", addr);
+      z80::pc = addr + 2;
     }
   }
+};
 
-  void activate() {
-    DEBUG_PRINTF("UI: Activate\n");
-    display.setTextColor(display.white, display.blue);
-    isActive = true;
-  }
+// Nascom debugger
+// Breakpoints and memory watchpoints for the Z80 core (see simz80.h).  They are edited
+// on the debug screen (F2), which is also shown when one of them is hit.
+//
+// Breakpoints are given as hex addresses: "0C80 1000"
+// Watchpoints are given as R (read), W (write) or RW, and a hex address or address range:
+//   "W0C29 RW1000-10FF"
 
-  void showScreen() {
-    display.clear();
-    setActiveField(noField);
-    display.drawTextAt(0, 0, version);
-    display.drawTextAt(37, 0, buildDate);
-    display.drawTextAt(16, 0, "Nascom-2 Control");
-    display.drawTextAt(10, 2, "File System");
-    display.drawTextAt(25, 2, "File Name");
-    display.drawTextAt(1, 3, "Tape In");
-    display.drawTextAt(1, 5, "Tape Out");
-    tapeFsValues.refresh();
-    addFieldWithValues(fields[tapeInFs], 10, 3, 14, &tapeFsValues);
-    tapeFileNamesInt.refresh();
-    tapeFileNamesSd.refresh();
-    addFieldWithValues(fields[tapeInFileName], 25, 3, 22, &tapeFileNamesInt);
-    addFieldWithValues(fields[tapeOutFs], 10, 5, 14, &tapeFsValues);
-    addFieldWithText(fields[tapeOutFileName], 25, 5, 22, "tape-out.cas");
-    display.setTextColor(display.white, display.blue);
-    display.drawTextAt(2, 7, "  <F1>  Exit and save current selection");
-    display.drawTextAt(2, 8, "  <TAB> Goto next field");
-    display.drawTextAt(2, 9, "Fields with fixed values:");
-    display.drawTextAt(2, 10, "  <\x0b\x5e>  Cycle through values");
-    display.drawTextAt(2, 11, "Fields with user values:");
-    display.drawTextAt(2, 12, "  <BS>  Delete last character");
-    display.drawTextAt(2, 13, "  <CHR> Add 'CHR' as last character");
-    setActiveField(firstField);
+class NascomDebugger {
+public:
+  static const uint32_t maxBreakpoints = 8;
+  static const uint32_t maxWatchpoints = 8;
+  enum StopReason {
+    stopNone,
+    stopBreak,
+    stopRead,
+    stopWrite
+  };
+
+private:
+  struct Watchpoint {
+    uint16_t first;
+    uint16_t last;
+    uint8_t  kind;
+  };
+  uint16_t   breakpoints[maxBreakpoints];
+  uint32_t   numBreakpoints = 0;
+  Watchpoint watchpoints[maxWatchpoints];
+  uint32_t   numWatchpoints = 0;
+  StopReason reason = stopNone;
+  uint16_t   hitAddr = 0;
+  uint16_t   hitPc = 0;
+
+  void updatePages() {
+    memset(z80::debugPages, 0, sizeof(z80::debugPages));
+    for (uint32_t bi = 0; bi < numBreakpoints; bi++)
+      z80::debugPages[breakpoints[bi] >> 8] |= DEBUG_BREAK;
+    for (uint32_t wi = 0; wi < numWatchpoints; wi++) {
+      for (uint32_t page = watchpoints[wi].first >> 8; page <= (uint32_t)watchpoints[wi].last >> 8; page++)
+        z80::debugPages[page] |= watchpoints[wi].kind;
+    }
+    z80::debugArmed = numBreakpoints != 0 || numWatchpoints != 0;
+  }
+  static bool parseHex(const char *&text, uint16_t *value) {
+    char *end;
+    unsigned long v = strtoul(text, &end, 16);
+    if (end == text || v > 0xffff)
+      return false;
+    text = end;
+    *value = v;
+    return true;
+  }
+  static void skipSpaces(const char *&text) {
+    while (*text == ' ')
+      text++;
+  }
+
+public:
+  // Both return false if the text has errors.  The valid entries before the error are set
+  bool setBreakpoints(const char *text) {
+    numBreakpoints = 0;
+    bool ok = true;
+    for (skipSpaces(text); *text != 0 && ok; skipSpaces(text)) {
+      uint16_t addr;
+      ok = numBreakpoints < maxBreakpoints && parseHex(text, &addr);
+      if (ok)
+        breakpoints[numBreakpoints++] = addr;
+    }
+    updatePages();
+    return ok;
+  }
+  bool setWatchpoints(const char *text) {
+    numWatchpoints = 0;
+    bool ok = true;
+    for (skipSpaces(text); *text != 0 && ok; skipSpaces(text)) {
+      Watchpoint watch = {0, 0, 0};
+      for (; *text == 'R' || *text == 'r' || *text == 'W' || *text == 'w'; text++)
+        watch.kind |= (toupper(*text) == 'R') ? DEBUG_READ : DEBUG_WRITE;
+      ok = numWatchpoints < maxWatchpoints && watch.kind != 0 && parseHex(text, &watch.first);
+      watch.last = watch.first;
+      if (ok && *text == '-') {
+        text++;
+        ok = parseHex(text, &watch.last) && watch.last >= watch.first;
+      }
+      if (ok)
+        watchpoints[numWatchpoints++] = watch;
+    }
+    updatePages();
+    return ok;
+  }
+  void getBreakpointsText(char *text, size_t size) {
+    size_t len = 0;
+    text[0] = 0;
+    for (uint32_t bi = 0; bi < numBreakpoints && len < size; bi++)
+      len += snprintf(&text[len], size - len, "%s%04X", bi == 0 ? "" : " ", breakpoints[bi]);
+  }
+  void getWatchpointsText(char *text, size_t size) {
+    size_t len = 0;
+    text[0] = 0;
+    for (uint32_t wi = 0; wi < numWatchpoints && len < size; wi++) {
+      const Watchpoint &watch = watchpoints[wi];
+      len += snprintf(&text[len], size - len, "%s%s%s%04X", wi == 0 ? "" : " ",
+                      (watch.kind & DEBUG_READ) ? "R" : "", (watch.kind & DEBUG_WRITE) ? "W" : "", watch.first);
+      if (watch.last != watch.first && len < size)
+        len += snprintf(&text[len], size - len, "-%04X", watch.last);
+    }
+  }
+
+  // Single entries, for the GDB stub.  add returns false if the list is full
+  bool addBreakpoint(uint16_t addr) {
+    if (isBreakpoint(addr))
+      return true;
+    if (numBreakpoints == maxBreakpoints)
+      return false;
+    breakpoints[numBreakpoints++] = addr;
+    updatePages();
+    return true;
+  }
+  void removeBreakpoint(uint16_t addr) {
+    for (uint32_t bi = 0; bi < numBreakpoints; bi++) {
+      if (breakpoints[bi] == addr) {
+        breakpoints[bi] = breakpoints[--numBreakpoints];
+        break;
+      }
+    }
+    updatePages();
+  }
+  bool addWatchpoint(uint16_t first, uint16_t last, uint8_t kind) {
+    if (numWatchpoints == maxWatchpoints)
+      return false;
+    watchpoints[numWatchpoints++] = {first, last, kind};
+    updatePages();
+    return true;
+  }
+  void removeWatchpoint(uint16_t first, uint16_t last, uint8_t kind) {
+    for (uint32_t wi = 0; wi < numWatchpoints; wi++) {
+      const Watchpoint &watch = watchpoints[wi];
+      if (watch.first == first && watch.last == last && watch.kind == kind) {
+        watchpoints[wi] = watchpoints[--numWatchpoints];
+        break;
+      }
+    }
+    updatePages();
+  }
+
+  bool isBreakpoint(uint16_t pc) {
+    for (uint32_t bi = 0; bi < numBreakpoints; bi++) {
+      if (breakpoints[bi] == pc)
+        return true;
+    }
+    return false;
+  }
+  void watchAccess(uint16_t addr, int kind) {
+    if (z80::debugHit)
+      return;
+    for (uint32_t wi = 0; wi < numWatchpoints; wi++) {
+      const Watchpoint &watch = watchpoints[wi];
+      if ((watch.kind & kind) != 0 && addr >= watch.first && addr <= watch.last) {
+        z80::debugHit = 1;
+        reason = (kind == DEBUG_READ) ? stopRead : stopWrite;
+        hitAddr = addr;
+        hitPc = z80::debugPC;
+        return;
+      }
+    }
+  }
+  // Called when simz80() returns DEBUG_STOP
+  void stopped(uint16_t pc) {
+    if (!z80::debugHit) {
+      reason = stopBreak;
+      hitPc = pc;
+    }
+    z80::debugHit = 0;
+    DEBUG_PRINTF("NascomDebugger: Stopped at %04x\n", pc);
+  }
+  StopReason getStopReason(uint16_t *addr) {
+    StopReason stop = reason;
+    *addr = hitAddr;
+    reason = stopNone;
+    return stop;
+  }
+  void getStopText(char *text, size_t size) {
+    switch (reason) {
+      case stopBreak:
+        snprintf(text, size, "Breakpoint at %04X", hitPc);
+        break;
+      case stopRead:
+        snprintf(text, size, "Read from %04X by instruction at %04X", hitAddr, hitPc);
+        break;
+      case stopWrite:
+        snprintf(text, size, "Write to %04X by instruction at %04X", hitAddr, hitPc);
+        break;
+      default:
+        snprintf(text, size, "Stopped at %04X", z80::pc);
+        break;
+    }
+    reason = stopNone;
+  }
+};
+
+// Nascom Control
+// UI for picking tape i/o files, and the debug screen
+
+class NascomControl {
+public:
+  enum View {
+    mainView,
+    debugView
+  };
+
+private:
+  NascomDisplay        &display;
+  NascomTape           &tape;
+  NascomUart           &uart;
+  NascomMemory         &memory;
+  NascomDebugger       &debugger;
+  View                  view = mainView;
+  static NascomControl *self;
+  bool                  isActive = false;
+  static bool           hasSd;
+
+  class FieldValues {
+  protected:
+    const char **values = nullptr;
+    uint32_t     numValues = 0;
+    uint32_t     current = 0;
+    bool         refreshed = false;
+  public:
+    virtual void refresh() = 0;
+
+    const char *getCurrent() {
+      if (numValues == 0)
+        return "";
+      else
+        return values[current];
+    }
+    const char *getNext() {
+      current += 1;
+      if (current == numValues) {
+        current = 0;
+      }
+      return getCurrent();
+    }
+    const char *getPrev() {
+      if (current == 0) {
+        current = numValues;
+      }
+      current -= 1;
+      return getCurrent();
+    }
+    void reset() {
+      current = 0;
+    }
+    bool isRefreshed() {
+      return refreshed;
+    }
+  };
+
+  class TapeFsValues : public FieldValues {
+  public:
+    void refresh() {
+      DEBUG_PRINTF("TapeFsValues::refresh\n");
+      if (values != nullptr) {
+        free(values);
+      }
+      values = (const char **)malloc(2*sizeof(void *));
+      bool hasInternal = true; //LittleFS.begin();
+      if (hasSd) {
+        sdcard_type_t cardType = SD.cardType();
+        if (cardType == CARD_NONE || cardType == CARD_UNKNOWN) {
+          hasSd = false;
+        }
+      }
+      numValues = 0;
+      if (hasInternal) {
+        values[numValues] = "Internal Flash";
+        numValues += 1;
+      }
+      if (hasSd) {
+        values[numValues] = "SD Card";
+        numValues += 1;
+      }
+      this->reset();
+      refreshed = true;
+    }
+  };
+  class FixedValues : public FieldValues {
+    const char **fixed;
+    uint32_t     numFixed;
+  public:
+    FixedValues(const char **fixed, uint32_t numFixed) : fixed(fixed), numFixed(numFixed) {}
+    void refresh() {
+      values = fixed;
+      numValues = numFixed;
+      refreshed = true;
+    }
+    void set(uint32_t index) {
+      current = index;
+    }
+  };
+  static const char *onOff[2];
+  static const char *memLoadActions[3];
+  static const char *snapshotActions[5];
+  static const char *resumeModes[4];
+  static const char *rewindActions[5];
+  static const char *diagnosticsModes[5];
+  static const char *uartModes[6];
+  class TapePositionValues : public FieldValues {
+    static const uint32_t labelLen = 12;
+    NascomTapeIndex       index;
+    char                (*labels)[labelLen] = nullptr;
+    FS                   *fs = nullptr;
+    const char           *fileName = nullptr;
+    bool                  build = false;
+    bool                  indexed = false;
+  public:
+    // Only an index that is already cached is used, until buildIndex()
+    void setFile(FS *fs, const char *fileName) {
+      this->fs = fs;
+      this->fileName = fileName;
+      build = false;
+    }
+    // Builds the index of the file, and writes it to the flash, when a position is picked
+    void buildIndex() {
+      if (build)
+        return;
+      build = true;
+      refresh();
+    }
+    void refresh() {
+      DEBUG_PRINTF("TapePositionValues::refresh\n");
+      free(values);
+      free(labels);
+      values = nullptr;
+      labels = nullptr;
+      numValues = 0;
+      indexed = false;
+      if (fs == nullptr || fileName == nullptr || fileName[0] == 0)
+        return;
+      indexed = index.load(fs, fileName, build);
+      // First value is the start of the tape, followed by one value per block
+      uint32_t numBlocks = indexed ? index.getNumBlocks() : 0;
+      values = (const char **)malloc((numBlocks + 1)*sizeof(char *));
+      labels = (char (*)[labelLen])malloc((numBlocks + 1)*labelLen);
+      if (values == nullptr || labels == nullptr) {
+        free(values);
+        free(labels);
+        values = nullptr;
+        labels = nullptr;
+        indexed = false;
+        return;
+      }
+      strcpy(labels[0], "Start");
+      values[0] = labels[0];
+      for (uint32_t bi = 0; bi < numBlocks; bi++) {
+        const NascomTapeIndex::Block &block = index.getBlock(bi);
+        snprintf(labels[bi + 1], labelLen, "%04X #%02X%s", block.addr, block.number, block.dataOk ? "" : "?");
+        values[bi + 1] = labels[bi + 1];
+      }
+      numValues = numBlocks + 1;
+      this->reset();
+      refreshed = true;
+    }
+    uint32_t getOffset() {
+      return (current == 0 || numValues == 0) ? 0 : index.getBlock(current - 1).offset;
+    }
+    // Load range of the program at the current position
+    void getRangeText(char *text, size_t size) {
+      uint16_t start;
+      uint16_t end;
+      uint32_t first = (current == 0) ? 0 : current - 1;
+      if (!indexed)
+        snprintf(text, size, "No index");
+      else if (!index.getProgramRange(first, &start, &end))
+        snprintf(text, size, "No blocks");
+      else
+        snprintf(text, size, "Load %04X-%04X", start, end);
+    }
+  };
+
+  class FileNames {
+  public:
+    static bool includeFile(File file, bool onlyMemoryImages) {
+      const char *name = file.name();
+      return (name != nullptr) && (name[0] != '.') &&
+             (!onlyMemoryImages || NascomMemory::isMemoryImage(name));
+    }
+    static uint32_t fileCount(File dir, bool onlyMemoryImages) {
+      uint32_t count = 0;
+      dir.rewindDirectory();
+      while (File file = dir.openNextFile()) {
+        if (includeFile(file, onlyMemoryImages))
+          count += 1;
+        file.close();
+      }
+      return count;
+    }
+    static const char **makeFileNames(File dir, uint32_t *count, bool onlyMemoryImages = false) {
+      *count = fileCount(dir, onlyMemoryImages);
+      char const **names = (const char **)malloc((*count)*sizeof(char *));
+      uint32_t fileNum = 0;
+      dir.rewindDirectory();
+      while (File file = dir.openNextFile()) {
+        if (!includeFile(file, onlyMemoryImages))
+          continue;
+        const char *name = file.name();
+        char *nameValue = (char *)malloc(strlen(name)+1);
+        strcpy(nameValue, name);
+        names[fileNum] = nameValue;
+        fileNum += 1;
+        file.close();
+      }
+      return names;
+    }
+    static void freeFileNames(const char **names, uint32_t count) {
+      for (uint32_t vi = 0; vi < count; vi++)
+        free((void *)names[vi]);
+      free(names);
+    }
+
+  };
+  class TapeFileNamesSd : public FieldValues, public FileNames {
+    bool onlyMemoryImages;
+  public:
+    TapeFileNamesSd(bool onlyMemoryImages = false) : onlyMemoryImages(onlyMemoryImages) {}
+    void refresh() {
+      DEBUG_PRINTF("TapeFileNamesSd::refresh\n");
+      if (values != nullptr) {
+        freeFileNames(values, numValues);
+      }
+      if (!hasSd) {
+        values = nullptr;
+        numValues = 0;
+        return;
+      }
+      File dir = SD.open("/");
+      values = makeFileNames(dir, &numValues, onlyMemoryImages);
+      dir.close();
+      this->reset();
+      refreshed = true;
+    }
+  };
+
+  class TapeFileNamesInt : public FieldValues, public FileNames {
+    bool onlyMemoryImages;
+  public:
+    TapeFileNamesInt(bool onlyMemoryImages = false) : onlyMemoryImages(onlyMemoryImages) {}
+    void refresh() {
+      DEBUG_PRINTF("TapeFileNamesInt::refresh\n");
+      if (values != nullptr) {
+        freeFileNames(values, numValues);
+      }
+      File dir = LittleFS.open("/");
+      values = makeFileNames(dir, &numValues, onlyMemoryImages);
+      dir.close();
+      this->reset();
+      refreshed = true;
+    }
+  };
+
+  enum FieldNames {
+    noField         = 0,
+    tapeInFs        = 1,
+    tapeInFileName  = 2,
+    tapeInPosition  = 3,
+    tapeOutFs       = 4,
+    tapeOutFileName = 5,
+    memFs           = 6,
+    memFileName     = 7,
+    tapeFastLoad    = 8,
+    memLoad         = 9,
+    snapFs          = 10,
+    snapFileName    = 11,
+    snapAction      = 12,
+    resumeMode      = 13,
+    rewindAction    = 14,
+    uartMode        = 15,
+    debugMemory     = 16,
+    debugBreak      = 17,
+    debugWatch      = 18,
+    debugDiagnostics = 19,
+    numFields       = 20 // pseudo field name
+  };
+  enum FieldType {
+    withValues,
+    withText
+  };
+  static const uint32_t maxTextFieldLen = 30;
+  struct Field {
+    uint32_t        x;
+    uint32_t        y;
+    uint32_t        length;
+    VGA3Bit::Color  background;
+    FieldType       type;
+    const char     *text;
+    char            textEdit[maxTextFieldLen + 1];
+    uint32_t        textLastChar;
+    FieldValues    *values = nullptr;
+  };
+  FieldNames firstField = tapeInFs;
+  FieldNames lastField  = rewindAction;
+
+  enum FieldMove {
+    current,
+    next,
+    prev
+  };
+
+  Field            fields[numFields];
+  FieldNames       activeField = noField;
+  TapeFsValues     tapeFsValues;
+  TapeFileNamesSd  tapeFileNamesSd;
+  TapeFileNamesInt tapeFileNamesInt;
+  TapePositionValues tapePositionValues;
+  TapeFileNamesSd  memFileNamesSd   = TapeFileNamesSd(true);
+  TapeFileNamesInt memFileNamesInt  = TapeFileNamesInt(true);
+  FixedValues      fastLoadValues   = FixedValues(onOff, 2);
+  FixedValues      memLoadValues    = FixedValues(memLoadActions, 3);
+  FixedValues      snapActionValues = FixedValues(snapshotActions, 5);
+  FixedValues      resumeValues     = FixedValues(resumeModes, 4);
+  uint32_t         resume           = 0;
+  FixedValues      rewindValues     = FixedValues(rewindActions, 5);
+  bool             rewindOn         = false;
+  uint32_t         rewindSeconds    = 0;
+  char             rewindStats[22 + 1] = "";
+  FixedValues      diagnosticsValues = FixedValues(diagnosticsModes, 5);
+  FixedValues      uartValues       = FixedValues(uartModes, 6);
+  uint32_t         diagnostics      = 0;
+  bool             memoryChanged    = false;
+  char             status[48 + 1]   = "";
+
+  void addFieldWithValues(Field &field, uint32_t x, uint32_t y, uint32_t length, FieldValues *values) {
+    field.x = x;
+    field.y = y;
+    field.length = length;
+    field.background = display.green;
+    field.values = values;
+    field.type = withValues;
+    if (values != nullptr)
+      setFieldText(field, values->getCurrent());
+    else
+      setFieldText(field, "");
+  }
+  void addFieldWithText(Field &field, uint32_t x, uint32_t y, uint32_t length, const char *text) {
+    field.x = x;
+    field.y = y;
+    field.length = length;
+    field.background = display.green;
+    field.type = withText;
+    if (text != nullptr) {
+      strncpy(field.textEdit, text, maxTextFieldLen);
+      field.textEdit[maxTextFieldLen] = 0;
+      field.textLastChar = strlen(text);
+    }
+    else {
+      field.textEdit[0] = 0;
+      field.textLastChar = 0;
+    }
+    setFieldText(field, field.textEdit);
+  }
+
+  void setFieldText(Field &field, const char *text) {
+    field.text = text;
+    refreshField(field);
+  }
+  void refreshField(Field &field) {
+    bool filling = false;
+    display.setTextColor(display.white, field.background);
+    for (uint32_t xi = 0; xi < field.length; xi++) {
+      if (!filling && field.text[xi] == 0)
+        filling = true;
+      if (filling)
+        display.drawCharAt(field.x + xi, field.y, ' ');
+      else
+        display.drawCharAt(field.x + xi, field.y, field.text[xi]);
+    }
+  }
+  void setActiveField(FieldNames fieldName) {
+    if (fieldName == noField) {
+      activeField = fieldName;
+    }
+    else if (activeField != fieldName) {
+      fields[activeField].background = display.green;
+      refreshField(fields[activeField]);
+      activeField = fieldName;
+      fields[activeField].background = display.red;
+      refreshField(fields[activeField]);
+    }
+  }
+  void gotoNextField() {
+    FieldNames nextField;
+    if (activeField == lastField)
+      nextField = firstField;
+    else
+      nextField = static_cast<FieldNames>(static_cast<uint32_t>(activeField) + 1);
+    setActiveField(nextField);
+  }
+  void updateFieldValues(FieldNames fieldName, FieldValues *values) {
+    DEBUG_PRINTF("updateFieldValues: %d\n", fieldName);
+    fields[fieldName].values = values;
+    updateFieldValue(fieldName, current);
+  }
+  void updateFieldValue(FieldNames fieldName, FieldMove move) {
+    DEBUG_PRINTF("updateFieldValue: %d\n", fieldName);
+    Field &field = fields[fieldName];
+    if (field.type != withValues)
+      return;
+    if (fieldName == tapeInPosition && move != current)
+      tapePositionValues.buildIndex();
+    FieldValues *values = fields[fieldName].values;
+    const char  *newValue = nullptr; 
+    if (values != nullptr) {
+      if (move == current)
+        newValue = values->getCurrent();
+      else if (move == next)
+        newValue = values->getNext();
+      else // if (move == prev)
+        newValue = values->getPrev();
+      setFieldText(field, newValue);
+      if (fieldName == tapeInFs) {
+        if (newValue[0] == 'I') //
+          updateFieldValues(tapeInFileName, &tapeFileNamesInt);
+        else 
+          updateFieldValues(tapeInFileName, &tapeFileNamesSd);
+      }
+      else if (fieldName == tapeInFileName) {
+        const char *fs = getFieldText(tapeInFs);
+        tapePositionValues.setFile(fs[0] == 'I' ? (FS *)&LittleFS : (FS *)&SD, newValue);
+        tapePositionValues.refresh();
+        updateFieldValues(tapeInPosition, &tapePositionValues);
+      }
+      else if (fieldName == tapeInPosition) {
+        showTapeRange();
+      }
+      else if (fieldName == memFs) {
+        if (newValue[0] == 'I')
+          updateFieldValues(memFileName, &memFileNamesInt);
+        else
+          updateFieldValues(memFileName, &memFileNamesSd);
+      }
+    }
+    else
+      setFieldText(fields[activeField], "");
+  }
+  void updateFieldText(FieldNames fieldName, uint8_t c) {
+    Field &field = fields[fieldName];
+    if (field.type != withText)
+      return;
+    if (c == 0x08) {
+      // backspace
+      DEBUG_PRINTF("updateFieldText: backspace\n", c);
+      if (field.textLastChar > 0) {
+        field.textLastChar -= 1;
+        field.textEdit[field.textLastChar] = 0;
+        setFieldText(field, field.textEdit);
+      }
+    }
+    else if (c >= 32 && c < 127 && (c != 32 || fieldName == debugBreak || fieldName == debugWatch)) {
+      DEBUG_PRINTF("updateFieldText: %c\n", c);
+      if (field.textLastChar < maxTextFieldLen && field.textLastChar < field.length) {
+        field.textEdit[field.textLastChar] = c;
+        field.textLastChar += 1;
+        setFieldText(field, field.textEdit);
+      }
+    }
+    if (fieldName == debugMemory)
+      showMemory();
+  }
+  const char *getFieldText(FieldNames fieldName) {
+    return fields[fieldName].text;
+  }
+  void showTapeRange() {
+    char text[22 + 1];
+    tapePositionValues.getRangeText(text, sizeof(text));
+    display.setTextColor(display.white, display.blue);
+    display.drawTextAt(25, 4, "                      ");
+    display.drawTextAt(25, 4, text);
+  }
+
+public:
+  enum SnapshotAction {
+    snapshotNone,
+    snapshotSave,
+    snapshotRestore,
+    snapshotRecord,
+    snapshotReplay
+  };
+
+private:
+  SnapshotAction snapshotRequest = snapshotNone;
+  FS            *snapshotFs      = &LittleFS;
+  char           snapshotFileName[maxTextFieldLen + 2];
+
+public:
+  NascomControl (NascomDisplay &display, NascomTape &tape, NascomUart &uart, NascomMemory &memory,
+                 NascomDebugger &debugger) :
+    display(display), tape(tape), uart(uart), memory(memory), debugger(debugger) {
+    self = this;
+  }
+
+  void init(bool hasSd) {
+    this->hasSd = hasSd;
+  }
+
+  static void handleVirtualKey(fabgl::VirtualKey *vk, fabgl::Keyboard &keyboard, bool down) {
+    DEBUG_PRINTF("UI: handleVirtualKey\n");
+    if (down && (*vk == fabgl::VK_TAB))
+      self->gotoNextField();
+    else if (down && (*vk == fabgl::VK_UP))
+      self->updateFieldValue(self->activeField, prev);
+    else if (down && (*vk == fabgl::VK_DOWN))
+      self->updateFieldValue(self->activeField, next);
+    else if (down) {
+      int asc = keyboard.virtualKeyToASCII(*vk);
+      if (asc != -1)
+        self->updateFieldText(self->activeField, asc);
+    }
+  }
+
+  void activate(View newView = mainView) {
+    DEBUG_PRINTF("UI: Activate\n");
+    display.setTextColor(display.white, display.blue);
+    view = newView;
+    isActive = true;
+  }
+
+  void showScreen() {
+    if (view == debugView) {
+      showDebugScreen();
+      return;
+    }
+    display.clear();
+    setActiveField(noField);
+    display.drawTextAt(0, 0, version);
+    display.drawTextAt(37, 0, buildDate);
+    display.drawTextAt(16, 0, "Nascom-2 Control");
+    display.drawTextAt(10, 2, "File System");
+    display.drawTextAt(25, 2, "File Name");
+    firstField = tapeInFs;
+#ifdef UART_BRIDGE
+    lastField = uartMode;
+#else
+    lastField = rewindAction;
+#endif
+    display.drawTextAt(1, 3, "Tape In");
+    display.drawTextAt(1, 4, "Position");
+    display.drawTextAt(1, 5, "Tape Out");
+    display.drawTextAt(1, 6, "Memory");
+    display.drawTextAt(1, 7, "Fast Load");
+    display.drawTextAt(1, 8, "Load Mem");
+    display.drawTextAt(1, 9, "Snapshot");
+    display.drawTextAt(1, 11, "Resume");
+    display.drawTextAt(25, 11, "Rewind");
+    display.drawTextAt(25, 10, rewindStats);
+    tapeFsValues.refresh();
+    addFieldWithValues(fields[tapeInFs], 10, 3, 14, &tapeFsValues);
+    tapeFileNamesInt.refresh();
+    tapeFileNamesSd.refresh();
+    addFieldWithValues(fields[tapeInFileName], 25, 3, 22, &tapeFileNamesInt);
+    tapePositionValues.setFile(&LittleFS, getFieldText(tapeInFileName));
+    tapePositionValues.refresh();
+    addFieldWithValues(fields[tapeInPosition], 10, 4, 14, &tapePositionValues);
+    showTapeRange();
+    addFieldWithValues(fields[tapeOutFs], 10, 5, 14, &tapeFsValues);
+    addFieldWithText(fields[tapeOutFileName], 25, 5, 22, "tape-out.cas");
+    memFileNamesInt.refresh();
+    memFileNamesSd.refresh();
+    addFieldWithValues(fields[memFs], 10, 6, 14, &tapeFsValues);
+    addFieldWithValues(fields[memFileName], 25, 6, 22, &memFileNamesInt);
+    fastLoadValues.refresh();
+    fastLoadValues.set(tape.getFastLoad() ? 0 : 1);
+    addFieldWithValues(fields[tapeFastLoad], 10, 7, 14, &fastLoadValues);
+    memLoadValues.refresh();
+    memLoadValues.set(0);
+    addFieldWithValues(fields[memLoad], 10, 8, 14, &memLoadValues);
+    addFieldWithValues(fields[snapFs], 10, 9, 14, &tapeFsValues);
+    addFieldWithText(fields[snapFileName], 25, 9, 22, "snapshot.nss");
+    snapActionValues.refresh();
+    snapActionValues.set(0);
+    addFieldWithValues(fields[snapAction], 10, 10, 14, &snapActionValues);
+    resumeValues.refresh();
+    resumeValues.set(resume);
+    addFieldWithValues(fields[resumeMode], 10, 11, 14, &resumeValues);
+    rewindValues.refresh();
+    rewindValues.set(rewindOn ? 1 : 0);
+    addFieldWithValues(fields[rewindAction], 32, 11, 15, &rewindValues);
+#ifdef UART_BRIDGE
+    display.drawTextAt(25, 7, "UART");
+    uartValues.refresh();
+    uartValues.set(uart.getMode());
+    addFieldWithValues(fields[uartMode], 32, 7, 15, &uartValues);
+#endif
+    display.setTextColor(display.white, display.blue);
+    display.drawTextAt(2, 12, "<F1> Exit and apply    <TAB> Next field");
+    display.drawTextAt(2, 13, "<\x0b\x5e> Cycle values     <BS>/<CHR> Edit text");
+    char stats[48 + 1];
+    tape.getCache().getStatsText(stats, sizeof(stats));
+    display.drawTextAt(2, 14, stats);
+    uint32_t lostBytes = tape.takeLostBytes();
+    if (lostBytes != 0) {
+      char msg[48 + 1];
+      snprintf(msg, sizeof(msg), "Tape write failed: %d bytes lost", lostBytes);
+      display.setTextColor(display.white, display.red);
+      display.drawTextAt(2, 15, msg);
+      display.setTextColor(display.white, display.blue);
+    }
+    else {
+      display.drawTextAt(2, 15, status);
+    }
+    status[0] = 0;
+    setActiveField(firstField);
+  }
+
+  void showMemory() {
+    uint16_t addr = strtoul(getFieldText(debugMemory), nullptr, 16) & 0xfff8;
+    display.setTextColor(display.white, display.blue);
+    for (uint32_t row = 0; row < 4; row++, addr += 8) {
+      char line[48 + 1];
+      size_t len = snprintf(line, sizeof(line), "%04X ", addr);
+      for (uint32_t bi = 0; bi < 8; bi++)
+        len += snprintf(&line[len], sizeof(line) - len, " %02X", z80::ram[(addr + bi) & 0xffff]);
+      line[len++] = ' ';
+      line[len++] = ' ';
+      for (uint32_t bi = 0; bi < 8; bi++) {
+        uint8_t c = z80::ram[(addr + bi) & 0xffff];
+        line[len++] = (c >= 0x20 && c < 0x7f) ? c : '.';
+      }
+      line[len] = 0;
+      display.drawTextAt(1, 8 + row, line);
+    }
+  }
+  void showDebugScreen() {
+    char text[48 + 1];
+    display.clear();
+    setActiveField(noField);
+    firstField = debugMemory;
+    lastField = debugDiagnostics;
+    display.drawTextAt(16, 0, "Nascom-2 Debug");
+    debugger.getStopText(text, sizeof(text));
+    display.drawTextAt(1, 2, text);
+    using namespace z80;
+    uint16_t af = z80::af[af_sel];
+    snprintf(text, sizeof(text), "AF %04X  BC %04X  DE %04X  HL %04X  %c%c-%c-%c%c%c",
+             af, regs[regs_sel].bc, regs[regs_sel].de, regs[regs_sel].hl,
+             (af & FLAG_S) ? 'S' : '.', (af & FLAG_Z) ? 'Z' : '.', (af & FLAG_H) ? 'H' : '.',
+             (af & FLAG_P) ? 'P' : '.', (af & FLAG_N) ? 'N' : '.', (af & FLAG_C) ? 'C' : '.');
+    display.drawTextAt(1, 4, text);
+    snprintf(text, sizeof(text), "AF'%04X  BC'%04X  DE'%04X  HL'%04X",
+             z80::af[1 - af_sel], regs[1 - regs_sel].bc, regs[1 - regs_sel].de, regs[1 - regs_sel].hl);
+    display.drawTextAt(1, 5, text);
+    snprintf(text, sizeof(text), "IX %04X  IY %04X  SP %04X  PC %04X  I %02X  %s",
+             ix, iy, sp, z80::pc, hreg(ir), (IFF & 1) ? "EI" : "DI");
+    display.drawTextAt(1, 6, text);
+    display.drawTextAt(1, 7, "Memory");
+    display.drawTextAt(1, 12, "Break");
+    display.drawTextAt(1, 13, "Watch");
+    display.drawTextAt(25, 7, "Diagnostics");
+    snprintf(text, sizeof(text), "%04X", z80::pc);
+    addFieldWithText(fields[debugMemory], 8, 7, 5, text);
+    showMemory();
+    debugger.getBreakpointsText(text, sizeof(text));
+    addFieldWithText(fields[debugBreak], 8, 12, 39, text);
+    debugger.getWatchpointsText(text, sizeof(text));
+    addFieldWithText(fields[debugWatch], 8, 13, 39, text);
+    diagnosticsValues.refresh();
+    diagnosticsValues.set(diagnostics);
+    addFieldWithValues(fields[debugDiagnostics], 37, 7, 10, &diagnosticsValues);
+    display.setTextColor(display.white, display.blue);
+    display.drawTextAt(2, 14, "<F1> Continue  <TAB> Next field  <BS> Delete");
+    display.drawTextAt(2, 15, status);
+    status[0] = 0;
+    setActiveField(firstField);
   }
 
   void deactivate() {
     DEBUG_PRINTF("UI: Deactivate\n");
-    isActive = false;
-    display.clearCache();
-    display.setTextColor(display.white, display.black);
+    if (view == debugView) {
+      if (!debugger.setBreakpoints(getFieldText(debugBreak)))
+        setStatus("Breakpoints: Syntax error");
+      if (!debugger.setWatchpoints(getFieldText(debugWatch)))
+        setStatus("Watchpoints: Syntax error");
+      for (uint32_t mi = 0; mi < sizeof(diagnosticsModes)/sizeof(diagnosticsModes[0]); mi++) {
+        if (getFieldText(debugDiagnostics) == diagnosticsModes[mi])
+          diagnostics = mi;
+      }
+      isActive = false;
+      display.clearCache();
+      display.setTextColor(display.white, display.black);
+      return;
+    }
+    // The CPU loop runs again as soon as isActive is cleared, and reads the requests once, so
+    // everything is set first
     const char *fs   = getFieldText(tapeInFs);
     const char *name = getFieldText(tapeInFileName);
     DEBUG_PRINTF("tapeInFs: %s\n", fs);
@@ -736,454 +2291,3485 @@ public:
     if (fs[0] == 'I')
       tape.setInputFile(&LittleFS, name);
     else
-      tape.setInputFile(&SD, name);
+      tape.setInputFile(&SD, name);
+    tape.setInputOffset(tapePositionValues.getOffset());
+
+    fs   = getFieldText(tapeOutFs);
+    name = getFieldText(tapeOutFileName);
+    DEBUG_PRINTF("tapeOutFs: %s\n", fs);
+    DEBUG_PRINTF("tapeOutFileName: %s\n", name);
+    if (fs[0] == 'I')
+      tape.setOutputFile(&LittleFS, name);
+    else
+      tape.setOutputFile(&SD, name);
+
+    tape.setFastLoad(strcmp(getFieldText(tapeFastLoad), "On") == 0);
+#ifdef UART_BRIDGE
+    for (uint32_t mi = 0; mi < sizeof(uartModes)/sizeof(uartModes[0]); mi++) {
+      if (getFieldText(uartMode) == uartModes[mi])
+        uart.setMode((NascomUart::Mode)mi);
+    }
+#endif
+
+    const char *action = getFieldText(memLoad);
+    if (strcmp(action, memLoadActions[0]) != 0) {
+      loadMemory(getFieldText(memFs), getFieldText(memFileName), action == memLoadActions[2]);
+    }
+
+    for (uint32_t mi = 0; mi < sizeof(resumeModes)/sizeof(resumeModes[0]); mi++) {
+      if (getFieldText(resumeMode) == resumeModes[mi])
+        resume = mi;
+    }
+
+    // "Back n s" leaves rewind on
+    const char *rewindText = getFieldText(rewindAction);
+    rewindOn = rewindText != rewindActions[0];
+    rewindSeconds = 0;
+    if (strncmp(rewindText, "Back ", 5) == 0)
+      rewindSeconds = atoi(&rewindText[5]);
+
+    // The snapshot is taken by the CPU loop, between two instructions
+    action = getFieldText(snapAction);
+    name   = getFieldText(snapFileName);
+    if (action != snapshotActions[0] && name[0] != 0) {
+      snprintf(snapshotFileName, sizeof(snapshotFileName), "%s%s", name[0] == '/' ? "" : "/", name);
+      snapshotFs = getFieldText(snapFs)[0] == 'I' ? (FS *)&LittleFS : (FS *)&SD;
+      for (uint32_t ai = 1; ai < sizeof(snapshotActions)/sizeof(snapshotActions[0]); ai++) {
+        if (action == snapshotActions[ai])
+          snapshotRequest = (SnapshotAction)ai;
+      }
+    }
+    isActive = false;
+    display.clearCache();
+    display.setTextColor(display.white, display.black);
+  }
+  SnapshotAction takeSnapshotRequest(FS **fs, const char **fileName) {
+    SnapshotAction action = snapshotRequest;
+    snapshotRequest = snapshotNone;
+    *fs = snapshotFs;
+    *fileName = snapshotFileName;
+    return action;
+  }
+  // Index into resumeModes, which are in NascomResume::Mode order
+  uint32_t getResumeMode() {
+    return resume;
+  }
+  void setResumeMode(uint32_t mode) {
+    resume = mode;
+  }
+  // Index into diagnosticsModes: Off, Profile, Op stats, Trace, All
+  uint32_t getDiagnostics() {
+    return diagnostics;
+  }
+  void setDiagnostics(uint32_t mode) {
+    diagnostics = mode;
+  }
+  void setRewind(bool on, const char *stats) {
+    rewindOn = on;
+    strncpy(rewindStats, stats, sizeof(rewindStats) - 1);
+    rewindStats[sizeof(rewindStats) - 1] = 0;
+  }
+  // Returns whether rewind is on, and the number of seconds to go back
+  bool takeRewindRequest(uint32_t *seconds) {
+    *seconds = rewindSeconds;
+    rewindSeconds = 0;
+    return rewindOn;
+  }
+  // True if the RAM was loaded since the last call
+  bool takeMemoryChanged() {
+    bool changed = memoryChanged;
+    memoryChanged = false;
+    return changed;
+  }
+  // Shown on the status line next time the control screen is shown
+  void setStatus(const char *text) {
+    strncpy(status, text, sizeof(status) - 1);
+    status[sizeof(status) - 1] = 0;
+  }
+
+  void loadMemory(const char *fs, const char *name, bool run) {
+    char fileName[40];
+    if (name[0] == 0)
+      return;
+    snprintf(fileName, sizeof(fileName), "%s%s", name[0] == '/' ? "" : "/", name);
+    uint32_t start = millis();
+    bool ok = memory.fileLoad(fs[0] == 'I' ? (FS *)&LittleFS : (FS *)&SD, fileName, false);
+    uint32_t ms = millis() - start;
+    DEBUG_PRINTF("loadMemory: %s: %s in %d ms\n", fileName, ok ? "Loaded" : "Failed", ms);
+    if (!ok && memory.getLoadErrors() != 0)
+      snprintf(status, sizeof(status), "%s: %d bad lines, first %d", name, memory.getLoadErrors(), memory.getFirstErrorLine());
+    else if (!ok)
+      snprintf(status, sizeof(status), "%s: Load failed", name);
+    else if (run)
+      snprintf(status, sizeof(status), "%s: Loaded, run at %04X", name, memory.getLoadStart());
+    else
+      snprintf(status, sizeof(status), "%s: Loaded at %04X", name, memory.getLoadStart());
+    if (ok && run) {
+      z80::pc = memory.getLoadStart();
+    }
+    memoryChanged = true;
+  }
+
+  bool getIsActive() {
+    return isActive;
+  }
+  bool getHasSd() {
+    return hasSd;
+  }
+};
+NascomControl *NascomControl::self = nullptr;
+const char    *NascomControl::onOff[2] = {"On", "Off"};
+const char    *NascomControl::memLoadActions[3] = {"No", "Load", "Load and run"};
+const char    *NascomControl::snapshotActions[5] = {"No", "Save", "Restore", "Record", "Replay"};
+const char    *NascomControl::resumeModes[4] = {"Off", "On F1", "Every minute", "Every 5 min"};
+const char    *NascomControl::diagnosticsModes[5] = {"Off", "Profile", "Op stats", "Trace", "All"};
+const char    *NascomControl::rewindActions[5] = {"Off", "On", "Back 5 s", "Back 10 s", "Back 30 s"};
+const char    *NascomControl::uartModes[6] = {"Tape", "Serial", "Serial 300", "Serial 1200", "Serial 2400", "Serial 9600"};
+bool           NascomControl::hasSd = false;
+
+// Nascom keyboard map.  Used to provide simulated input from keyboard
+class NascomKeyboardMap {
+  // Encoding: csrrrccc
+  // c   = CTRL
+  // s   = SHIFT
+  // rrr = row
+  // ccc = col
+  #define NK_MAKE(row, col) ((row) << 3 | (col))
+  #define NK_ROW(key)       (((key) & 0x38) >> 3)
+  #define NK_COL(key)       ((key) & 0x07)
+  #define NK_SHIFT_MASK     0x40
+  #define NK_CTRL_MASK      0x80
+  #define NK_BASE(key)      ((key) & 0x3f)
+  #define NK_HAS_SHIFT(key) (((key) & NK_SHIFT_MASK) != 0)
+  #define NK_HAS_CTRL(key)  (((key) & NK_CTRL_MASK) != 0)
+
+  #define NK_NONE           NK_MAKE(7, 7)
+  #define NK_UP             NK_MAKE(1, 6)
+  #define NK_DOWN           NK_MAKE(3, 6)
+  #define NK_LEFT           NK_MAKE(2, 6)
+  #define NK_RIGHT          NK_MAKE(4, 6)
+  #define NK_SHIFT          NK_MAKE(0, 4)
+  #define NK_CTRL           NK_MAKE(0, 3)
+  #define NK_GRAPH          NK_MAKE(5, 6)
+  #define NK_SPACE          NK_MAKE(7, 4)
+  #define NK_ENTER          NK_MAKE(0, 1)
+  #define NK_0              NK_MAKE(6, 2)
+  #define NK_2              NK_MAKE(6, 3)
+  #define NK_A              NK_MAKE(4, 4)
+  #define NK_B              NK_MAKE(1, 1)
+  #define NK_C              NK_MAKE(7, 3)
+  #define NK_D              NK_MAKE(2, 3)
+  #define NK_E              NK_MAKE(3, 3)
+  #define NK_F              NK_MAKE(1, 3)
+  #define NK_G              NK_MAKE(7, 0)
+  #define NK_H              NK_MAKE(1, 0)
+  #define NK_I              NK_MAKE(4, 5)
+  #define NK_J              NK_MAKE(2, 0)
+  #define NK_K              NK_MAKE(3, 0)
+  #define NK_L              NK_MAKE(4, 0)
+  #define NK_M              NK_MAKE(3, 1)
+  #define NK_N              NK_MAKE(2, 1)
+  #define NK_O              NK_MAKE(5, 5)
+  #define NK_P              NK_MAKE(6, 5)
+  #define NK_Q              NK_MAKE(5, 4)
+  #define NK_R              NK_MAKE(7, 5)
+  #define NK_S              NK_MAKE(3, 4)
+  #define NK_T              NK_MAKE(1, 5)
+  #define NK_U              NK_MAKE(3, 5)
+  #define NK_V              NK_MAKE(7, 1)
+  #define NK_W              NK_MAKE(4, 3)
+  #define NK_X              NK_MAKE(1, 4)
+  #define NK_Y              NK_MAKE(2, 5)
+  #define NK_Z              NK_MAKE(2, 4)
+  #define NK_LEFTBRACKET    NK_MAKE(6, 6)
+  #define NK_RIGHTBRACKET   NK_MAKE(7, 6)
+  
+  static const uint32_t mapSize = 8;
+  uint8_t               map[mapSize];
+  uint8_t               mapSnapshot[mapSize];
+  bool                  mapIsUpdating = false;
+  TaskHandle_t          mainTaskId;
+
+  static constexpr char encoding[mapSize][9] = {
+    /*        _   6    5   4   3   2   1    0 */
+    /* 0 */  "_" "\t" "@" "_" "_" "-" "\r" "\010",
+    /* 1 */  "_" "_"  "T" "X" "F" "5" "B"  "H",
+    /* 2 */  "_" "_"  "Y" "Z" "D" "6" "N"  "J",
+    /* 3 */  "_" "_"  "U" "S" "E" "7" "M"  "K",
+    /* 4 */  "_" "_"  "I" "A" "W" "8" ","  "L",
+    /* 5 */  "_" "_"  "O" "Q" "3" "9" "."  ";",
+    /* 6 */  "_" "["  "P" "1" "2" "0" "/"  ":",
+    /* 7 */  "_" "]"  "R" " " "C" "4" "V"  "G",
+    };
+  uint32_t mapIndex = 0;
+
+  void set(uint8_t row, uint8_t col, bool down) {
+    if (down)
+      map[row] |= 1 << col;
+    else
+      map[row] &= ~(1 << col);
+  }
+
+  uint8_t getNk(uint8_t ascChar) {
+    if (ascChar == '_') {
+      // '_' is used as an 'unknown'
+      return NK_NONE;
+    }
+    for (uint32_t row = 0; row < mapSize; row++) {
+      for (uint32_t col = 0; col < 7; col++) {
+        if (encoding[row][7-col] == ascChar) {
+          return NK_MAKE(row, col);
+        }
+      }
+    }
+    return NK_NONE;
+  }
+
+  #define ___ " " // Dummy
+  static constexpr const char *keys          = ";" ":" "["    "]" "-" "," "." "/"    "0" "1" "2"  "3" "4" "5" "6" "7" "8" "9" " ";
+  static constexpr const char *keysShift     = "+" "*" "\\"   "_" "=" "<" ">" "?"    "^" "!" "\"" "#" "$" "%" "&" "'" "(" ")" ___;
+  static constexpr const char *keysCtrl      = "{" ___ "\033" ___ ___ ___ ___ ___    ___ ___ ___  ___ ___ ___ ___ ___ ___ ___ "`";
+  static constexpr const char *keysShiftCtrl = ___ ___ ___    ___ "}" "|" "~" "\177" ___ ___ ___  ___ ___ ___ ___ ___ ___ ___ ___;
+
+  static constexpr const uint8_t ascNkMap[32] = {
+    NK_SPACE|NK_CTRL_MASK, NK_A|NK_CTRL_MASK, NK_B|NK_CTRL_MASK, NK_C|NK_CTRL_MASK,           //  0 -  3
+    NK_D|NK_CTRL_MASK,     NK_E|NK_CTRL_MASK, NK_F|NK_CTRL_MASK, NK_G|NK_CTRL_MASK,           //  4 -  7
+    NK_H|NK_CTRL_MASK,     NK_I|NK_CTRL_MASK, NK_J|NK_CTRL_MASK, NK_K|NK_CTRL_MASK,           //  8 - 11
+    NK_L|NK_CTRL_MASK,     NK_M|NK_CTRL_MASK, NK_N|NK_CTRL_MASK, NK_O|NK_CTRL_MASK,           // 12 - 15
+    NK_P|NK_CTRL_MASK,     NK_Q|NK_CTRL_MASK, NK_R|NK_CTRL_MASK, NK_S|NK_CTRL_MASK,           // 16 - 19
+    NK_T|NK_CTRL_MASK,     NK_U|NK_CTRL_MASK, NK_V|NK_CTRL_MASK, NK_W|NK_CTRL_MASK,           // 20 - 23
+    NK_X|NK_CTRL_MASK,     NK_Y|NK_CTRL_MASK, NK_Z|NK_CTRL_MASK, NK_LEFTBRACKET|NK_CTRL_MASK, // 24 - 27
+    NK_LEFTBRACKET|NK_SHIFT_MASK|NK_CTRL_MASK, NK_RIGHTBRACKET|NK_CTRL_MASK, NK_0|NK_SHIFT_MASK|NK_CTRL_MASK, NK_RIGHTBRACKET|NK_SHIFT_MASK|NK_CTRL_MASK // 28 - 31
+  };
+
+  uint8_t getNascomKey(uint8_t ascChar) {
+    // Handle upper/lower case letters.
+    // Lowercase should be mapped to uppercase and vice versa
+    if (isupper(ascChar) || ascChar == '@') {
+      // for some reason '@' requires SHIFT
+      return getNk(ascChar) | NK_SHIFT_MASK;
+    }
+    else if (islower(ascChar)) {
+      return getNk(toupper(ascChar));
+    }
+
+    // Check if ascChar is in the keyboard map
+    uint8_t nk = getNk(ascChar);
+    if (nk != NK_NONE) {
+      return nk;
+    }
+    // Check if ascChar is in the set of chars that must use SHIFT and be remapped
+    for (uint32_t i = 0; keysShift[i] != 0; i++) {
+      if (keysShift[i] == ascChar) {
+        return getNk(keys[i]) | NK_SHIFT_MASK;
+      }
+    }
+    // Check if ascChar is in the set of chars that must use CTRL and be remapped
+    for (uint32_t i = 0; keysCtrl[i] != 0; i++) {
+      if (keysCtrl[i] == ascChar) {
+        return getNk(keys[i]) | NK_CTRL_MASK;
+      }
+    }
+    // Check if ascChar is in the set of chars that must use SHIFT+CTRL and be remapped
+    for (uint32_t i = 0; keysShiftCtrl[i] != 0; i++) {
+      if (keysShiftCtrl[i] == ascChar) {
+        return getNk(keys[i]) | NK_SHIFT_MASK | NK_CTRL_MASK;
+      }
+    }
+    if (ascChar < 32) {
+      return ascNkMap[ascChar];
+    }
+    return NK_NONE;
+  }
+
+public:
+  struct State {
+    uint8_t  map[mapSize];
+    uint8_t  mapSnapshot[mapSize];
+    uint32_t mapIndex;
+  };
+  NascomKeyboardMap() {
+    mainTaskId = xTaskGetCurrentTaskHandle();
+  }
+  void getState(State &state) {
+    memcpy(state.map, map, mapSize);
+    memcpy(state.mapSnapshot, mapSnapshot, mapSize);
+    state.mapIndex = mapIndex;
+  }
+  void setState(const State &state) {
+    memcpy(map, state.map, mapSize);
+    memcpy(mapSnapshot, state.mapSnapshot, mapSize);
+    mapIndex = state.mapIndex < mapSize ? state.mapIndex : 0;
+  }
+  void reset() {
+    memset(map, 0, sizeof(map));
+  }
+
+  // Returns NK_NONE if there is no key for ascChar
+  uint8_t toNascomKey(uint8_t ascChar) {
+    return getNascomKey(ascChar);
+  }
+  bool setAsciiChar(uint8_t ascChar, bool down) {
+    uint8_t nk = getNascomKey(ascChar);
+    //DEBUG_PRINTF("nk: %02x (%d, %d) %s %s\n", nk, NK_ROW(nk), NK_COL(nk), NK_HAS_SHIFT(nk) ? "SHIFT" : "", NK_HAS_CTRL(nk) ? "CTRL" : "");
+    if (nk != NK_NONE) {
+      mapIsUpdating = true;
+      setKeyAll(nk, down);
+      mapIsUpdating = false;
+      return true;
+    }
+    return false;
+  }
+
+  void setKey(uint8_t nk, bool down) {
+    set(NK_ROW(nk), NK_COL(nk), down);
+  }
+
+  void setKeyAll(uint8_t nk, bool down) {
+    if (NK_HAS_SHIFT(nk)) {
+      setKey(NK_SHIFT, down);
+    }
+    if (NK_HAS_CTRL(nk)) {
+      setKey(NK_CTRL, down);
+    }
+    setKey(nk, down);
+  }
+  
+  void rewind() {
+    mapIndex = 0;
+    if (!mapIsUpdating) {
+      memcpy(mapSnapshot, map, mapSize);
+    }
+  }
+
+  void step() {
+    mapIndex += 1;
+    if (mapIndex == mapSize)
+      mapIndex = 0;
+  }
+
+  uint8_t current() {
+    return mapSnapshot[mapIndex];
+  }
+
+  uint32_t getMapIndex() {
+    return mapIndex;
+  }
+
+  void dump() {
+    for (uint8_t row = 0; row < mapSize; row++) {
+      uint8_t rowValue = map[row];
+      char rowValueStr[9];
+      for (uint8_t i = 0; i < 8; i++) {
+        rowValueStr[i] = (rowValue & (0x80 >> i)) ? '1' : '0';
+      }
+      rowValueStr[8] = 0;
+      DEBUG_PRINTF("%s\n", rowValueStr);
+    }
+  }
+};
+constexpr char NascomKeyboardMap::encoding[mapSize][9];
+constexpr uint8_t NascomKeyboardMap::ascNkMap[32];
+
+// Nascom keyboard
+class NascomKeyboard {
+public:
+  // Direct: Key events update the map when they arrive
+  // Queued: Key events are queued and applied between frames by the CPU task
+  // Ignored: Key events are dropped, e.g. while input is replayed
+  enum InputMode {
+    inputDirect,
+    inputQueued,
+    inputIgnored
+  };
+
+private:
+  fabgl::Keyboard        keyboard;
+  NascomKeyboardMap      map;
+  NascomControl         &control;
+  InputMode              inputMode = inputDirect;
+  static const uint32_t  queueSize = 32;
+  uint16_t               queue[queueSize];
+  volatile uint32_t      queueHead = 0;
+  volatile uint32_t      queueTail = 0;
+  bool                   shiftDown = false;
+  bool                   ctrlDown  = false;
+  const char            *startText;
+  uint32_t               startTextIndex = 0;
+  bool                   startTextKeyDown = false;
+  uint8_t                startTextChar;
+  uint8_t                pressedKey = NK_NONE;
+  bool                   pressedKeyDown = false;
+  volatile bool          benchmarkRequest = false;
+  volatile bool          conformanceRequest = false;
+  volatile bool          lockstepRequest = false;
+  static NascomKeyboard *self;
+
+  // Single producer (keyboard task), single consumer (CPU task)
+  void keyEvent(uint8_t nk, bool down) {
+    if (inputMode == inputDirect) {
+      map.setKeyAll(nk, down);
+    }
+    else if (inputMode == inputQueued) {
+      uint32_t next = (queueHead + 1) % queueSize;
+      if (next == queueTail) {
+        DEBUG_PRINTF("NascomKeyboard: Queue full\n");
+        return;
+      }
+      queue[queueHead] = nk | (down ? 0x100 : 0);
+      queueHead = next;
+    }
+  }
+  bool asciiEvent(uint8_t ascChar, bool down) {
+    if (inputMode == inputDirect)
+      return map.setAsciiChar(ascChar, down);
+    uint8_t nk = map.toNascomKey(ascChar);
+    if (nk == NK_NONE)
+      return false;
+    keyEvent(nk, down);
+    return true;
+  }
+
+  static void handleVirtualKey(fabgl::VirtualKey *vk, bool down) {
+    DEBUG_PRINTF("%s (%s)\n", self->keyboard.virtualKeyToString(*vk), down ? "down" : "up");
+    if (down && *vk == fabgl::VK_F1) {
+      if (!self->control.getIsActive()) {
+        self->control.activate();
+      }
+      else {
+        self->control.deactivate();
+      }
+    }
+    else if (down && *vk == fabgl::VK_F2 && !self->control.getIsActive()) {
+      self->control.activate(NascomControl::debugView);
+    }
+    else if (down && *vk == fabgl::VK_F3 && !self->control.getIsActive()) {
+      self->benchmarkRequest = true;
+    }
+    else if (down && *vk == fabgl::VK_F4 && !self->control.getIsActive()) {
+      self->conformanceRequest = true;
+    }
+    else if (down && *vk == fabgl::VK_F5 && !self->control.getIsActive()) {
+      self->lockstepRequest = true;
+    }
+    if (self->control.getIsActive()) {
+      self->control.handleVirtualKey(vk, self->keyboard, down);
+      return;
+    }
+    uint8_t shiftCtrlMask = 0;
+    if (*vk == fabgl::VK_LSHIFT || *vk == fabgl::VK_RSHIFT) {
+      self->shiftDown = down;
+    }
+    if (*vk == fabgl::VK_LCTRL || *vk == fabgl::VK_RCTRL) {
+      self->ctrlDown = down;
+    }
+    if (self->shiftDown) {
+      shiftCtrlMask = NK_SHIFT_MASK;
+    }
+    if (self->ctrlDown) {
+      shiftCtrlMask |= NK_CTRL_MASK;
+    }
+    bool mapUpdated = true;
+    // Handle special non-ascii characters
+    switch (*vk) {
+      case fabgl::VK_UP:
+        self->keyEvent(NK_UP | shiftCtrlMask, down);
+        break;
+      case fabgl::VK_DOWN:
+        self->keyEvent(NK_DOWN | shiftCtrlMask, down);
+        break;
+      case fabgl::VK_LEFT:
+        self->keyEvent(NK_LEFT | shiftCtrlMask, down);
+        break;
+      case fabgl::VK_RIGHT:
+        self->keyEvent(NK_RIGHT | shiftCtrlMask, down);
+        break;
+      case fabgl::VK_RETURN:
+        self->keyEvent(NK_ENTER | shiftCtrlMask, down);
+        break;
+      default:
+        mapUpdated = false;
+        break;
+    }
+    // Handle ascii characters
+    if (!mapUpdated) {
+      int asc = self->keyboard.virtualKeyToASCII(*vk);
+      DEBUG_PRINTF("ASCII: 0x%02x\n", asc);
+      if (asc != -1)
+        mapUpdated = self->asciiEvent(asc, down);
+    }
+    if (mapUpdated) {
+      //DEBUG_PRINTF("Nascom Keyboard Map\n");
+      //self->map.dump();
+    }
+  }
+public:
+  struct State {
+    NascomKeyboardMap::State map;
+    uint32_t                 startTextIndex;
+    uint8_t                  startTextKeyDown;
+    uint8_t                  startTextChar;
+  };
+  NascomKeyboard(NascomControl &control, const char *startText = "") : control(control), startText(startText) {
+    self = this;
+  }
+  void setInputMode(InputMode mode) {
+    inputMode = mode;
+    queueTail = queueHead;
+  }
+  // Next queued key event.  Called by the CPU task
+  bool takeKeyEvent(uint8_t *nk, bool *down) {
+    if (queueTail == queueHead)
+      return false;
+    uint16_t event = queue[queueTail];
+    queueTail = (queueTail + 1) % queueSize;
+    *nk = event & 0xff;
+    *down = (event & 0x100) != 0;
+    return true;
+  }
+  void applyKeyEvent(uint8_t nk, bool down) {
+    map.setKeyAll(nk, down);
+  }
+  // Types text like the start text, one key per keyboard scan.  text must stay valid
+  // until isTyping() is false
+  void type(const char *text) {
+    if (startTextKeyDown)
+      map.setAsciiChar(startTextChar, false);
+    startText = text;
+    startTextIndex = 0;
+    startTextKeyDown = false;
+  }
+  bool isTyping() {
+    return startText[startTextIndex] != 0 || pressedKey != NK_NONE;
+  }
+  // Presses and releases a Nascom key (NK_*, with the SHIFT and CTRL masks) during the next
+  // keyboard scans, after any typed text
+  void press(uint8_t nk) {
+    if (pressedKeyDown)
+      map.setKeyAll(pressedKey, false);
+    pressedKey = nk;
+    pressedKeyDown = false;
+  }
+  // F3 was pressed
+  bool takeBenchmarkRequest() {
+    bool request = benchmarkRequest;
+    benchmarkRequest = false;
+    return request;
+  }
+  // F4 was pressed
+  bool takeConformanceRequest() {
+    bool request = conformanceRequest;
+    conformanceRequest = false;
+    return request;
+  }
+  // F5 was pressed
+  bool takeLockstepRequest() {
+    bool request = lockstepRequest;
+    lockstepRequest = false;
+    return request;
+  }
+  void getState(State &state) {
+    map.getState(state.map);
+    state.startTextIndex = startTextIndex;
+    state.startTextKeyDown = startTextKeyDown;
+    state.startTextChar = startTextChar;
+  }
+  void setState(const State &state) {
+    map.setState(state.map);
+    startTextIndex = state.startTextIndex <= strlen(startText) ? state.startTextIndex : strlen(startText);
+    startTextKeyDown = state.startTextKeyDown;
+    startTextChar = state.startTextChar;
+  }
+  void init() {
+    keyboard.begin(Pins::kbdClock, Pins::kbdData, true, false);
+    keyboard.onVirtualKey = handleVirtualKey;
+  }
+  fabgl::Keyboard &getKeyboard() {
+    return keyboard;
+  }
+  void mapRewind() {
+    if (startText[startTextIndex] != 0) {
+      if (startTextKeyDown) {
+        map.setAsciiChar(startTextChar, false);
+        startTextKeyDown = false;
+        startTextIndex += 1;
+      }
+      else {
+        startTextChar = startText[startTextIndex];
+        if (islower(startTextChar))
+          startTextChar = toupper(startTextChar);
+        else if (isupper(startTextChar))
+          startTextChar = tolower(startTextChar);
+        map.setAsciiChar(startTextChar, true);
+        startTextKeyDown = true;
+      }
+    }
+    else if (pressedKey != NK_NONE) {
+      map.setKeyAll(pressedKey, !pressedKeyDown);
+      if (pressedKeyDown)
+        pressedKey = NK_NONE;
+      pressedKeyDown = !pressedKeyDown;
+    }
+    map.rewind();
+  }
+  void mapStep() {
+    map.step();
+  }
+  uint8_t mapCurrent() {
+    return map.current();
+  }
+
+  uint32_t mapGetIndex() {
+    return map.getMapIndex();
+  }
+};
+NascomKeyboard *NascomKeyboard::self = nullptr;
+
+// Nascom IO logic
+class NascomIo {
+  // Port0 Out/In bits
+  // -----------------
+  //   Bit  Out                        In
+  //   7:   ??                         ??
+  //   6:   ??                         Keyboard S6
+  //   5:   ??                         Keyboard S3
+  //   4:   Tape LED                   Keyboard S5
+  //   3:   Single step                Keyboard S4
+  //   2:   ??                         Keyboard S0
+  //   1:   Keyboard index reset       Keyboard S2
+  //   0:   Keyboard index increment   Keyboard S1
+  #define P0_OUT_KEYBOARD_INCREMENT 1 << 0
+  #define P0_OUT_KEYBOARD_RESET     1 << 1
+  #define P0_OUT_TAPE_LED           1 << 4
+  #define P2_IN_UART_TBR_EMPTY      1 << 6
+  #define P2_IN_UART_DATA_READY     1 << 7
+  // Not a Nascom port.  Console output of the CP/M programs run by NascomConformance
+  #define CONSOLE_PORT              0xff
+
+  NascomKeyboard &keyboard;
+  NascomTape     &tape;
+  NascomUart     &uart;
+  uint8_t        p0LastValue;
+  Print          *console = nullptr;
+public:
+  NascomIo(NascomKeyboard &keyboard, NascomTape &tape, NascomUart &uart) :
+    keyboard(keyboard), tape(tape), uart(uart), p0LastValue(0) {}
+  // Output to CONSOLE_PORT goes to console while it is set
+  void setConsole(Print *console) {
+    this->console = console;
+  }
+  uint8_t getP0LastValue() {
+    return p0LastValue;
+  }
+  void setP0LastValue(uint8_t value) {
+    p0LastValue = value;
+  }
+  uint8_t in(uint32_t port) {
+    //DEBUG_PRINTF("in(%d) called\n", port);
+    switch (port) {
+      case 0: {
+        uint8_t val = keyboard.mapCurrent();
+        return ~val;
+      }
+      case 1:
+        if (uart.getActive())
+          return uart.read();
+        return tape.readByte();
+      case 2: {
+          if (uart.getActive()) {
+            return (uart.getTransmitReady() ? P2_IN_UART_TBR_EMPTY : 0) |
+                   (uart.getDataReady() ? P2_IN_UART_DATA_READY : 0);
+          }
+          // UART Status: Always ready to send data. Only provide input data if led is on
+          return P2_IN_UART_TBR_EMPTY | (tape.getLed() ? P2_IN_UART_DATA_READY : 0);
+      }
+      default:
+        return 0;
+    }
+  }
+  void out(uint32_t port, uint8_t value) {
+    //DEBUG_PRINTF("out(%d, %d) called \n", port, value);
+    switch (port) {
+      case 0: {
+        uint8_t zero2One = ~p0LastValue & value;
+        uint8_t one2Zero = p0LastValue & ~value;
+        if ((value & P0_OUT_KEYBOARD_RESET) != 0) {
+          keyboard.mapRewind();
+        }
+        else if ((zero2One & P0_OUT_KEYBOARD_INCREMENT) != 0) {
+          //DEBUG_PRINTF("out(0): value: %02x, zero2One: %02x\n", value, zero2One);
+          keyboard.mapStep();
+        }
+        if ((zero2One & P0_OUT_TAPE_LED) != 0) {
+          tape.setLed(true);
+          //tape.openFiles();
+          //Note: files are opened on demand during the first read or write operation
+        }
+        if ((one2Zero & P0_OUT_TAPE_LED) != 0) {
+          tape.setLed(false);
+          tape.closeFiles();
+        }
+        p0LastValue = value;
+        break;
+      }
+      case 1:
+        if (uart.getActive())
+          uart.write(value);
+        else
+          tape.writeByte(value);
+        break;
+      case CONSOLE_PORT:
+        if (console != nullptr)
+          console->write(value);
+        break;
+      default:
+        break;
+    }
+  }
+};
+
+// Nascom machine snapshot
+// Saves and restores the complete machine state: The Z80 registers, the RAM, the keyboard
+// scan state, the port 0 latch, and the tape files, position and LED.
+//
+// Snapshot file format (.nss):
+//   Header            Magic "NSS1", version, header size, CRC-32 and the machine state
+//   Packed RAM        The 64K RAM, run-length encoded
+// The CRC-32 covers the whole file with the CRC field set to 0.
+//
+// The RAM is packed in PackBits style, since most of it is usually zero:
+//   00-7F             n+1 literal bytes follow
+//   80-FF             The next byte is repeated n-0x80+3 times
+
+class NascomSnapshot {
+public:
+  struct CpuState {
+    uint16_t af[2];
+    uint16_t bc[2];
+    uint16_t de[2];
+    uint16_t hl[2];
+    uint16_t ir;
+    uint16_t ix;
+    uint16_t iy;
+    uint16_t sp;
+    uint16_t pc;
+    uint16_t iff;
+    uint8_t  afSel;
+    uint8_t  regsSel;
+    uint8_t  reserved[2];
+  };
+  // Everything but the RAM
+  struct MachineState {
+    CpuState               cpu;
+    NascomKeyboard::State  keyboard;
+    NascomTape::State      tape;
+    uint8_t                p0LastValue;
+    uint8_t                reserved[3];
+  };
+
+private:
+  static const uint32_t magic   = 0x3153534e; // "NSS1"
+  static const uint16_t version = 1;
+  static const uint32_t ramSize = MEMSIZE*1024;
+
+  struct Header {
+    uint32_t     magic;
+    uint16_t     version;
+    uint16_t     headerSize;
+    uint32_t     crc;
+    uint32_t     packedSize;
+    MachineState state;
+  };
+
+  NascomKeyboard &keyboard;
+  NascomIo       &io;
+  NascomTape     &tape;
+  const char     *error = "";
+
+  // Returns the packed size. Only counts when dst is nullptr
+  static uint32_t pack(const uint8_t *src, uint32_t srcLen, uint8_t *dst) {
+    uint32_t si = 0;
+    uint32_t di = 0;
+    while (si < srcLen) {
+      uint32_t run = 1;
+      while (si + run < srcLen && run < 130 && src[si + run] == src[si])
+        run++;
+      if (run >= 3) {
+        if (dst != nullptr) {
+          dst[di] = 0x80 + run - 3;
+          dst[di + 1] = src[si];
+        }
+        di += 2;
+        si += run;
+      }
+      else {
+        uint32_t start = si;
+        uint32_t len = 0;
+        while (si < srcLen && len < 128) {
+          if (si + 2 < srcLen && src[si] == src[si + 1] && src[si] == src[si + 2])
+            break;
+          si++;
+          len++;
+        }
+        if (dst != nullptr) {
+          dst[di] = len - 1;
+          memcpy(&dst[di + 1], &src[start], len);
+        }
+        di += 1 + len;
+      }
+    }
+    return di;
+  }
+  static bool unpack(const uint8_t *src, uint32_t srcLen, uint8_t *dst, uint32_t dstLen) {
+    uint32_t si = 0;
+    uint32_t di = 0;
+    while (si < srcLen) {
+      uint8_t code = src[si++];
+      if (code < 0x80) {
+        uint32_t len = code + 1;
+        if (si + len > srcLen || di + len > dstLen)
+          return false;
+        memcpy(&dst[di], &src[si], len);
+        si += len;
+        di += len;
+      }
+      else {
+        uint32_t len = code - 0x80 + 3;
+        if (si == srcLen || di + len > dstLen)
+          return false;
+        memset(&dst[di], src[si++], len);
+        di += len;
+      }
+    }
+    return di == dstLen;
+  }
+
+  void getCpuState(CpuState &cpu) {
+    memset(&cpu, 0, sizeof(cpu));
+    for (uint32_t bank = 0; bank < 2; bank++) {
+      cpu.af[bank] = z80::af[bank];
+      cpu.bc[bank] = z80::regs[bank].bc;
+      cpu.de[bank] = z80::regs[bank].de;
+      cpu.hl[bank] = z80::regs[bank].hl;
+    }
+    cpu.ir = z80::ir;
+    cpu.ix = z80::ix;
+    cpu.iy = z80::iy;
+    cpu.sp = z80::sp;
+    cpu.pc = z80::pc;
+    cpu.iff = z80::IFF;
+    cpu.afSel = z80::af_sel;
+    cpu.regsSel = z80::regs_sel;
+  }
+  void setCpuState(const CpuState &cpu) {
+    for (uint32_t bank = 0; bank < 2; bank++) {
+      z80::af[bank] = cpu.af[bank];
+      z80::regs[bank].bc = cpu.bc[bank];
+      z80::regs[bank].de = cpu.de[bank];
+      z80::regs[bank].hl = cpu.hl[bank];
+    }
+    z80::ir = cpu.ir;
+    z80::ix = cpu.ix;
+    z80::iy = cpu.iy;
+    z80::sp = cpu.sp;
+    z80::pc = cpu.pc;
+    z80::IFF = cpu.iff;
+    z80::af_sel = cpu.afSel & 1;
+    z80::regs_sel = cpu.regsSel & 1;
+  }
+
+public:
+  NascomSnapshot(NascomKeyboard &keyboard, NascomIo &io, NascomTape &tape) : keyboard(keyboard), io(io), tape(tape) {}
+
+  void getState(MachineState &state) {
+    memset(&state, 0, sizeof(state));
+    getCpuState(state.cpu);
+    keyboard.getState(state.keyboard);
+    tape.getState(state.tape);
+    state.p0LastValue = io.getP0LastValue();
+  }
+  void setState(const MachineState &state) {
+    setCpuState(state.cpu);
+    keyboard.setState(state.keyboard);
+    tape.setState(state.tape);
+    io.setP0LastValue(state.p0LastValue);
+  }
+
+  // Packs the current machine state into a malloc'ed buffer. Returns nullptr if out of memory
+  uint8_t *capture(uint32_t *size) {
+    uint32_t packedSize = pack(z80::ram, ramSize, nullptr);
+    uint8_t *image = (uint8_t *)malloc(sizeof(Header) + packedSize);
+    if (image == nullptr) {
+      error = "Out of memory";
+      return nullptr;
+    }
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = magic;
+    header.version = version;
+    header.headerSize = sizeof(Header);
+    header.packedSize = packedSize;
+    getState(header.state);
+    pack(z80::ram, ramSize, &image[sizeof(Header)]);
+    memcpy(image, &header, sizeof(Header));
+    header.crc = NascomMemory::crc32(0, image, sizeof(Header) + packedSize);
+    memcpy(image, &header, sizeof(Header));
+    *size = sizeof(Header) + packedSize;
+    return image;
+  }
+  bool save(FS *fs, const char *fileName) {
+    uint32_t start = millis();
+    uint32_t size;
+    uint8_t *image = capture(&size);
+    if (image == nullptr)
+      return false;
+    File file = fs->open(fileName, "w");
+    size_t written = file ? file.write(image, size) : 0;
+    if (file)
+      file.close();
+    free(image);
+    if (written != size) {
+      DEBUG_PRINTF("NascomSnapshot: Cannot write %s\n", fileName);
+      error = "Write failed";
+      return false;
+    }
+    DEBUG_PRINTF("NascomSnapshot: Saved %s (%d bytes) in %d ms\n", fileName, size, millis() - start);
+    return true;
+  }
+  // Verifies the snapshot before any state is changed
+  bool restore(FS *fs, const char *fileName) {
+    uint32_t start = millis();
+    File file = fs->open(fileName, "r");
+    if (!file) {
+      error = "Cannot open";
+      return false;
+    }
+    Header header;
+    uint32_t size = file.size();
+    if (file.read((uint8_t *)&header, sizeof(Header)) != sizeof(Header) || header.magic != magic ||
+        header.version != version || header.headerSize != sizeof(Header) ||
+        header.packedSize != size - sizeof(Header)) {
+      file.close();
+      error = "Not a snapshot";
+      return false;
+    }
+    uint8_t *image = (uint8_t *)malloc(size);
+    if (image == nullptr) {
+      file.close();
+      error = "Out of memory";
+      return false;
+    }
+    uint32_t crc = header.crc;
+    header.crc = 0;
+    memcpy(image, &header, sizeof(Header));
+    bool ok = file.read(&image[sizeof(Header)], header.packedSize) == header.packedSize &&
+              NascomMemory::crc32(0, image, size) == crc;
+    file.close();
+    if (ok) {
+      // The packed data has been verified, so unpacking can't fail half way
+      ok = unpack(&image[sizeof(Header)], header.packedSize, z80::ram, ramSize);
+      z80::ram[ramSize] = z80::ram[0];
+    }
+    free(image);
+    if (!ok) {
+      DEBUG_PRINTF("NascomSnapshot: %s is corrupt\n", fileName);
+      error = "Corrupt snapshot";
+      return false;
+    }
+    setState(header.state);
+    DEBUG_PRINTF("NascomSnapshot: Restored %s (%d bytes) in %d ms\n", fileName, size, millis() - start);
+    return true;
+  }
+  const char *getError() {
+    return error;
+  }
+};
+
+// Nascom instant resume
+// Keeps a snapshot of the running machine in the internal flash (/resume.nss) and
+// restores it at boot instead of doing a cold boot.  Depending on the mode, the
+// snapshot is saved when the control screen is opened or at a fixed interval.
+//
+// The snapshot is captured in RAM between two frames, and written to the flash by a
+// low priority task, so the emulation isn't stalled by the file system.  It is written
+// to /resume.tmp and then renamed, so the previous snapshot survives a torn write.
+// If the rename itself is interrupted, a complete /resume.tmp is used at boot.
+
+class NascomResume {
+public:
+  enum Mode {
+    off            = 0,
+    onControl      = 1,
+    everyMinute    = 2,
+    every5Minutes  = 3,
+    numModes       = 4
+  };
+
+private:
+  static constexpr const char *fileName       = "/resume.nss";
+  static constexpr const char *tmpFileName    = "/resume.tmp";
+  static constexpr const char *configFileName = "/resume.cfg";
+  static const uint32_t        writeChunkSize = 4096;
+
+  NascomSnapshot   &snapshot;
+  Mode              mode = off;
+  uint32_t          lastSaveMs = 0;
+  TaskHandle_t      writerTask = nullptr;
+  uint8_t *volatile pendingImage = nullptr;
+  uint32_t          pendingSize = 0;
+
+  static uint32_t getIntervalMs(Mode mode) {
+    switch (mode) {
+      case everyMinute:   return 60*1000;
+      case every5Minutes: return 5*60*1000;
+      default:            return 0;
+    }
+  }
+  bool write(const uint8_t *image, uint32_t size) {
+    uint32_t start = millis();
+    File file = LittleFS.open(tmpFileName, "w");
+    if (!file) {
+      DEBUG_PRINTF("NascomResume: Cannot open %s\n", tmpFileName);
+      return false;
+    }
+    uint32_t written = 0;
+    while (written < size) {
+      uint32_t chunk = size - written < writeChunkSize ? size - written : writeChunkSize;
+      if (file.write(&image[written], chunk) != chunk)
+        break;
+      written += chunk;
+    }
+    file.close();
+    if (written != size || !LittleFS.rename(tmpFileName, fileName)) {
+      DEBUG_PRINTF("NascomResume: Cannot write %s\n", fileName);
+      return false;
+    }
+    DEBUG_PRINTF("NascomResume: Saved %s (%d bytes) in %d ms\n", fileName, size, millis() - start);
+    return true;
+  }
+  static void writer(void *arg) {
+    NascomResume *self = (NascomResume *)arg;
+    while (true) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      uint8_t *image = self->pendingImage;
+      if (image != nullptr) {
+        self->write(image, self->pendingSize);
+        free(image);
+        self->pendingImage = nullptr;
+      }
+    }
+  }
+
+public:
+  NascomResume(NascomSnapshot &snapshot) : snapshot(snapshot) {}
+
+  // Reads the mode.  Must be called after LittleFS is mounted
+  void init() {
+    File file = LittleFS.open(configFileName, "r");
+    if (file) {
+      char text[8] = "";
+      file.read((uint8_t *)text, sizeof(text) - 1);
+      file.close();
+      int value = atoi(text);
+      mode = (value > off && value < numModes) ? (Mode)value : off;
+    }
+    DEBUG_PRINTF("NascomResume: Mode %d\n", mode);
+  }
+  // The writer runs on core 0, the emulation runs on core 1
+  void start() {
+    if (writerTask == nullptr)
+      xTaskCreatePinnedToCore(writer, "resumeWriter", 4096, this, 1, &writerTask, 0);
+    lastSaveMs = millis();
+  }
+  Mode getMode() {
+    return mode;
+  }
+  void setMode(Mode newMode) {
+    if (newMode == mode)
+      return;
+    mode = newMode;
+    lastSaveMs = millis();
+    File file = LittleFS.open(configFileName, "w");
+    if (file) {
+      file.printf("%d\n", mode);
+      file.close();
+    }
+    if (mode == off) {
+      LittleFS.remove(fileName);
+      LittleFS.remove(tmpFileName);
+    }
+    DEBUG_PRINTF("NascomResume: Mode %d\n", mode);
+  }
+  // Restores the last snapshot.  Returns false if resume is off or there is no valid snapshot
+  bool restore() {
+    if (mode == off)
+      return false;
+    if (LittleFS.exists(fileName) && snapshot.restore(&LittleFS, fileName))
+      return true;
+    return LittleFS.exists(tmpFileName) && snapshot.restore(&LittleFS, tmpFileName);
+  }
+  // Captures the machine state and hands it to the writer.  Skipped if the previous
+  // snapshot is still being written
+  bool save() {
+    if (mode == off || writerTask == nullptr || pendingImage != nullptr)
+      return false;
+    uint32_t start = micros();
+    uint32_t size;
+    uint8_t *image = snapshot.capture(&size);
+    if (image == nullptr)
+      return false;
+    pendingSize = size;
+    pendingImage = image;
+    lastSaveMs = millis();
+    DEBUG_PRINTF("NascomResume: Captured %d bytes in %d us\n", size, micros() - start);
+    xTaskNotifyGive(writerTask);
+    return true;
+  }
+  // Called once per frame
+  void tick() {
+    uint32_t intervalMs = getIntervalMs(mode);
+    if (intervalMs != 0 && millis() - lastSaveMs >= intervalMs)
+      save();
+  }
+};
+
+// Nascom rewind buffer
+// Captures the machine state once a second, so a session can be stepped back in time.
+// RAM is kept as an undo log: The first write to a 1K page after a capture copies the
+// page before it's changed (see MarkDirty() in simz80.h).  Rewinding copies the pages
+// back, newest first, and restores the machine state.
+//
+// The page copies are kept in a ring in the order they were made, so dropping the
+// oldest capture frees the oldest pages.  When the pool is full, the oldest captures
+// are dropped to make room.  NAS-SYS writes its stack page every second even when idle,
+// so the maxPages pool holds about 30 s of an idle machine, and only a few seconds
+// of a program that writes the screen and its variables.  The control screen shows
+// the span actually held.
+
+class NascomRewind {
+  static const uint32_t maxEntries        = 60;
+  static const uint32_t maxPages          = 32;
+  static const uint32_t pageSize          = 1 << PAGE_SHIFT;
+  static const uint32_t captureIntervalMs = 1000;
+
+  struct Entry {
+    uint32_t                     timeMs;
+    uint32_t                     numPages;
+    NascomSnapshot::MachineState state;
+  };
+
+  NascomSnapshot &snapshot;
+  bool            enabled = false;
+  Entry          *entries = nullptr;
+  uint32_t        firstEntry = 0;
+  uint32_t        numEntries = 0;
+  uint8_t        *pageData = nullptr;
+  uint8_t         pageNumbers[maxPages];
+  uint32_t        firstPage = 0;
+  uint32_t        numPages = 0;
+  uint32_t        lastCaptureMs = 0;
+
+  // Capture cost statistics
+  uint32_t        frames = 0;
+  uint32_t        captures = 0;
+  uint32_t        captureUs = 0;
+  uint32_t        maxCaptureUs = 0;
+  uint32_t        pageCopies = 0;
+
+  Entry &entry(uint32_t index) {
+    return entries[(firstEntry + index) % maxEntries];
+  }
+  void dropOldest() {
+    Entry &oldest = entry(0);
+    firstPage = (firstPage + oldest.numPages) % maxPages;
+    numPages -= oldest.numPages;
+    firstEntry = (firstEntry + 1) % maxEntries;
+    numEntries -= 1;
+  }
+  void clear() {
+    firstEntry = 0;
+    numEntries = 0;
+    firstPage = 0;
+    numPages = 0;
+  }
+  void capture() {
+    uint32_t start = micros();
+    if (numEntries == maxEntries)
+      dropOldest();
+    numEntries += 1;
+    Entry &newest = entry(numEntries - 1);
+    newest.timeMs = millis();
+    newest.numPages = 0;
+    snapshot.getState(newest.state);
+    memset(z80::dirty, 0, sizeof(z80::dirty));
+    lastCaptureMs = newest.timeMs;
+    uint32_t us = micros() - start;
+    captures += 1;
+    captureUs += us;
+    if (us > maxCaptureUs)
+      maxCaptureUs = us;
+  }
+
+public:
+  NascomRewind(NascomSnapshot &snapshot) : snapshot(snapshot) {
+    memset(z80::dirty, 1, sizeof(z80::dirty));
+  }
+
+  void setEnabled(bool enable) {
+    if (enable == enabled)
+      return;
+    if (enable) {
+      entries = (Entry *)malloc(maxEntries*sizeof(Entry));
+      pageData = (uint8_t *)malloc(maxPages*pageSize);
+      if (entries == nullptr || pageData == nullptr) {
+        DEBUG_PRINTF("NascomRewind: Out of memory\n");
+        free(entries);
+        free(pageData);
+        entries = nullptr;
+        pageData = nullptr;
+        return;
+      }
+      enabled = true;
+      reset();
+    }
+    else {
+      enabled = false;
+      clear();
+      free(entries);
+      free(pageData);
+      entries = nullptr;
+      pageData = nullptr;
+      memset(z80::dirty, 1, sizeof(z80::dirty));
+    }
+    DEBUG_PRINTF("NascomRewind: %s (%d bytes)\n", enabled ? "On" : "Off",
+                 enabled ? maxEntries*sizeof(Entry) + maxPages*pageSize : 0);
+  }
+  bool getEnabled() {
+    return enabled;
+  }
+  // Drops the history.  Must be called when the RAM is changed behind the Z80's back
+  void reset() {
+    clear();
+    if (enabled)
+      capture();
+  }
+
+  // Called from firstPageWrite() before the page is changed
+  void pageWrite(uint32_t page) {
+    z80::dirty[page] = 1;
+    if (numEntries == 0)
+      return;
+    while (numPages == maxPages && numEntries > 1)
+      dropOldest();
+    if (numPages == maxPages) {
+      // The current second alone fills the pool.  Nothing to go back to until the next capture
+      dropOldest();
+      return;
+    }
+    uint32_t slot = (firstPage + numPages) % maxPages;
+    memcpy(&pageData[slot*pageSize], &z80::ram[page*pageSize], pageSize);
+    pageNumbers[slot] = page;
+    numPages += 1;
+    entry(numEntries - 1).numPages += 1;
+    pageCopies += 1;
+  }
+
+  // Called once per frame
+  void tick() {
+    if (!enabled)
+      return;
+    frames += 1;
+    if (millis() - lastCaptureMs >= captureIntervalMs) {
+      capture();
+      if (captures % maxEntries == 0) {
+        DEBUG_PRINTF("NascomRewind: %d s, %d pages, capture %d us avg, %d us max, %d us/frame, %d page copies/s\n",
+                     numEntries, numPages, captureUs/captures, maxCaptureUs, captureUs/frames, pageCopies/captures);
+      }
+    }
+  }
+
+  // Goes back the given number of seconds, or as far as possible.  Returns the number
+  // of seconds actually gone back
+  uint32_t rewind(uint32_t seconds) {
+    if (!enabled || numEntries == 0)
+      return 0;
+    uint32_t target = seconds < numEntries ? numEntries - 1 - seconds : 0;
+    uint32_t page = numPages;
+    for (uint32_t ei = numEntries; ei-- > target; ) {
+      for (uint32_t pi = 0; pi < entry(ei).numPages; pi++) {
+        page -= 1;
+        uint32_t slot = (firstPage + page) % maxPages;
+        memcpy(&z80::ram[pageNumbers[slot]*pageSize], &pageData[slot*pageSize], pageSize);
+      }
+    }
+    z80::ram[0x10000] = z80::ram[0]; // make getWord(0xffff) work correctly
+    Entry &to = entry(target);
+    uint32_t back = (millis() - to.timeMs + 500)/1000;
+    snapshot.setState(to.state);
+    numPages = page;
+    numEntries = target;
+    capture();
+    DEBUG_PRINTF("NascomRewind: Back %d s\n", back);
+    return back;
+  }
+
+  void getStatsText(char *text, size_t size) {
+    if (!enabled)
+      text[0] = 0;
+    else
+      snprintf(text, size, "%ds %dK %dus/f", numEntries, numPages*pageSize/1024, frames == 0 ? 0 : captureUs/frames);
+  }
+};
 
-    fs   = getFieldText(tapeOutFs);
-    name = getFieldText(tapeOutFileName);
-    DEBUG_PRINTF("tapeOutFs: %s\n", fs);
-    DEBUG_PRINTF("tapeOutFileName: %s\n", name);
-    if (fs[0] == 'I')
-      tape.setOutputFile(&LittleFS, name);
+// Nascom input log
+// Records the key events of a session so it can be replayed exactly.  A recording is
+// a snapshot (<name>.nss) and a log of the key events (<name>.nkl) stamped with the
+// frame number.  A frame is a fixed number of Z80 instructions, and key events are
+// applied between frames both when recording and when replaying, so a replay from the
+// snapshot executes exactly the same instructions.  The tape file and position are part
+// of the snapshot, and tape bytes are read on demand by the Z80, so tape input replays
+// without being logged.
+//
+// Log file format:
+//   Header            Magic "NKL1", version, instructions per frame
+//   Events            12 bytes each, in frame order
+// The recording ends with an end event holding the CRC-32 of the RAM and the PC, and a
+// replay reports whether it ended in the same state.
+
+class NascomInputLog {
+public:
+  enum Mode {
+    idle,
+    recording,
+    replaying
+  };
+
+private:
+  static const uint32_t magic   = 0x314c4b4e; // "NKL1"
+  static const uint16_t version = 1;
+  struct Header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t insnPerFrame;
+  };
+  enum EventType {
+    keyEvent = 1,
+    endEvent = 2
+  };
+  struct Event {
+    uint32_t frame;
+    uint8_t  type;
+    uint8_t  nk;
+    uint8_t  down;
+    uint8_t  reserved;
+    uint32_t value;
+  };
+
+  NascomKeyboard &keyboard;
+  NascomSnapshot &snapshot;
+  NascomControl  &control;
+  uint32_t        insnPerFrame;
+  Mode            mode = idle;
+  File            file;
+  uint32_t        frame = 0;
+  uint32_t        numEvents = 0;
+  Event           next;
+  bool            hasNext = false;
+
+  static void logFileName(const char *snapshotFileName, char *fileName, size_t size) {
+    const char *ext = strrchr(snapshotFileName, '.');
+    size_t      baseLen = (ext == nullptr) ? strlen(snapshotFileName) : ext - snapshotFileName;
+    snprintf(fileName, size, "%.*s.nkl", (int)baseLen, snapshotFileName);
+  }
+  static uint32_t stateCrc() {
+    return NascomMemory::crc32(0, z80::ram, MEMSIZE*1024) ^ z80::pc;
+  }
+  void readNext() {
+    hasNext = file.read((uint8_t *)&next, sizeof(next)) == sizeof(next);
+  }
+  void endReplay(bool identical) {
+    char status[48 + 1];
+    if (identical)
+      snprintf(status, sizeof(status), "Replay: Identical after %d frames", frame);
     else
-      tape.setOutputFile(&SD, name);
+      snprintf(status, sizeof(status), "Replay: Diverged after %d frames", frame);
+    DEBUG_PRINTF("NascomInputLog: %s\n", status);
+    control.setStatus(status);
+    stop();
   }
 
-  bool getIsActive() {
-    return isActive;
+public:
+  NascomInputLog(NascomKeyboard &keyboard, NascomSnapshot &snapshot, NascomControl &control, uint32_t insnPerFrame) :
+    keyboard(keyboard), snapshot(snapshot), control(control), insnPerFrame(insnPerFrame) {}
+
+  // Must be called between two frames
+  bool startRecording(FS *fs, const char *snapshotFileName) {
+    char fileName[48];
+    stop();
+    logFileName(snapshotFileName, fileName, sizeof(fileName));
+    if (!snapshot.save(fs, snapshotFileName))
+      return false;
+    file = fs->open(fileName, "w");
+    Header header = {magic, version, 0, insnPerFrame};
+    if (!file || file.write((uint8_t *)&header, sizeof(header)) != sizeof(header)) {
+      DEBUG_PRINTF("NascomInputLog: Cannot write %s\n", fileName);
+      if (file)
+        file.close();
+      return false;
+    }
+    DEBUG_PRINTF("NascomInputLog: Recording to %s\n", fileName);
+    keyboard.setInputMode(NascomKeyboard::inputQueued);
+    frame = 0;
+    numEvents = 0;
+    mode = recording;
+    return true;
+  }
+  bool startReplay(FS *fs, const char *snapshotFileName) {
+    char   fileName[48];
+    Header header;
+    stop();
+    logFileName(snapshotFileName, fileName, sizeof(fileName));
+    file = fs->open(fileName, "r");
+    if (!file || file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+        header.magic != magic || header.version != version || header.insnPerFrame != insnPerFrame) {
+      DEBUG_PRINTF("NascomInputLog: %s is not a valid log\n", fileName);
+      if (file)
+        file.close();
+      return false;
+    }
+    if (!snapshot.restore(fs, snapshotFileName)) {
+      file.close();
+      return false;
+    }
+    DEBUG_PRINTF("NascomInputLog: Replaying %s\n", fileName);
+    keyboard.setInputMode(NascomKeyboard::inputIgnored);
+    frame = 0;
+    numEvents = 0;
+    mode = replaying;
+    readNext();
+    return true;
+  }
+  // Ends a recording with the end event.  Must be called between two frames
+  void stop() {
+    if (mode == recording) {
+      Event event = {frame, endEvent, 0, 0, 0, stateCrc()};
+      file.write((uint8_t *)&event, sizeof(event));
+      char status[48 + 1];
+      snprintf(status, sizeof(status), "Recorded %d frames, %d key events", frame, numEvents);
+      DEBUG_PRINTF("NascomInputLog: %s\n", status);
+      control.setStatus(status);
+    }
+    if (mode != idle) {
+      file.close();
+      keyboard.setInputMode(NascomKeyboard::inputDirect);
+      mode = idle;
+    }
+  }
+  Mode getMode() {
+    return mode;
+  }
+
+  // Called between two frames
+  void tick() {
+    if (mode == recording) {
+      uint8_t nk;
+      bool    down;
+      while (keyboard.takeKeyEvent(&nk, &down)) {
+        Event event = {frame, keyEvent, nk, down, 0, 0};
+        file.write((uint8_t *)&event, sizeof(event));
+        keyboard.applyKeyEvent(nk, down);
+        numEvents += 1;
+      }
+      frame += 1;
+    }
+    else if (mode == replaying) {
+      while (hasNext && next.frame == frame && next.type == keyEvent) {
+        keyboard.applyKeyEvent(next.nk, next.down);
+        numEvents += 1;
+        readNext();
+      }
+      frame += 1;
+      if (!hasNext)
+        endReplay(false);
+      else if (next.type == endEvent && next.frame == frame)
+        endReplay(next.value == stateCrc());
+    }
   }
 };
-NascomControl *NascomControl::self = nullptr;
-bool           NascomControl::hasSd = false;
 
-// Nascom keyboard map.  Used to provide simulated input from keyboard
-class NascomKeyboardMap {
-  // Encoding: csrrrccc
-  // c   = CTRL
-  // s   = SHIFT
-  // rrr = row
-  // ccc = col
-  #define NK_MAKE(row, col) ((row) << 3 | (col))
-  #define NK_ROW(key)       (((key) & 0x38) >> 3)
-  #define NK_COL(key)       ((key) & 0x07)
-  #define NK_SHIFT_MASK     0x40
-  #define NK_CTRL_MASK      0x80
-  #define NK_BASE(key)      ((key) & 0x3f)
-  #define NK_HAS_SHIFT(key) (((key) & NK_SHIFT_MASK) != 0)
-  #define NK_HAS_CTRL(key)  (((key) & NK_CTRL_MASK) != 0)
+// Nascom profiler
+// Reports where the Z80 spends its time, from the instruction counts per 16 byte
+// block collected by simz80 while FEATURE_PROFILE is set (see simz80.h).  simz80 samples
+// every PROFILE_PERIOD-th instruction, so the counts are estimates in steps of
+// PROFILE_PERIOD.  The report lists the hottest blocks, and the hottest ranges of
+// consecutive executed blocks, which roughly correspond to routines and loops.  It's
+// written to the serial port (unless SERIAL_TAKEN) and to /profile.txt on the SD card
+// each time the control screen is opened, and the counts are then cleared.  The counts
+// are instructions, not cycles, since the core doesn't count cycles.
 
-  #define NK_NONE           NK_MAKE(7, 7)
-  #define NK_UP             NK_MAKE(1, 6)
-  #define NK_DOWN           NK_MAKE(3, 6)
-  #define NK_LEFT           NK_MAKE(2, 6)
-  #define NK_RIGHT          NK_MAKE(4, 6)
-  #define NK_SHIFT          NK_MAKE(0, 4)
-  #define NK_CTRL           NK_MAKE(0, 3)
-  #define NK_GRAPH          NK_MAKE(5, 6)
-  #define NK_SPACE          NK_MAKE(7, 4)
-  #define NK_ENTER          NK_MAKE(0, 1)
-  #define NK_0              NK_MAKE(6, 2)
-  #define NK_2              NK_MAKE(6, 3)
-  #define NK_A              NK_MAKE(4, 4)
-  #define NK_B              NK_MAKE(1, 1)
-  #define NK_C              NK_MAKE(7, 3)
-  #define NK_D              NK_MAKE(2, 3)
-  #define NK_E              NK_MAKE(3, 3)
-  #define NK_F              NK_MAKE(1, 3)
-  #define NK_G              NK_MAKE(7, 0)
-  #define NK_H              NK_MAKE(1, 0)
-  #define NK_I              NK_MAKE(4, 5)
-  #define NK_J              NK_MAKE(2, 0)
-  #define NK_K              NK_MAKE(3, 0)
-  #define NK_L              NK_MAKE(4, 0)
-  #define NK_M              NK_MAKE(3, 1)
-  #define NK_N              NK_MAKE(2, 1)
-  #define NK_O              NK_MAKE(5, 5)
-  #define NK_P              NK_MAKE(6, 5)
-  #define NK_Q              NK_MAKE(5, 4)
-  #define NK_R              NK_MAKE(7, 5)
-  #define NK_S              NK_MAKE(3, 4)
-  #define NK_T              NK_MAKE(1, 5)
-  #define NK_U              NK_MAKE(3, 5)
-  #define NK_V              NK_MAKE(7, 1)
-  #define NK_W              NK_MAKE(4, 3)
-  #define NK_X              NK_MAKE(1, 4)
-  #define NK_Y              NK_MAKE(2, 5)
-  #define NK_Z              NK_MAKE(2, 4)
-  #define NK_LEFTBRACKET    NK_MAKE(6, 6)
-  #define NK_RIGHTBRACKET   NK_MAKE(7, 6)
-  
-  static const uint32_t mapSize = 8;
-  uint8_t               map[mapSize];
-  uint8_t               mapSnapshot[mapSize];
-  bool                  mapIsUpdating = false;
-  TaskHandle_t          mainTaskId;
+class NascomProfiler {
+  static const uint32_t topBlocks = 20;
+  static const uint32_t topRanges = 10;
+  static constexpr const char *fileName = "/profile.txt";
 
-  static constexpr char encoding[mapSize][9] = {
-    /*        _   6    5   4   3   2   1    0 */
-    /* 0 */  "_" "\t" "@" "_" "_" "-" "\r" "\010",
-    /* 1 */  "_" "_"  "T" "X" "F" "5" "B"  "H",
-    /* 2 */  "_" "_"  "Y" "Z" "D" "6" "N"  "J",
-    /* 3 */  "_" "_"  "U" "S" "E" "7" "M"  "K",
-    /* 4 */  "_" "_"  "I" "A" "W" "8" ","  "L",
-    /* 5 */  "_" "_"  "O" "Q" "3" "9" "."  ";",
-    /* 6 */  "_" "["  "P" "1" "2" "0" "/"  ":",
-    /* 7 */  "_" "]"  "R" " " "C" "4" "V"  "G",
-    };
-  uint32_t mapIndex = 0;
+  struct Range {
+    uint32_t first;
+    uint32_t last;
+    uint32_t count;
+  };
 
-  void set(uint8_t row, uint8_t col, bool down) {
-    if (down)
-      map[row] |= 1 << col;
-    else
-      map[row] &= ~(1 << col);
+  static void insertTop(Range *top, uint32_t size, const Range &range) {
+    if (range.count <= top[size - 1].count)
+      return;
+    uint32_t ti = size - 1;
+    while (ti > 0 && top[ti - 1].count < range.count) {
+      top[ti] = top[ti - 1];
+      ti--;
+    }
+    top[ti] = range;
+  }
+  static void printRange(Print &out, const Range &range, uint64_t total) {
+    out.printf("  %04X-%04X %10u %5.1f%%\n", range.first << PROFILE_SHIFT, ((range.last + 1) << PROFILE_SHIFT) - 1,
+               range.count, total == 0 ? 0.0 : range.count*100.0/total);
+  }
+
+public:
+  static void report(Print &out) {
+    Range    blocks[topBlocks] = {};
+    Range    ranges[topRanges] = {};
+    Range    range = {};
+    uint64_t total = 0;
+    for (uint32_t bi = 0; bi < NUM_PROFILE_BLOCKS; bi++) {
+      uint32_t count = z80::profile[bi];
+      total += count;
+      insertTop(blocks, topBlocks, {bi, bi, count});
+      if (count != 0 && range.count != 0 && range.last == bi - 1) {
+        range.last = bi;
+        range.count += count;
+      }
+      else {
+        insertTop(ranges, topRanges, range);
+        range = {bi, bi, count};
+      }
+    }
+    insertTop(ranges, topRanges, range);
+    out.printf("Profile: %llu instructions\n", total);
+    out.printf("Hot blocks:\n");
+    for (uint32_t ti = 0; ti < topBlocks && blocks[ti].count != 0; ti++)
+      printRange(out, blocks[ti], total);
+    out.printf("Hot ranges:\n");
+    for (uint32_t ti = 0; ti < topRanges && ranges[ti].count != 0; ti++)
+      printRange(out, ranges[ti], total);
+  }
+  static void dump(bool toSd) {
+    uint32_t start = millis();
+#ifndef SERIAL_TAKEN
+    report(Serial);
+#endif
+    if (toSd) {
+      File file = SD.open(fileName, "w");
+      if (file) {
+        report(file);
+        file.close();
+      }
+    }
+    memset(z80::profile, 0, NUM_PROFILE_BLOCKS*sizeof(uint32_t));
+    DEBUG_PRINTF("NascomProfiler: Report in %d ms\n", millis() - start);
+  }
+  // Allocates or frees the counts and sets the feature.  False if out of memory
+  static bool setEnabled(bool on) {
+    z80::features &= ~FEATURE_PROFILE;
+    if (!on) {
+      free(z80::profile);
+      z80::profile = nullptr;
+      return true;
+    }
+    if (z80::profile == nullptr)
+      z80::profile = (uint32_t *)calloc(NUM_PROFILE_BLOCKS, sizeof(uint32_t));
+    if (z80::profile == nullptr)
+      return false;
+    z80::features |= FEATURE_PROFILE;
+    return true;
+  }
+};
+
+// Nascom opcode statistics
+// Exports the opcode counts collected by simz80 while FEATURE_OPSTATS is set as CSV files
+// on the SD card, each time the control screen is opened:
+//   /opstats.csv      table,opcode,count          Tables: main, CB, DD, ED, FD, XYCB
+//   /oppairs.csv      first,second,count          Pairs of consecutive main opcodes
+// XYCB is DD CB d op and FD CB d op.  The pairs are counted in a fixed size hash table;
+// pairs that don't fit are only counted as a total, which is reported on the serial port.
+// The counts are cleared after the export, so each workload (e.g. primes.bas, primes.pas,
+// primes.for or Sargon) can be run and exported separately.
+
+class NascomOpStats {
+  static const uint32_t maxPairs = 2048;
+  static constexpr const char *tableNames[z80::NUM_OPS_TABLES] = {"main", "CB", "DD", "ED", "FD", "XYCB"};
+
+  struct Pair {
+    uint16_t key;     // first << 8 | second
+    uint16_t used;
+    uint32_t count;
+  };
+  static Pair    *pairs;
+  static uint32_t lostPairs;
+  static uint32_t prevOp;
+
+public:
+  static void pair(uint32_t op) {
+    uint16_t key = prevOp << 8 | op;
+    prevOp = op;
+    uint32_t slot = (key * 40503u >> 5) % maxPairs;
+    for (uint32_t probe = 0; probe < 8; probe++) {
+      Pair &p = pairs[(slot + probe) % maxPairs];
+      if (p.used && p.key == key) {
+        p.count++;
+        return;
+      }
+      if (!p.used) {
+        p.used = 1;
+        p.key = key;
+        p.count = 1;
+        return;
+      }
+    }
+    lostPairs++;
+  }
+  static void dump(bool toSd) {
+    uint32_t start = millis();
+    uint32_t numPairs = 0;
+    for (uint32_t pi = 0; pi < maxPairs; pi++)
+      numPairs += pairs[pi].used;
+    if (toSd) {
+      File file = SD.open("/opstats.csv", "w");
+      if (file) {
+        file.printf("table,opcode,count\n");
+        for (uint32_t ti = 0; ti < z80::NUM_OPS_TABLES; ti++) {
+          for (uint32_t op = 0; op < 256; op++) {
+            if (z80::opCounts[ti][op] != 0)
+              file.printf("%s,%02X,%u\n", tableNames[ti], op, z80::opCounts[ti][op]);
+          }
+        }
+        file.close();
+      }
+      file = SD.open("/oppairs.csv", "w");
+      if (file) {
+        file.printf("first,second,count\n");
+        for (uint32_t pi = 0; pi < maxPairs; pi++) {
+          if (pairs[pi].used)
+            file.printf("%02X,%02X,%u\n", pairs[pi].key >> 8, pairs[pi].key & 0xff, pairs[pi].count);
+        }
+        file.close();
+      }
+    }
+    DEBUG_PRINTF("NascomOpStats: %d pairs, %d pair executions not counted, exported in %d ms\n",
+                 numPairs, lostPairs, millis() - start);
+    memset(z80::opCounts, 0, z80::NUM_OPS_TABLES*sizeof(*z80::opCounts));
+    memset(pairs, 0, maxPairs*sizeof(Pair));
+    lostPairs = 0;
+  }
+  // Allocates or frees the counts and sets the feature.  False if out of memory
+  static bool setEnabled(bool on) {
+    z80::features &= ~FEATURE_OPSTATS;
+    if (on && z80::opCounts == nullptr)
+      z80::opCounts = (uint32_t (*)[256])calloc(z80::NUM_OPS_TABLES, sizeof(*z80::opCounts));
+    if (on && pairs == nullptr)
+      pairs = (Pair *)calloc(maxPairs, sizeof(Pair));
+    if (!on || z80::opCounts == nullptr || pairs == nullptr) {
+      free(z80::opCounts);
+      free(pairs);
+      z80::opCounts = nullptr;
+      pairs = nullptr;
+      return !on;
+    }
+    z80::features |= FEATURE_OPSTATS;
+    return true;
+  }
+};
+constexpr const char *NascomOpStats::tableNames[z80::NUM_OPS_TABLES];
+NascomOpStats::Pair *NascomOpStats::pairs = nullptr;
+uint32_t NascomOpStats::lostPairs = 0;
+uint32_t NascomOpStats::prevOp = 0;
+
+// Nascom instruction trace
+// Writes the trace of the last instructions collected by simz80 while FEATURE_TRACE is set
+// (see simz80.h) to /trace.ntr on the SD card, or the internal flash if there is no SD card.  The trace
+// is written when the control screen is opened and when the Z80 executes HALT.
+// tools/ntrdump.py decodes the file.
+//
+// Trace file format (.ntr):
+//   Header            Magic "NTR1", version, record size, number of records, and the
+//                     number of instructions executed since the trace was cleared
+//   Records           16 bytes each, oldest first: PC, the 4 bytes at PC, AF, BC, DE, HL, SP
+
+class NascomTrace {
+  static const uint32_t magic   = 0x3152544e; // "NTR1"
+  static const uint16_t version = 1;
+  static constexpr const char *fileName = "/trace.ntr";
+
+  struct Header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t numRecords;
+    uint32_t numInstructions;
+  };
+
+public:
+  static void dump(bool toSd) {
+    uint32_t start = millis();
+    FS *fs = toSd ? (FS *)&SD : (FS *)&LittleFS;
+    uint32_t count = z80::traceIndex;
+    uint32_t numRecords = count < TRACE_SIZE ? count : TRACE_SIZE;
+    Header header = {magic, version, sizeof(z80::traceRecord), numRecords, count};
+    File file = fs->open(fileName, "w");
+    if (!file) {
+      DEBUG_PRINTF("NascomTrace: Cannot write %s\n", fileName);
+      return;
+    }
+    file.write((uint8_t *)&header, sizeof(header));
+    uint32_t first = (count - numRecords) & (TRACE_SIZE - 1);
+    if (first + numRecords > TRACE_SIZE) {
+      file.write((uint8_t *)&z80::trace[first], (TRACE_SIZE - first)*sizeof(z80::traceRecord));
+      file.write((uint8_t *)&z80::trace[0], (first + numRecords - TRACE_SIZE)*sizeof(z80::traceRecord));
+    }
+    else {
+      file.write((uint8_t *)&z80::trace[first], numRecords*sizeof(z80::traceRecord));
+    }
+    file.close();
+    DEBUG_PRINTF("NascomTrace: %d instructions written to %s in %d ms\n", numRecords, fileName, millis() - start);
+  }
+  // Allocates or frees the trace and sets the feature.  False if out of memory
+  static bool setEnabled(bool on) {
+    z80::features &= ~FEATURE_TRACE;
+    if (!on) {
+      free(z80::trace);
+      z80::trace = nullptr;
+      return true;
+    }
+    if (z80::trace == nullptr) {
+      z80::trace = (z80::traceRecord *)calloc(TRACE_SIZE, sizeof(z80::traceRecord));
+      z80::traceIndex = 0;
+    }
+    if (z80::trace == nullptr)
+      return false;
+    z80::features |= FEATURE_TRACE;
+    return true;
+  }
+};
+
+// CPU timing.  simz80 runs slices of INSN_PER_REFRESH instructions, UI_REFRESH_RATE times per
+// second when throttled
+#define Z80_FREQUENCY              4000000
+#define UI_REFRESH_RATE            30
+#define ESTIMATED_CYCLES_PER_INSN  8
+#define INSN_PER_REFRESH           Z80_FREQUENCY/UI_REFRESH_RATE/ESTIMATED_CYCLES_PER_INSN
+
+// Nascom lockstep checker
+// Runs the benchmark workloads (see NascomBenchmark) when F5 is pressed, with every block
+// of blockSize instructions executed twice from the same state: First by the reference
+// interpreter (z80::ENGINE_PLAIN), then by the checked one.  The registers, the HALT stop
+// and a hash of each 1K page written by either run must match.  Port input of the
+// reference run is replayed to the checked run, and its output must match.
+//
+// At the first divergence the block is run again with 1, 2, ... instructions to find the
+// instruction, which is reported on the serial port and in /lockstep.jsonl (LittleFS) with
+// both register sets:
+//   {"lockstep":"diverged","engine":"full","pc":"0c4b","opcode":"ed b0 00 00","instructions":...,
+//    "reference":{"pc":...},"checked":{"pc":...},"page":null,"io":false}
+// and the checking stops, with the machine in the reference state.  A summary follows at
+// the end:
+//   {"lockstep":"done","engine":"full","instructions":...,"blocks":...,"unchecked":...,
+//    "diverged":false}
+// Blocks with a fast tape load trap, or that write more than maxPages pages, are executed
+// by the reference interpreter only, and counted as unchecked.
+
+class NascomLockstep {
+  static const uint32_t blockSize  = 64;
+  static const uint32_t maxPages   = 16;
+  static const uint32_t maxIo      = 256;
+  static const uint32_t pageSize   = 1 << PAGE_SHIFT;
+  static const char    *const engineNames[z80::NUM_ENGINES];
+  static constexpr const char *resultFileName = "/lockstep.jsonl";
+
+  struct Registers {
+    z80::WORD af[2];
+    int       afSel;
+    z80::ddregs regs[2];
+    int       regsSel;
+    z80::WORD ir, ix, iy, sp, pc, iff;
+
+    void get() {
+      memcpy(af, z80::af, sizeof(af));
+      afSel = z80::af_sel;
+      memcpy(regs, z80::regs, sizeof(regs));
+      regsSel = z80::regs_sel;
+      ir = z80::ir;
+      ix = z80::ix;
+      iy = z80::iy;
+      sp = z80::sp;
+      pc = z80::pc;
+      iff = z80::IFF;
+    }
+    void set() const {
+      memcpy(z80::af, af, sizeof(af));
+      z80::af_sel = afSel;
+      memcpy(z80::regs, regs, sizeof(regs));
+      z80::regs_sel = regsSel;
+      z80::ir = ir;
+      z80::ix = ix;
+      z80::iy = iy;
+      z80::sp = sp;
+      z80::pc = pc;
+      z80::IFF = iff;
+    }
+    bool operator==(const Registers &other) const {
+      return memcmp(af, other.af, sizeof(af)) == 0 && afSel == other.afSel &&
+             memcmp(regs, other.regs, sizeof(regs)) == 0 && regsSel == other.regsSel &&
+             ir == other.ir && ix == other.ix && iy == other.iy &&
+             sp == other.sp && pc == other.pc && iff == other.iff;
+    }
+    int print(char *text, size_t size) const {
+      return snprintf(text, size,
+                      "{\"pc\":\"%04x\",\"af\":\"%04x\",\"bc\":\"%04x\",\"de\":\"%04x\",\"hl\":\"%04x\","
+                      "\"ix\":\"%04x\",\"iy\":\"%04x\",\"sp\":\"%04x\",\"af'\":\"%04x\",\"bc'\":\"%04x\","
+                      "\"de'\":\"%04x\",\"hl'\":\"%04x\",\"i\":\"%02x\",\"iff\":%d}",
+                      pc, af[afSel], regs[regsSel].bc, regs[regsSel].de, regs[regsSel].hl, ix, iy, sp,
+                      af[1 - afSel], regs[1 - regsSel].bc, regs[1 - regsSel].de, regs[1 - regsSel].hl,
+                      ir >> 8, iff);
+    }
+  };
+  struct IoEntry {
+    uint16_t port;
+    uint8_t  value;
+    bool     in;
+  };
+  enum Mode { modeOff, modeRecord, modeReplay };
+
+  NascomIo       &io;
+  NascomFastLoad &fastLoad;
+  bool            active = false;
+  Mode            mode = modeOff;
+  int             engine = z80::ENGINE_FULL;
+  int             features = 0;
+  int             debugArmed = 0;
+  z80::BYTE       debugPages[256];
+
+  // The state at the start of the block: The registers, and the pages written since
+  Registers       startRegisters;
+  uint8_t        *pageData = nullptr;
+  uint8_t         pageSlots[NUM_PAGES];     // Index into pageData + 1, 0 if not saved
+  uint8_t         pageNumbers[maxPages];
+  uint32_t        numPages = 0;
+  bool            overflow = false;         // Too many pages, or port accesses
+  uint32_t        pageHashes[NUM_PAGES];    // Of the reference run, for the saved pages
+
+  IoEntry         ioLog[maxIo];
+  uint32_t        numIo = 0;
+  uint32_t        ioNext = 0;
+  bool            ioDiverged = false;
+  bool            trapped = false;
+
+  uint64_t        instructions = 0;
+  uint32_t        blocks = 0;
+  uint32_t        unchecked = 0;
+  bool            diverged = false;
+
+  static int blockEnd() {
+    return -1;
+  }
+  static uint32_t hashPage(uint32_t page) {
+    uint32_t       hash = 2166136261u;
+    const uint8_t *data = &z80::ram[page*pageSize];
+    for (uint32_t i = 0; i < pageSize; i++)
+      hash = (hash ^ data[i])*16777619u;
+    return hash;
+  }
+  // Runs instructions in engine.  Returns the simz80 stop value
+  z80::FASTWORK runEngine(int engine, uint32_t instructions) {
+    return z80::simz80_engine(engine, z80::pc, instructions + 1, blockEnd);
+  }
+  // Starts a block at the current state
+  void begin() {
+    startRegisters.get();
+    for (uint32_t pi = 0; pi < numPages; pi++)
+      pageSlots[pageNumbers[pi]] = 0;
+    numPages = 0;
+    overflow = false;
+    memset(z80::dirty, 0, sizeof(z80::dirty));
+    numIo = 0;
+    trapped = false;
+    mode = modeRecord;
+  }
+  // Back to the start of the block, for a replay
+  void rewind() {
+    for (uint32_t pi = 0; pi < numPages; pi++) {
+      uint32_t page = pageNumbers[pi];
+      memcpy(&z80::ram[page*pageSize], &pageData[pi*pageSize], pageSize);
+      z80::dirty[page] = 0;
+    }
+    z80::ram[0x10000] = z80::ram[0];
+    startRegisters.set();
+    ioNext = 0;
+    ioDiverged = false;
+    mode = modeReplay;
+  }
+  void hashPages() {
+    for (uint32_t pi = 0; pi < numPages; pi++)
+      pageHashes[pageNumbers[pi]] = hashPage(pageNumbers[pi]);
+  }
+  // The first saved page that differs from the reference run, or -1
+  int32_t comparePages() {
+    for (uint32_t pi = 0; pi < numPages; pi++) {
+      if (hashPage(pageNumbers[pi]) != pageHashes[pageNumbers[pi]])
+        return pageNumbers[pi];
+    }
+    return -1;
+  }
+  // Runs the checked engine from the start of the block, after the reference run, which made
+  // numPortIo port accesses.  Returns true if the runs match, with the mismatching page in *page
+  bool check(uint32_t instructions, z80::FASTWORK reference, const Registers &referenceRegisters,
+             uint32_t numPortIo, Registers &checked, int32_t *page) {
+    rewind();
+    z80::FASTWORK stop = runEngine(engine, instructions);
+    checked.get();
+    *page = comparePages();
+    return stop == reference && checked == referenceRegisters && *page < 0 && !overflow &&
+           !ioDiverged && ioNext == numPortIo;
+  }
+  // Finds and reports the first diverging instruction of the block, and leaves the machine
+  // in the reference state after the block
+  void report() {
+    Registers reference;
+    Registers checked;
+    int32_t   page = -1;
+    uint16_t  pc = startRegisters.pc;
+    uint8_t   opcode[4];
+    uint32_t  count;
+    uint32_t  numPortIo = 0;
+    for (count = 1; count <= blockSize; count++) {
+      rewind();
+      for (uint32_t bi = 0; bi < sizeof(opcode); bi++)
+        opcode[bi] = z80::ram[(pc + bi) & 0xffff];
+      z80::FASTWORK stop = runEngine(z80::ENGINE_PLAIN, count);
+      reference.get();
+      numPortIo = ioNext;
+      hashPages();
+      if (!check(count, stop, reference, numPortIo, checked, &page))
+        break;
+      pc = reference.pc;
+      if ((stop & 0x10000) == 0)
+        break;
+    }
+    char text[640];
+    int  len = snprintf(text, sizeof(text),
+                        "{\"lockstep\":\"diverged\",\"engine\":\"%s\",\"pc\":\"%04x\",\"opcode\":\"%02x %02x %02x %02x\","
+                        "\"instructions\":%llu,\"reference\":",
+                        engineNames[engine], pc, opcode[0], opcode[1], opcode[2], opcode[3],
+                        (unsigned long long)(instructions + count));
+    len += reference.print(&text[len], sizeof(text) - len);
+    len += snprintf(&text[len], sizeof(text) - len, ",\"checked\":");
+    len += checked.print(&text[len], sizeof(text) - len);
+    char pageText[8] = "null";
+    if (page >= 0)
+      snprintf(pageText, sizeof(pageText), "\"%04x\"", page*pageSize);
+    snprintf(&text[len], sizeof(text) - len, ",\"page\":%s,\"io\":%s}\n",
+             pageText, ioDiverged || ioNext != numPortIo ? "true" : "false");
+    report(text);
+    rewind();
+    runEngine(z80::ENGINE_PLAIN, blockSize);
+  }
+  static void report(const char *text) {
+    REPORT_PRINTF("%s", text);
+    File file = LittleFS.open(resultFileName, "a");
+    if (file) {
+      file.print(text);
+      file.close();
+    }
+  }
+  // Runs one block.  Returns the simz80 stop value
+  z80::FASTWORK block() {
+    begin();
+    z80::FASTWORK stop = runEngine(z80::ENGINE_PLAIN, blockSize);
+    mode = modeOff;
+    blocks++;
+    if (trapped || overflow) {
+      unchecked++;
+    }
+    else {
+      Registers reference;
+      Registers checked;
+      int32_t   page;
+      reference.get();
+      hashPages();
+      if (!check(blockSize, stop, reference, numIo, checked, &page)) {
+        mode = modeOff;
+        report();
+        diverged = true;
+        finish();
+        return stop;
+      }
+      mode = modeOff;
+    }
+    instructions += blockSize;
+    return stop;
+  }
+
+public:
+  NascomLockstep(NascomIo &io, NascomFastLoad &fastLoad) : io(io), fastLoad(fastLoad) {
+    memset(pageSlots, 0, sizeof(pageSlots));
+  }
+
+  bool start(int engine) {
+    pageData = (uint8_t *)malloc(maxPages*pageSize);
+    features = z80::features;
+    bool ok = pageData != nullptr;
+    if (ok && engine == z80::ENGINE_FULL) {
+      ok = NascomProfiler::setEnabled(true) && NascomOpStats::setEnabled(true) && NascomTrace::setEnabled(true);
+    }
+    if (!ok) {
+      DEBUG_PRINTF("NascomLockstep: Out of memory\n");
+      finish();
+      return false;
+    }
+    this->engine = engine;
+    // Breakpoints would stop the debug instances
+    debugArmed = z80::debugArmed;
+    memcpy(debugPages, z80::debugPages, sizeof(debugPages));
+    z80::debugArmed = 0;
+    memset(z80::debugPages, 0, sizeof(z80::debugPages));
+    numPages = 0;
+    instructions = 0;
+    blocks = 0;
+    unchecked = 0;
+    diverged = false;
+    active = true;
+    LittleFS.remove(resultFileName);
+    DEBUG_PRINTF("NascomLockstep: Checking %s\n", engineNames[engine]);
+    return true;
+  }
+  void finish() {
+    if (active) {
+      char text[160];
+      snprintf(text, sizeof(text),
+               "{\"lockstep\":\"done\",\"engine\":\"%s\",\"instructions\":%llu,\"blocks\":%u,\"unchecked\":%u,"
+               "\"diverged\":%s}\n", engineNames[engine], (unsigned long long)instructions, blocks, unchecked,
+               diverged ? "true" : "false");
+      report(text);
+      z80::debugArmed = debugArmed;
+      memcpy(z80::debugPages, debugPages, sizeof(debugPages));
+    }
+    NascomProfiler::setEnabled(features & FEATURE_PROFILE);
+    NascomOpStats::setEnabled(features & FEATURE_OPSTATS);
+    NascomTrace::setEnabled(features & FEATURE_TRACE);
+    for (uint32_t pi = 0; pi < numPages; pi++)
+      pageSlots[pageNumbers[pi]] = 0;
+    numPages = 0;
+    free(pageData);
+    pageData = nullptr;
+    memset(z80::dirty, 1, sizeof(z80::dirty));
+    mode = modeOff;
+    active = false;
+  }
+  bool getActive() {
+    return active;
+  }
+  // Runs like simz80: fnc is called every count instructions, and a HALT or fnc returning
+  // -1 stops.  Returns the simz80 stop value.  Returns after finish()
+  z80::FASTWORK run(uint32_t count, int (*fnc)()) {
+    while (active) {
+      for (uint32_t done = 0; done < count && active; done += blockSize) {
+        z80::FASTWORK stop = block();
+        if ((stop & 0x10000) == 0)
+          return stop;
+      }
+      if (!active)
+        break;
+      int r = fnc();
+      if (r == -1)
+        break;
+      else if (r != 0)
+        z80::pc = 0;
+    }
+    return (z80::pc & 0xffff) | 0x10000;
   }
 
-  uint8_t getNk(uint8_t ascChar) {
-    if (ascChar == '_') {
-      // '_' is used as an 'unknown'
-      return NK_NONE;
+  // Port access and traps while active, called instead of NascomIo and NascomFastLoad
+  uint8_t in(uint32_t port) {
+    if (mode != modeReplay) {
+      uint8_t value = io.in(port);
+      if (mode == modeRecord && numIo < maxIo)
+        ioLog[numIo++] = {(uint16_t)port, value, true};
+      else if (mode == modeRecord)
+        overflow = true;
+      return value;
     }
-    for (uint32_t row = 0; row < mapSize; row++) {
-      for (uint32_t col = 0; col < 7; col++) {
-        if (encoding[row][7-col] == ascChar) {
-          return NK_MAKE(row, col);
-        }
-      }
+    if (ioNext < numIo && ioLog[ioNext].in && ioLog[ioNext].port == port)
+      return ioLog[ioNext++].value;
+    ioDiverged = true;
+    return 0xff;
+  }
+  void out(uint32_t port, uint8_t value) {
+    if (mode != modeReplay) {
+      io.out(port, value);
+      if (mode == modeRecord && numIo < maxIo)
+        ioLog[numIo++] = {(uint16_t)port, value, false};
+      else if (mode == modeRecord)
+        overflow = true;
+      return;
     }
-    return NK_NONE;
+    if (ioNext < numIo && !ioLog[ioNext].in && ioLog[ioNext].port == port && ioLog[ioNext].value == value)
+      ioNext++;
+    else
+      ioDiverged = true;
+  }
+  void trap(uint32_t addr) {
+    if (mode != modeReplay) {
+      trapped = true;
+      fastLoad.trap(addr);
+      return;
+    }
+    ioDiverged = true;
+    z80::pc = addr + 2;
+  }
+  // Called from firstPageWrite() before the page is changed.  Saves the page as it was at
+  // the start of the block
+  void pageWrite(uint32_t page) {
+    z80::dirty[page] = 1;
+    if (pageSlots[page] != 0)
+      return;
+    if (numPages == maxPages) {
+      overflow = true;
+      return;
+    }
+    memcpy(&pageData[numPages*pageSize], &z80::ram[page*pageSize], pageSize);
+    pageHashes[page] = hashPage(page);
+    pageNumbers[numPages] = page;
+    pageSlots[page] = ++numPages;
   }
+};
+const char *const NascomLockstep::engineNames[z80::NUM_ENGINES] = {"plain", "debug", "full", "flat-ram"};
 
-  #define ___ " " // Dummy
-  static constexpr const char *keys          = ";" ":" "["    "]" "-" "," "." "/"    "0" "1" "2"  "3" "4" "5" "6" "7" "8" "9" " ";
-  static constexpr const char *keysShift     = "+" "*" "\\"   "_" "=" "<" ">" "?"    "^" "!" "\"" "#" "$" "%" "&" "'" "(" ")" ___;
-  static constexpr const char *keysCtrl      = "{" ___ "\033" ___ ___ ___ ___ ___    ___ ___ ___  ___ ___ ___ ___ ___ ___ ___ "`";
-  static constexpr const char *keysShiftCtrl = ___ ___ ___    ___ "}" "|" "~" "\177" ___ ___ ___  ___ ___ ___ ___ ___ ___ ___ ___;
+// Nascom benchmark, batch jobs and scripts
+// Runs the workloads in /bench.txt (SD card, or internal flash) unthrottled when F3 is
+// pressed (F5 with NascomLockstep checking), and reports each as a JSON line on the serial
+// port and in /bench.jsonl on the SD card (or internal flash):
+//   {"workload":"basic-primes","result":"ok","instructions":...,"wall_ms":...,
+//    "est_mhz":...,"ns_per_insn":...,"version":"V1.1","build":"...","screen":[...]}
+// The machine is saved in /bench.nss on the internal flash first, and restored when the
+// run ends.
+// instructions and wall_ms are measured from the run step to the completion marker, or from
+// the start of a workload without a run step to its end, with a resolution of one slice of
+// INSN_PER_REFRESH instructions.  The core doesn't count cycles, so est_mhz assumes
+// ESTIMATED_CYCLES_PER_INSN cycles per instruction; a real Nascom-2 is 4.  screen is only
+// there after a capture step.
+//
+// Batch jobs on the device are workloads too: If the SD card has /jobs.txt at power on, it is
+// run the same way, one job after the other, with the results in /jobs.jsonl.  The file is
+// read a line at a time, so it can hold any number of jobs.  This is not a host runner with a
+// machine per core: simz80 keeps the one Z80 in globals.
+//
+// Each workload starts from a cold boot (cleared RAM and the ROM images), with fast tape load
+// on.  Workload file, one step per line, # starts a comment:
+//   rom <file>...     Sets the ROM images for the next workloads (default nassys3.nal basic.nal)
+//   workload <name>   Starts a workload
+//   load <file>       Loads a memory image from the internal flash
+//   tape <file>       Sets the tape input file (SD card, or internal flash)
+//   type <text>       Types text, one key per keyboard scan.  \r is Enter
+//   key <key>         Types one key: A character, enter, escape, backspace, tab, space, up,
+//                     down, left, right or graph, optionally after shift- and ctrl-
+//   wait <text>       Waits until the screen shows text
+//   match <pattern>   Waits until a screen line matches pattern: * is any characters and ?
+//                     is any character.  Trailing spaces of the line are ignored
+//   sleep <ms>        Waits for emulated time, in slices of 1/UI_REFRESH_RATE s
+//   run <text>        Types text and starts timing.  The next wait is the completion marker
+//   capture [<file>]  Adds the screen as it is now to the result, or writes it to a text file
+//   snapshot save|restore <file>
+//                     Saves or restores the machine (SD card, or internal flash)
+//   timeout <s>       Emulated seconds before the workload fails (default 600)
+// The screen is only searched when NascomDisplay reports changed lines, so waits cost nothing
+// while the screen is unchanged.
 
-  static constexpr const uint8_t ascNkMap[32] = {
-    NK_SPACE|NK_CTRL_MASK, NK_A|NK_CTRL_MASK, NK_B|NK_CTRL_MASK, NK_C|NK_CTRL_MASK,           //  0 -  3
-    NK_D|NK_CTRL_MASK,     NK_E|NK_CTRL_MASK, NK_F|NK_CTRL_MASK, NK_G|NK_CTRL_MASK,           //  4 -  7
-    NK_H|NK_CTRL_MASK,     NK_I|NK_CTRL_MASK, NK_J|NK_CTRL_MASK, NK_K|NK_CTRL_MASK,           //  8 - 11
-    NK_L|NK_CTRL_MASK,     NK_M|NK_CTRL_MASK, NK_N|NK_CTRL_MASK, NK_O|NK_CTRL_MASK,           // 12 - 15
-    NK_P|NK_CTRL_MASK,     NK_Q|NK_CTRL_MASK, NK_R|NK_CTRL_MASK, NK_S|NK_CTRL_MASK,           // 16 - 19
-    NK_T|NK_CTRL_MASK,     NK_U|NK_CTRL_MASK, NK_V|NK_CTRL_MASK, NK_W|NK_CTRL_MASK,           // 20 - 23
-    NK_X|NK_CTRL_MASK,     NK_Y|NK_CTRL_MASK, NK_Z|NK_CTRL_MASK, NK_LEFTBRACKET|NK_CTRL_MASK, // 24 - 27
-    NK_LEFTBRACKET|NK_SHIFT_MASK|NK_CTRL_MASK, NK_RIGHTBRACKET|NK_CTRL_MASK, NK_0|NK_SHIFT_MASK|NK_CTRL_MASK, NK_RIGHTBRACKET|NK_SHIFT_MASK|NK_CTRL_MASK // 28 - 31
+class NascomBenchmark {
+  static const uint32_t maxText = 80;
+  static const uint32_t defaultTimeout = 600;
+  static const uint32_t screenRows = 16;
+  static const uint32_t screenColumns = 48;
+  static constexpr const char *defaultRoms = "nassys3.nal basic.nal";
+  static constexpr const char *sessionFileName = "/bench.nss";
+
+  // Keys of the key step with a character are typed, the others are pressed
+  struct Key {
+    const char *name;
+    char        ascChar;
+    uint8_t     nk;
   };
+  static const Key keys[10];
 
-  uint8_t getNascomKey(uint8_t ascChar) {
-    // Handle upper/lower case letters.
-    // Lowercase should be mapped to uppercase and vice versa
-    if (isupper(ascChar) || ascChar == '@') {
-      // for some reason '@' requires SHIFT
-      return getNk(ascChar) | NK_SHIFT_MASK;
+  NascomDisplay  &display;
+  NascomMemory   &memory;
+  NascomKeyboard &keyboard;
+  NascomTape     &tape;
+  NascomUart     &uart;
+  NascomFastLoad &fastLoad;
+  NascomSnapshot &snapshot;
+  NascomControl  &control;
+  NascomLockstep &lockstep;
+  uint32_t        sliceInstructions;
+  NascomUart::Mode uartMode = NascomUart::off;
+  bool            tapeFastLoad = true;
+  File            steps;
+  const char     *resultFileName = nullptr;
+  char            roms[maxText + 1] = "";
+  char            name[24 + 1] = "";
+  char            text[maxText + 1] = "";
+  char            waitText[maxText + 1] = "";
+  bool            waitPattern = false;
+  uint16_t        waitRows = 0;
+  uint32_t        sleepSlices = 0;
+  char            restoreFileName[maxText + 2] = "";
+  char           *screen = nullptr;
+  bool            timing = false;
+  bool            reported = true;
+  uint32_t        slices = 0;
+  uint32_t        timeoutSlices = 0;
+  uint32_t        startUs = 0;
+  uint32_t        numWorkloads = 0;
+  uint32_t        numFailed = 0;
+  bool            bootRequest = false;
+  bool            session = false;          // The machine is saved in sessionFileName
+  bool            sessionRequest = false;
+
+  // Reads the next line into line[], without the newline.  False at the end
+  bool nextLine(char *line, size_t size) {
+    if (!steps || !steps.available())
+      return false;
+    size_t len = 0;
+    int    c;
+    while ((c = steps.read()) >= 0 && c != '\n') {
+      if (c != '\r' && len < size - 1)
+        line[len++] = c;
     }
-    else if (islower(ascChar)) {
-      return getNk(toupper(ascChar));
+    line[len] = 0;
+    return true;
+  }
+  // Copies the text argument of a step, with \r as Enter
+  static void copyText(char *to, const char *from) {
+    size_t len = 0;
+    for (; *from != 0 && len < maxText; from++) {
+      if (from[0] == '\\' && from[1] == 'r') {
+        to[len++] = '\r';
+        from++;
+      }
+      else {
+        to[len++] = *from;
+      }
     }
-
-    // Check if ascChar is in the keyboard map
-    uint8_t nk = getNk(ascChar);
-    if (nk != NK_NONE) {
-      return nk;
+    to[len] = 0;
+  }
+  // Screen line y, 0 is the top line.  The top line is at 0BCA, the others from 080A
+  static const uint8_t *screenLine(uint32_t y) {
+    return &z80::ram[0x800 + ((y + screenRows - 1) % screenRows)*64 + 10];
+  }
+  // Matches all of text against pattern, with * for any characters and ? for any character
+  static bool globMatch(const char *pattern, const char *text) {
+    const char *star = nullptr;
+    const char *starText = nullptr;
+    while (*text != 0) {
+      if (*pattern == '?' || (*pattern != '*' && *pattern == *text)) {
+        pattern++;
+        text++;
+      }
+      else if (*pattern == '*') {
+        star = pattern++;
+        starText = text;
+      }
+      else if (star != nullptr) {
+        pattern = star + 1;
+        text = ++starText;
+      }
+      else {
+        return false;
+      }
     }
-    // Check if ascChar is in the set of chars that must use SHIFT and be remapped
-    for (uint32_t i = 0; keysShift[i] != 0; i++) {
-      if (keysShift[i] == ascChar) {
-        return getNk(keys[i]) | NK_SHIFT_MASK;
+    while (*pattern == '*')
+      pattern++;
+    return *pattern == 0;
+  }
+  bool lineMatches(uint32_t y) {
+    const uint8_t *line = screenLine(y);
+    if (!waitPattern) {
+      size_t len = strlen(waitText);
+      for (uint32_t col = 0; col + len <= screenColumns; col++) {
+        if (memcmp(&line[col], waitText, len) == 0)
+          return true;
       }
+      return false;
     }
-    // Check if ascChar is in the set of chars that must use CTRL and be remapped
-    for (uint32_t i = 0; keysCtrl[i] != 0; i++) {
-      if (keysCtrl[i] == ascChar) {
-        return getNk(keys[i]) | NK_CTRL_MASK;
+    char   text[screenColumns + 1];
+    size_t len = screenColumns;
+    memcpy(text, line, len);
+    while (len > 0 && text[len - 1] == ' ')
+      len--;
+    text[len] = 0;
+    return globMatch(waitText, text);
+  }
+  // Searches the lines that changed since the last search
+  bool screenMatches() {
+    uint16_t rows = waitRows;
+    waitRows = 0;
+    for (uint32_t y = 0; y < screenRows; y++) {
+      if ((rows & (1 << y)) != 0 && lineMatches(y))
+        return true;
+    }
+    return false;
+  }
+  void startWait(const char *text, bool pattern) {
+    copyText(waitText, text);
+    waitPattern = pattern;
+    waitRows = 0xffff;
+  }
+  // Writes the screen as 16 lines of text.  Graphics characters are written as '.'
+  void writeScreen(const char *fileName) {
+    FS  *fs = control.getHasSd() ? (FS *)&SD : (FS *)&LittleFS;
+    File file = fs->open(fileName, "w");
+    if (!file) {
+      DEBUG_PRINTF("NascomBenchmark: Cannot create %s\n", fileName);
+      return;
+    }
+    for (uint32_t y = 0; y < screenRows; y++) {
+      const uint8_t *line = screenLine(y);
+      char           text[screenColumns + 2];
+      for (uint32_t col = 0; col < screenColumns; col++)
+        text[col] = line[col] >= 32 && line[col] < 127 ? line[col] : '.';
+      text[screenColumns] = '\n';
+      file.write((const uint8_t *)text, screenColumns + 1);
+    }
+    file.close();
+  }
+  // Types or presses the key of a key step
+  void typeKey(const char *name) {
+    bool shift = false;
+    bool ctrl = false;
+    while (true) {
+      if (strncmp(name, "shift-", 6) == 0 && name[6] != 0) {
+        shift = true;
+        name += 6;
+      }
+      else if (strncmp(name, "ctrl-", 5) == 0 && name[5] != 0) {
+        ctrl = true;
+        name += 5;
+      }
+      else {
+        break;
       }
     }
-    // Check if ascChar is in the set of chars that must use SHIFT+CTRL and be remapped
-    for (uint32_t i = 0; keysShiftCtrl[i] != 0; i++) {
-      if (keysShiftCtrl[i] == ascChar) {
-        return getNk(keys[i]) | NK_SHIFT_MASK | NK_CTRL_MASK;
+    char ascChar = name[1] == 0 ? name[0] : 0;
+    for (uint32_t ki = 0; ascChar == 0 && ki < sizeof(keys)/sizeof(keys[0]); ki++) {
+      if (strcmp(name, keys[ki].name) != 0)
+        continue;
+      if (keys[ki].ascChar == 0) {
+        keyboard.press(keys[ki].nk | (shift ? NK_SHIFT_MASK : 0) | (ctrl ? NK_CTRL_MASK : 0));
+        return;
       }
+      ascChar = keys[ki].ascChar;
     }
-    if (ascChar < 32) {
-      return ascNkMap[ascChar];
+    if (ascChar == 0) {
+      DEBUG_PRINTF("NascomBenchmark: Unknown key: %s\n", name);
+      return;
     }
-    return NK_NONE;
+    text[0] = ctrl ? ascChar & 0x1f : ascChar;
+    text[1] = 0;
+    keyboard.type(text);
+  }
+  // Copies the screen as a JSON array of strings, top line first.  Graphics characters are
+  // shown as '.'
+  void captureScreen() {
+    const size_t size = screenRows*(screenColumns*2 + 3) + 3;
+    if (screen == nullptr)
+      screen = (char *)malloc(size);
+    if (screen == nullptr)
+      return;
+    size_t len = 0;
+    screen[len++] = '[';
+    for (uint32_t ri = 0; ri < screenRows; ri++) {
+      // The top line is at 0BCA, the others from 080A
+      uint32_t       row = (ri + screenRows - 1) % screenRows;
+      const uint8_t *line = &z80::ram[0x800 + row*64 + 10];
+      screen[len++] = '"';
+      for (uint32_t col = 0; col < screenColumns; col++) {
+        uint8_t c = line[col];
+        if (c == '"' || c == '\\')
+          screen[len++] = '\\';
+        screen[len++] = c >= 32 && c < 127 ? c : '.';
+      }
+      screen[len++] = '"';
+      if (ri < screenRows - 1)
+        screen[len++] = ',';
+    }
+    screen[len++] = ']';
+    screen[len] = 0;
+  }
+  void coldBoot() {
+    memset(z80::ram, 0, sizeof(z80::ram));
+    char        fileName[maxText + 2];
+    const char *rom = roms;
+    while (*rom != 0) {
+      size_t len = strcspn(rom, " ");
+      if (len > 0) {
+        snprintf(fileName, sizeof(fileName), "/%.*s", (int)len, rom);
+        if (!memory.load(fileName))
+          DEBUG_PRINTF("NascomBenchmark: Cannot load %s\n", fileName);
+      }
+      rom += len + strspn(&rom[len], " ");
+    }
+    fastLoad.install(memory);
+    z80::af[0] = z80::af[1] = 0;
+    z80::af_sel = 0;
+    memset(z80::regs, 0, sizeof(z80::regs));
+    z80::regs_sel = 0;
+    z80::ir = z80::ix = z80::iy = z80::sp = 0;
+    z80::IFF = 0;
+    z80::pc = 0;
+    keyboard.type("");
+    tape.setLed(false);
+    tape.setFastLoad(true);
+  }
+  void report(bool ok) {
+    char     line[256];
+    uint32_t us = micros() - startUs;
+    uint64_t instructions = (uint64_t)slices*sliceInstructions;
+    double   seconds = us/1e6;
+    snprintf(line, sizeof(line),
+             "{\"workload\":\"%s\",\"result\":\"%s\",\"instructions\":%llu,\"wall_ms\":%u,"
+             "\"est_mhz\":%.2f,\"ns_per_insn\":%.1f,\"version\":\"%s\",\"build\":\"%s\"",
+             name, ok ? "ok" : "timeout", (unsigned long long)instructions, us/1000,
+             us == 0 ? 0.0 : instructions*ESTIMATED_CYCLES_PER_INSN/seconds/1e6,
+             instructions == 0 ? 0.0 : us*1000.0/instructions, version, buildDate);
+    const char *screenText = screen != nullptr && screen[0] != 0 ? screen : nullptr;
+    REPORT_PRINTF("%s", line);
+    if (screenText != nullptr)
+      REPORT_PRINTF(",\"screen\":%s", screenText);
+    REPORT_PRINTF("}\n");
+    FS  *fs = control.getHasSd() ? (FS *)&SD : (FS *)&LittleFS;
+    File file = fs->open(resultFileName, "a");
+    if (file) {
+      file.print(line);
+      if (screenText != nullptr)
+        file.printf(",\"screen\":%s", screenText);
+      file.print("}\n");
+      file.close();
+    }
+    numWorkloads++;
+    numFailed += ok ? 0 : 1;
+    reported = true;
+  }
+  // Reports a workload without a run step when it ends
+  void endWorkload() {
+    if (!reported)
+      report(true);
+    if (screen != nullptr)
+      screen[0] = 0;
+  }
+  // Runs steps until one has to wait for the machine.  Returns true for a cold boot
+  bool step() {
+    char line[maxText + 16];
+    while (nextLine(line, sizeof(line))) {
+      char *arg = strchr(line, ' ');
+      if (arg != nullptr)
+        *arg++ = 0;
+      else
+        arg = &line[strlen(line)];
+      if (line[0] == '#' || line[0] == 0) {
+        continue;
+      }
+      else if (strcmp(line, "workload") == 0) {
+        endWorkload();
+        strncpy(name, arg, sizeof(name) - 1);
+        timing = false;
+        reported = false;
+        slices = 0;
+        timeoutSlices = defaultTimeout*UI_REFRESH_RATE;
+        startUs = micros();
+        bootRequest = true;
+        return true;
+      }
+      else if (strcmp(line, "rom") == 0) {
+        strncpy(roms, arg, sizeof(roms) - 1);
+      }
+      else if (strcmp(line, "load") == 0) {
+        if (!memory.load(arg))
+          DEBUG_PRINTF("NascomBenchmark: Cannot load %s\n", arg);
+      }
+      else if (strcmp(line, "tape") == 0) {
+        snprintf(text, sizeof(text), "/%s", arg[0] == '/' ? &arg[1] : arg);
+        tape.setInputFile(control.getHasSd() && SD.exists(text) ? (FS *)&SD : (FS *)&LittleFS, text);
+      }
+      else if (strcmp(line, "type") == 0 || strcmp(line, "run") == 0) {
+        copyText(text, arg);
+        keyboard.type(text);
+        if (line[0] == 'r') {
+          timing = true;
+          slices = 0;
+          startUs = micros();
+        }
+        return false;
+      }
+      else if (strcmp(line, "key") == 0) {
+        typeKey(arg);
+        return false;
+      }
+      else if (strcmp(line, "wait") == 0 || strcmp(line, "match") == 0) {
+        startWait(arg, line[0] == 'm');
+        return false;
+      }
+      else if (strcmp(line, "sleep") == 0) {
+        sleepSlices = (atoi(arg)*UI_REFRESH_RATE + 999)/1000;
+        return false;
+      }
+      else if (strcmp(line, "capture") == 0) {
+        if (arg[0] == 0) {
+          captureScreen();
+        }
+        else {
+          snprintf(text, sizeof(text), "/%s", arg[0] == '/' ? &arg[1] : arg);
+          writeScreen(text);
+        }
+      }
+      else if (strcmp(line, "snapshot") == 0) {
+        char *file = strchr(arg, ' ');
+        if (file != nullptr)
+          *file++ = 0;
+        if (file != nullptr && strcmp(arg, "restore") == 0) {
+          snprintf(restoreFileName, sizeof(restoreFileName), "/%s", file[0] == '/' ? &file[1] : file);
+          return true;
+        }
+        else if (file != nullptr && strcmp(arg, "save") == 0) {
+          snprintf(text, sizeof(text), "/%s", file[0] == '/' ? &file[1] : file);
+          if (!snapshot.save(control.getHasSd() ? (FS *)&SD : (FS *)&LittleFS, text))
+            DEBUG_PRINTF("NascomBenchmark: %s: %s\n", text, snapshot.getError());
+        }
+        else {
+          DEBUG_PRINTF("NascomBenchmark: Unknown snapshot step: %s\n", arg);
+        }
+      }
+      else if (strcmp(line, "timeout") == 0) {
+        timeoutSlices = atoi(arg)*UI_REFRESH_RATE;
+      }
+      else {
+        DEBUG_PRINTF("NascomBenchmark: Unknown step: %s\n", line);
+      }
+    }
+    return finish();
+  }
+  // Reports a timeout and skips to the next workload
+  void fail() {
+    if (screen == nullptr || screen[0] == 0)
+      captureScreen();
+    report(false);
+    if (screen != nullptr)
+      screen[0] = 0;
+    waitText[0] = 0;
+    sleepSlices = 0;
+    timing = false;
+    keyboard.type("");
+    char   line[maxText + 16];
+    size_t last = steps.position();
+    while (nextLine(line, sizeof(line)) && strncmp(line, "workload ", 9) != 0)
+      last = steps.position();
+    steps.seek(last);
+  }
+  // Returns true when the saved session must be restored
+  bool finish() {
+    endWorkload();
+    REPORT_PRINTF("{\"suite\":\"done\",\"workloads\":%u,\"failed\":%u}\n", numWorkloads, numFailed);
+    steps.close();
+    steps = File();
+    free(screen);
+    screen = nullptr;
+    keyboard.type("");
+    lockstep.finish();
+    uart.setMode(uartMode);
+    tape.setFastLoad(tapeFastLoad);
+    sessionRequest = session;
+    session = false;
+    return sessionRequest;
+  }
+  // Starts a run from the keyboard, after saving the machine
+  bool startSession() {
+    if (!snapshot.save(&LittleFS, sessionFileName)) {
+      DEBUG_PRINTF("NascomBenchmark: %s\n", snapshot.getError());
+      return false;
+    }
+    if (!start()) {
+      LittleFS.remove(sessionFileName);
+      return false;
+    }
+    session = true;
+    return true;
   }
 
 public:
-  NascomKeyboardMap() {
-    mainTaskId = xTaskGetCurrentTaskHandle();
+  NascomBenchmark(NascomDisplay &display, NascomMemory &memory, NascomKeyboard &keyboard, NascomTape &tape,
+                  NascomUart &uart, NascomFastLoad &fastLoad, NascomSnapshot &snapshot, NascomControl &control,
+                  NascomLockstep &lockstep, uint32_t sliceInstructions) :
+    display(display), memory(memory), keyboard(keyboard), tape(tape), uart(uart), fastLoad(fastLoad), snapshot(snapshot),
+    control(control), lockstep(lockstep), sliceInstructions(sliceInstructions) {}
+
+  bool start(const char *fileName = "/bench.txt", const char *resultFileName = "/bench.jsonl") {
+    FS *fs = control.getHasSd() && SD.exists(fileName) ? (FS *)&SD : (FS *)&LittleFS;
+    steps = fs->open(fileName, "r");
+    if (!steps) {
+      DEBUG_PRINTF("NascomBenchmark: Cannot open %s\n", fileName);
+      return false;
+    }
+    this->resultFileName = resultFileName;
+    strcpy(roms, defaultRoms);
+    waitText[0] = 0;
+    sleepSlices = 0;
+    restoreFileName[0] = 0;
+    name[0] = 0;
+    timing = false;
+    reported = true;
+    slices = 0;
+    timeoutSlices = defaultTimeout*UI_REFRESH_RATE;
+    keyboard.type("");
+    numWorkloads = 0;
+    numFailed = 0;
+    // The workloads load from the tape, with fast load on
+    uartMode = uart.getMode();
+    uart.setMode(NascomUart::off);
+    tapeFastLoad = tape.getFastLoad();
+    DEBUG_PRINTF("NascomBenchmark: Running %s\n", fileName);
+    return true;
   }
-  void reset() {
-    memset(map, 0, sizeof(map));
+  bool getRunning() {
+    return steps;
   }
-
-  bool setAsciiChar(uint8_t ascChar, bool down) {
-    uint8_t nk = getNascomKey(ascChar);
-    //DEBUG_PRINTF("nk: %02x (%d, %d) %s %s\n", nk, NK_ROW(nk), NK_COL(nk), NK_HAS_SHIFT(nk) ? "SHIFT" : "", NK_HAS_CTRL(nk) ? "CTRL" : "");
-    if (nk != NK_NONE) {
-      mapIsUpdating = true;
-      setKeyAll(nk, down);
-      mapIsUpdating = false;
+  // Called by the CPU loop between slices.  Returns true if the machine was cold booted or
+  // restored from a snapshot
+  bool boot() {
+    if (bootRequest) {
+      bootRequest = false;
+      coldBoot();
+      return true;
+    }
+    if (sessionRequest) {
+      sessionRequest = false;
+      if (!snapshot.restore(&LittleFS, sessionFileName))
+        DEBUG_PRINTF("NascomBenchmark: %s: %s\n", sessionFileName, snapshot.getError());
+      LittleFS.remove(sessionFileName);
+      return true;
+    }
+    if (restoreFileName[0] != 0) {
+      if (!snapshot.restore(control.getHasSd() ? (FS *)&SD : (FS *)&LittleFS, restoreFileName))
+        DEBUG_PRINTF("NascomBenchmark: %s: %s\n", restoreFileName, snapshot.getError());
+      restoreFileName[0] = 0;
+      keyboard.type("");
       return true;
     }
     return false;
   }
+  // Called once per slice, after the display update.  Returns true when the machine must be
+  // cold booted or restored.  The slice must then end, and the CPU loop calls boot() before
+  // the next one
+  bool tick() {
+    bool check = keyboard.takeLockstepRequest();
+    if ((keyboard.takeBenchmarkRequest() || check) && !getRunning() && startSession() && check)
+      lockstep.start(z80::ENGINE_FULL);
+    waitRows |= display.getChangedRows();
+    if (!getRunning())
+      return false;
+    slices++;
+    if ((waitText[0] != 0 || keyboard.isTyping()) && slices >= timeoutSlices)
+      fail();
+    if (sleepSlices != 0) {
+      sleepSlices--;
+      return false;
+    }
+    if (waitText[0] != 0) {
+      if (!screenMatches())
+        return false;
+      waitText[0] = 0;
+      if (timing) {
+        report(true);
+        timing = false;
+      }
+    }
+    if (keyboard.isTyping())
+      return false;
+    return step();
+  }
+};
+const NascomBenchmark::Key NascomBenchmark::keys[10] = {
+  {"enter", '\r', 0}, {"escape", '\033', 0}, {"backspace", '\b', 0}, {"tab", '\t', 0}, {"space", ' ', 0},
+  {"up", 0, NK_UP}, {"down", 0, NK_DOWN}, {"left", 0, NK_LEFT}, {"right", 0, NK_RIGHT}, {"graph", 0, NK_GRAPH}
+};
 
-  void setKey(uint8_t nk, bool down) {
-    set(NK_ROW(nk), NK_COL(nk), down);
+// Nascom conformance runner
+// Runs the CP/M instruction set exercisers /prelim.com, /zexdoc.com and /zexall.com from the
+// SD card (or internal flash) when F4 is pressed, to check the Z80 core.  The programs are
+// not included.  The machine is saved in /conform.nss on the internal flash first, and
+// restored when the run ends or F1 aborts it.
+//
+// Each program runs alone on a CP/M style machine: All of the 64K is RAM (FEATURE_FLAT_RAM),
+// the program is loaded at 0100, 0000 holds a HALT that ends it (warm boot), and 0005 jumps
+// to a BDOS shim at FF00 that writes to CONSOLE_PORT for function 2 (character in E) and 9
+// (string at DE, ending with $).  The console output is copied to the serial port, and each
+// test group result ("<group>.... OK" or "... ERROR ...") is reported as a JSON line on the
+// serial port and in /conform.jsonl on the SD card (or internal flash):
+//   {"program":"zexdoc","group":"aluop a,nn","result":"ok","instructions":...,"wall_ms":...,
+//    "mips":...}
+// instructions and wall_ms are measured from the previous result, with a resolution of one
+// slice of sliceInstructions instructions.  The screen is not updated during the run.
+// The same programs, and per-opcode cases for all interpreter instances, run on the host
+// with "pio test -e native" (test/test_simz80).
+
+class NascomConformance : public Print {
+  static const uint32_t maxLine = 80;
+  static const uint16_t bdos = 0xff00;
+  static constexpr const char *snapshotFileName = "/conform.nss";
+  static constexpr const char *resultFileName = "/conform.jsonl";
+  static const char    *const programs[3];
+  static const uint8_t  bdosCode[21];
+
+  NascomKeyboard &keyboard;
+  NascomIo       &io;
+  NascomSnapshot &snapshot;
+  NascomControl  &control;
+  uint32_t        sliceInstructions;
+  bool            request = false;
+  char            program[12 + 1] = "";
+  char            line[maxLine + 1] = "";
+  uint32_t        lineLen = 0;
+  uint32_t        slices = 0;
+  uint32_t        startUs = 0;
+  uint32_t        numPrograms = 0;
+  uint32_t        numGroups = 0;
+  uint32_t        numFailed = 0;
+
+  static NascomConformance *self;
+
+  static int simAction() {
+    self->slices++;
+    yield();
+    return self->control.getIsActive() ? -1 : 0;
+  }
+  void report(const char *group, const char *result) {
+    char     text[256];
+    uint32_t us = micros() - startUs;
+    uint64_t instructions = (uint64_t)slices*sliceInstructions;
+    snprintf(text, sizeof(text),
+             "{\"program\":\"%s\",\"group\":\"%s\",\"result\":\"%s\",\"instructions\":%llu,\"wall_ms\":%u,"
+             "\"mips\":%.2f}\n",
+             program, group, result, (unsigned long long)instructions, us/1000,
+             us == 0 ? 0.0 : (double)instructions/us);
+    REPORT_PRINTF("%s", text);
+    FS  *fs = control.getHasSd() ? (FS *)&SD : (FS *)&LittleFS;
+    File file = fs->open(resultFileName, "a");
+    if (file) {
+      file.print(text);
+      file.close();
+    }
+    numGroups++;
+    numFailed += strcmp(result, "ok") == 0 ? 0 : 1;
+    slices = 0;
+    startUs = micros();
+  }
+  // Reports a console line with a test group result.  The group name is the text before
+  // the dots
+  void endLine() {
+    line[lineLen] = 0;
+    bool ok = lineLen >= 2 && strcmp(&line[lineLen - 2], "OK") == 0;
+    const char *error = strstr(line, "ERROR");
+    if (!ok && error == nullptr)
+      return;
+    const char *end = strstr(line, "..");
+    if (end == nullptr)
+      end = error != nullptr ? error : &line[lineLen - 2];
+    while (end > line && end[-1] == ' ')
+      end--;
+    char group[maxLine + 1];
+    if (end == line)
+      strcpy(group, program);
+    else
+      snprintf(group, sizeof(group), "%.*s", (int)(end - line), line);
+    for (char *c = group; *c != 0; c++) {
+      if (*c == '"' || *c == '\\')
+        *c = '\'';
+    }
+    report(group, error != nullptr ? "error" : "ok");
+  }
+  // Returns false if the run was aborted
+  bool runProgram(FS *fs, const char *fileName) {
+    File file = fs->open(fileName, "r");
+    if (!file)
+      return true;
+    memset(z80::ram, 0, sizeof(z80::ram));
+    file.read(&z80::ram[0x100], bdos - 0x100);
+    file.close();
+    z80::ram[0x0000] = 0x76;                  // HALT
+    z80::ram[0x10000] = z80::ram[0x0000];
+    z80::ram[0x0005] = 0xc3;                  // JP bdos, also the top of the memory
+    z80::ram[0x0006] = bdos & 0xff;
+    z80::ram[0x0007] = bdos >> 8;
+    memcpy(&z80::ram[bdos], bdosCode, sizeof(bdosCode));
+    z80::af[0] = z80::af[1] = 0;
+    z80::af_sel = 0;
+    memset(z80::regs, 0, sizeof(z80::regs));
+    z80::regs_sel = 0;
+    z80::ir = z80::ix = z80::iy = 0;
+    z80::IFF = 0;
+    z80::sp = bdos;
+    z80::pc = 0x100;
+    snprintf(program, sizeof(program), "%s", &fileName[1]);
+    char *dot = strchr(program, '.');
+    if (dot != nullptr)
+      *dot = 0;
+    DEBUG_PRINTF("NascomConformance: Running %s\n", fileName);
+    lineLen = 0;
+    slices = 0;
+    startUs = micros();
+    while ((z80::simz80(z80::pc, sliceInstructions, simAction) & 0x10000) != 0) {
+      if (control.getIsActive()) {
+        report(program, "aborted");
+        return false;
+      }
+    }
+    if (z80::pc != 0x0001) {
+      char group[24];
+      snprintf(group, sizeof(group), "HALT at %04x", (z80::pc - 1) & 0xffff);
+      report(group, "halt");
+    }
+    return true;
   }
 
-  void setKeyAll(uint8_t nk, bool down) {
-    if (NK_HAS_SHIFT(nk)) {
-      setKey(NK_SHIFT, down);
+public:
+  NascomConformance(NascomKeyboard &keyboard, NascomIo &io, NascomSnapshot &snapshot, NascomControl &control,
+                    uint32_t sliceInstructions) :
+    keyboard(keyboard), io(io), snapshot(snapshot), control(control), sliceInstructions(sliceInstructions) {
+    self = this;
+  }
+  // Console output of the programs
+  size_t write(uint8_t c) override {
+    REPORT_PRINTF("%c", c);
+    if (c == '\n') {
+      endLine();
+      lineLen = 0;
     }
-    if (NK_HAS_CTRL(nk)) {
-      setKey(NK_CTRL, down);
+    else if (c != '\r' && lineLen < maxLine) {
+      line[lineLen++] = c;
     }
-    setKey(nk, down);
+    return 1;
   }
-  
-  void rewind() {
-    mapIndex = 0;
-    if (!mapIsUpdating) {
-      memcpy(mapSnapshot, map, mapSize);
+  // Called once per slice.  Returns true when a run is requested.  The slice must then end,
+  // and the CPU loop calls run() before the next one
+  bool tick() {
+    if (keyboard.takeConformanceRequest())
+      request = true;
+    return request;
+  }
+  // Called by the CPU loop between slices.  Returns true if the programs were run and the
+  // machine restored
+  bool run() {
+    if (!request)
+      return false;
+    request = false;
+    if (!snapshot.save(&LittleFS, snapshotFileName)) {
+      DEBUG_PRINTF("NascomConformance: %s\n", snapshot.getError());
+      return false;
+    }
+    int features = z80::features;
+    z80::features = FEATURE_FLAT_RAM;
+    io.setConsole(this);
+    numPrograms = 0;
+    numGroups = 0;
+    numFailed = 0;
+    for (uint32_t pi = 0; pi < sizeof(programs)/sizeof(programs[0]); pi++) {
+      FS *fs = control.getHasSd() && SD.exists(programs[pi]) ? (FS *)&SD : (FS *)&LittleFS;
+      if (!fs->exists(programs[pi]))
+        continue;
+      numPrograms++;
+      if (!runProgram(fs, programs[pi]))
+        break;
     }
+    io.setConsole(nullptr);
+    z80::features = features;
+    REPORT_PRINTF("{\"suite\":\"conformance\",\"programs\":%u,\"groups\":%u,\"failed\":%u}\n",
+                  numPrograms, numGroups, numFailed);
+    if (!snapshot.restore(&LittleFS, snapshotFileName))
+      DEBUG_PRINTF("NascomConformance: %s\n", snapshot.getError());
+    LittleFS.remove(snapshotFileName);
+    return true;
   }
+};
+NascomConformance *NascomConformance::self = nullptr;
+const char *const  NascomConformance::programs[3] = {"/prelim.com", "/zexdoc.com", "/zexall.com"};
+// BDOS functions 2 and 9 at FF00
+const uint8_t      NascomConformance::bdosCode[21] = {
+  0x79,             //       LD   A,C
+  0xfe, 0x02,       //       CP   2
+  0x28, 0x0c,       //       JR   Z,CHAR
+  0xfe, 0x09,       //       CP   9
+  0xc0,             //       RET  NZ
+  0x1a,             // STR:  LD   A,(DE)
+  0xfe, 0x24,       //       CP   '$'
+  0xc8,             //       RET  Z
+  0xd3, 0xff,       //       OUT  (CONSOLE_PORT),A
+  0x13,             //       INC  DE
+  0x18, 0xf7,       //       JR   STR
+  0x7b,             // CHAR: LD   A,E
+  0xd3, 0xff,       //       OUT  (CONSOLE_PORT),A
+  0xc9              //       RET
+};
 
-  void step() {
-    mapIndex += 1;
-    if (mapIndex == mapSize)
-      mapIndex = 0;
+#ifdef Z80_GDB
+// Nascom GDB stub
+// GDB remote serial protocol server for the emulated Z80, on the serial port.  Connect with
+//   (gdb) set architecture z80
+//   (gdb) target remote /dev/ttyUSB0
+// The machine stops when GDB connects or sends an interrupt (Ctrl-C), and then only runs on
+// continue or step.  Breakpoints (Z0, Z1) and watchpoints (Z2-Z4) use NascomDebugger, so they
+// can also be seen and edited on the debug screen.  Memory reads, hex (m) or binary (x),
+// are written to the stream in chunks while the checksum is computed.  GDB sizes its reads
+// from PacketSize, so a 64 KB dump takes 16 binary or 32 hex packets.
+//
+// Registers in GDB's z80 order: AF BC DE HL SP PC IX IY AF' BC' DE' HL' IR
+//
+// The stub works on any Stream.  DEBUG_PRINTF is off in this build, because it shares the
+// serial port.
+
+class NascomGdbStub {
+  static const uint32_t maxPacket = 4096;  // Largest packet received, PacketSize=1000
+  static const uint32_t maxRead   = maxPacket;  // GDB doesn't ask for more
+  static const uint32_t numRegs   = 13;
+
+  static Stream         *stream;
+  static NascomDebugger *debugger;
+  static bool            attached;
+  static char            packet[maxPacket + 1];
+  static uint8_t         out[256];
+  static uint32_t        outLen;
+  static uint8_t         outSum;
+
+  static int readByte() {
+    int c;
+    while ((c = stream->read()) < 0)
+      delay(1);
+    return c;
+  }
+  static int hexDigit(int c) {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+    return -1;
+  }
+  static uint32_t parseHex(const char *&text) {
+    uint32_t value = 0;
+    for (int d; (d = hexDigit(*text)) >= 0; text++)
+      value = (value << 4) | d;
+    return value;
   }
 
-  uint8_t current() {
-    return mapSnapshot[mapIndex];
+  // Reads a packet into packet[] and acknowledges it.  Returns the packet length, or -1
+  // for an interrupt
+  static int readPacket() {
+    while (true) {
+      int c = readByte();
+      if (c == 0x03)
+        return -1;
+      if (c != '$')
+        continue;
+      uint32_t len = 0;
+      uint8_t  sum = 0;
+      while ((c = readByte()) != '#') {
+        sum += c;
+        if (len < maxPacket)
+          packet[len++] = c;
+      }
+      int check = hexDigit(readByte()) << 4;
+      check |= hexDigit(readByte());
+      if (check != sum) {
+        stream->write('-');
+        continue;
+      }
+      stream->write('+');
+      packet[len] = 0;
+      return len;
+    }
   }
 
-  uint32_t getMapIndex() {
-    return mapIndex;
+  // Replies are built with these, and sent in chunks as they are built
+  static void flushOut() {
+    stream->write(out, outLen);
+    outLen = 0;
+  }
+  static void putRaw(uint8_t c) {
+    if (outLen == sizeof(out))
+      flushOut();
+    out[outLen++] = c;
+  }
+  static void put(uint8_t c) {
+    outSum += c;
+    putRaw(c);
+  }
+  static void putHexByte(uint8_t value) {
+    static const char digits[] = "0123456789abcdef";
+    put(digits[value >> 4]);
+    put(digits[value & 0xf]);
+  }
+  static void putString(const char *text) {
+    while (*text != 0)
+      put(*text++);
+  }
+  static void beginReply() {
+    outSum = 0;
+    putRaw('$');
+  }
+  static void endReply() {
+    putRaw('#');
+    putHexByte(outSum);
+    flushOut();
+  }
+  static void reply(const char *text) {
+    beginReply();
+    putString(text);
+    endReply();
+  }
+
+  static uint16_t *regAddress(uint32_t reg) {
+    switch (reg) {
+      case 0:  return &z80::af[z80::af_sel];
+      case 1:  return &z80::regs[z80::regs_sel].bc;
+      case 2:  return &z80::regs[z80::regs_sel].de;
+      case 3:  return &z80::regs[z80::regs_sel].hl;
+      case 4:  return &z80::sp;
+      case 5:  return &z80::pc;
+      case 6:  return &z80::ix;
+      case 7:  return &z80::iy;
+      case 8:  return &z80::af[1 - z80::af_sel];
+      case 9:  return &z80::regs[1 - z80::regs_sel].bc;
+      case 10: return &z80::regs[1 - z80::regs_sel].de;
+      case 11: return &z80::regs[1 - z80::regs_sel].hl;
+      case 12: return &z80::ir;
+      default: return nullptr;
+    }
+  }
+  static uint16_t parseReg(const char *&text) {
+    uint16_t value = hexDigit(text[0]) << 4 | hexDigit(text[1]) | hexDigit(text[2]) << 12 | hexDigit(text[3]) << 8;
+    text += 4;
+    return value;
+  }
+  static void writeMemory(uint16_t addr, uint8_t value) {
+    z80::MarkDirty(addr);
+    z80::ram[addr] = value;
+    if (addr == 0)
+      z80::ram[0x10000] = value;
   }
 
-  void dump() {
-    for (uint8_t row = 0; row < mapSize; row++) {
-      uint8_t rowValue = map[row];
-      char rowValueStr[9];
-      for (uint8_t i = 0; i < 8; i++) {
-        rowValueStr[i] = (rowValue & (0x80 >> i)) ? '1' : '0';
-      }
-      rowValueStr[8] = 0;
-      DEBUG_PRINTF("%s\n", rowValueStr);
+  static void readRegisters() {
+    beginReply();
+    for (uint32_t reg = 0; reg < numRegs; reg++) {
+      uint16_t value = *regAddress(reg);
+      putHexByte(value & 0xff);
+      putHexByte(value >> 8);
     }
+    endReply();
   }
-};
-constexpr char NascomKeyboardMap::encoding[mapSize][9];
-constexpr uint8_t NascomKeyboardMap::ascNkMap[32];
-
-// Nascom keyboard
-class NascomKeyboard {
-  fabgl::Keyboard        keyboard;
-  NascomKeyboardMap      map;
-  NascomControl         &control;
-  bool                   shiftDown = false;
-  bool                   ctrlDown  = false;
-  const char            *startText;
-  uint32_t               startTextIndex = 0;
-  bool                   startTextKeyDown = false;
-  uint8_t                startTextChar;
-  static NascomKeyboard *self;
-  static void handleVirtualKey(fabgl::VirtualKey *vk, bool down) {
-    DEBUG_PRINTF("%s (%s)\n", self->keyboard.virtualKeyToString(*vk), down ? "down" : "up");
-    if (down && *vk == fabgl::VK_F1) {
-      if (!self->control.getIsActive()) {
-        self->control.activate();
+  static void writeRegisters(const char *text) {
+    for (uint32_t reg = 0; reg < numRegs && strlen(text) >= 4; reg++)
+      *regAddress(reg) = parseReg(text);
+    reply("OK");
+  }
+  static void readRegister(const char *text) {
+    uint16_t *reg = regAddress(parseHex(text));
+    if (reg == nullptr) {
+      reply("E01");
+      return;
+    }
+    beginReply();
+    putHexByte(*reg & 0xff);
+    putHexByte(*reg >> 8);
+    endReply();
+  }
+  static void writeRegister(const char *text) {
+    uint16_t *reg = regAddress(parseHex(text));
+    if (reg == nullptr || *text++ != '=' || strlen(text) < 4) {
+      reply("E01");
+      return;
+    }
+    *reg = parseReg(text);
+    reply("OK");
+  }
+  static void readMemory(const char *text, bool binary) {
+    uint32_t addr = parseHex(text);
+    text++;
+    uint32_t len = parseHex(text);
+    if (len > maxRead)
+      len = maxRead;
+    beginReply();
+    if (binary)
+      put('b');
+    for (uint32_t ai = 0; ai < len; ai++) {
+      uint8_t value = z80::ram[(addr + ai) & 0xffff];
+      if (!binary) {
+        putHexByte(value);
+      }
+      else if (value == '#' || value == '$' || value == '}' || value == '*') {
+        put('}');
+        put(value ^ 0x20);
       }
       else {
-        self->control.deactivate();
+        put(value);
       }
     }
-    if (self->control.getIsActive()) {
-      self->control.handleVirtualKey(vk, self->keyboard, down);
+    endReply();
+  }
+  // M addr,len:hex and X addr,len:binary.  The binary data is already unescaped
+  static void writeMemory(const char *text, const char *end, bool binary) {
+    uint32_t addr = parseHex(text);
+    text++;
+    uint32_t len = parseHex(text);
+    if (*text++ != ':' || (uint32_t)(end - text) < (binary ? len : 2*len)) {
+      reply("E01");
       return;
     }
-    uint8_t shiftCtrlMask = 0;
-    if (*vk == fabgl::VK_LSHIFT || *vk == fabgl::VK_RSHIFT) {
-      self->shiftDown = down;
-    }
-    if (*vk == fabgl::VK_LCTRL || *vk == fabgl::VK_RCTRL) {
-      self->ctrlDown = down;
-    }
-    if (self->shiftDown) {
-      shiftCtrlMask = NK_SHIFT_MASK;
-    }
-    if (self->ctrlDown) {
-      shiftCtrlMask |= NK_CTRL_MASK;
-    }
-    bool mapUpdated = true;
-    // Handle special non-ascii characters
-    switch (*vk) {
-      case fabgl::VK_UP:
-        self->map.setKeyAll(NK_UP | shiftCtrlMask, down);
-        break;
-      case fabgl::VK_DOWN:
-        self->map.setKeyAll(NK_DOWN | shiftCtrlMask, down);
-        break;
-      case fabgl::VK_LEFT:
-        self->map.setKeyAll(NK_LEFT | shiftCtrlMask, down);
-        break;
-      case fabgl::VK_RIGHT:
-        self->map.setKeyAll(NK_RIGHT | shiftCtrlMask, down);
-        break;
-      case fabgl::VK_RETURN:
-        self->map.setKeyAll(NK_ENTER | shiftCtrlMask, down);
-        break;
-      default:
-        mapUpdated = false;
-        break;
+    for (uint32_t ai = 0; ai < len; ai++) {
+      if (binary) {
+        writeMemory(addr + ai, text[ai]);
+      }
+      else {
+        writeMemory(addr + ai, hexDigit(text[2*ai]) << 4 | hexDigit(text[2*ai + 1]));
+      }
     }
-    // Handle ascii characters
-    if (!mapUpdated) {
-      int asc = self->keyboard.virtualKeyToASCII(*vk);
-      DEBUG_PRINTF("ASCII: 0x%02x\n", asc);
-      if (asc != -1)
-        mapUpdated = self->map.setAsciiChar(asc, down);
+    reply("OK");
+  }
+  // Z/z type,addr,kind.  For watchpoints kind is the length
+  static void setBreakpoint(const char *text, bool insert) {
+    uint32_t type = parseHex(text);
+    text++;
+    uint16_t addr = parseHex(text);
+    text++;
+    uint32_t len = parseHex(text);
+    uint16_t last = (len == 0) ? addr : addr + len - 1;
+    static const uint8_t watchKinds[] = {DEBUG_WRITE, DEBUG_READ, DEBUG_READ | DEBUG_WRITE};
+    bool ok = true;
+    if (type <= 1 && insert)
+      ok = debugger->addBreakpoint(addr);
+    else if (type <= 1)
+      debugger->removeBreakpoint(addr);
+    else if (type <= 4 && insert)
+      ok = debugger->addWatchpoint(addr, last, watchKinds[type - 2]);
+    else if (type <= 4)
+      debugger->removeWatchpoint(addr, last, watchKinds[type - 2]);
+    else {
+      reply("");
+      return;
     }
-    if (mapUpdated) {
-      //DEBUG_PRINTF("Nascom Keyboard Map\n");
-      //self->map.dump();
+    reply(ok ? "OK" : "E01");
+  }
+  static void stopReply() {
+    uint16_t addr;
+    NascomDebugger::StopReason reason = debugger->getStopReason(&addr);
+    if (reason != NascomDebugger::stopRead && reason != NascomDebugger::stopWrite) {
+      reply("S05");
+      return;
     }
+    char text[24];
+    snprintf(text, sizeof(text), "T05%s:%04x;", reason == NascomDebugger::stopRead ? "rwatch" : "watch", addr);
+    reply(text);
+  }
+  static int stepAction() {
+    return -1;
+  }
+  static void step() {
+    z80::simz80(z80::pc, 2, stepAction);
+    if (z80::debugHit)
+      debugger->stopped(z80::pc);
+    stopReply();
+  }
+
+  // Decodes the binary data in X packets in place.  Returns the new length
+  static uint32_t unescape(uint32_t len) {
+    char *data = strchr(packet, ':');
+    if (data == nullptr)
+      return len;
+    uint32_t to = data + 1 - packet;
+    for (uint32_t from = to; from < len; from++)
+      packet[to++] = (packet[from] == '}' && from + 1 < len) ? packet[++from] ^ 0x20 : packet[from];
+    return to;
   }
+
 public:
-  NascomKeyboard(NascomControl &control, const char *startText = "") : control(control), startText(startText) {
-    self = this;
+  static void begin(Stream &gdbStream, NascomDebugger &gdbDebugger) {
+    stream = &gdbStream;
+    debugger = &gdbDebugger;
   }
-  void init() {
-    keyboard.begin(Pins::kbdClock, Pins::kbdData, true, false);
-    keyboard.onVirtualKey = handleVirtualKey;
+  // True when GDB has sent something.  The CPU loop then stops and calls serve()
+  static bool pending() {
+    return stream != nullptr && stream->available() > 0;
   }
-  fabgl::Keyboard &getKeyboard() {
-    return keyboard;
+  static bool getAttached() {
+    return attached;
   }
-  void mapRewind() {
-    if (startText[startTextIndex] != 0) {
-      if (startTextKeyDown) {
-        map.setAsciiChar(startTextChar, false);
-        startTextKeyDown = false;
-        startTextIndex += 1;
+  // Handles packets while the machine is stopped.  Returns on continue or detach.  sendStop
+  // reports a breakpoint or watchpoint stop first
+  static void serve(bool sendStop) {
+    if (sendStop)
+      stopReply();
+    while (true) {
+      int len = readPacket();
+      if (len < 0) {
+        reply("S02");
+        continue;
       }
-      else {
-        startTextChar = startText[startTextIndex];
-        if (islower(startTextChar))
-          startTextChar = toupper(startTextChar);
-        else if (isupper(startTextChar))
-          startTextChar = tolower(startTextChar);
-        map.setAsciiChar(startTextChar, true);
-        startTextKeyDown = true;
+      attached = true;
+      const char *args = &packet[1];
+      switch (packet[0]) {
+        case '?':
+          reply("S05");
+          break;
+        case 'g':
+          readRegisters();
+          break;
+        case 'G':
+          writeRegisters(args);
+          break;
+        case 'p':
+          readRegister(args);
+          break;
+        case 'P':
+          writeRegister(args);
+          break;
+        case 'm':
+          readMemory(args, false);
+          break;
+        case 'x':
+          readMemory(args, true);
+          break;
+        case 'M':
+          writeMemory(args, &packet[len], false);
+          break;
+        case 'X':
+          len = unescape(len);
+          writeMemory(args, &packet[len], true);
+          break;
+        case 'Z':
+        case 'z':
+          setBreakpoint(args, packet[0] == 'Z');
+          break;
+        case 's':
+          if (*args != 0)
+            z80::pc = parseHex(args);
+          step();
+          break;
+        case 'c':
+          if (*args != 0)
+            z80::pc = parseHex(args);
+          return;
+        case 'D':
+          reply("OK");
+          attached = false;
+          return;
+        case 'k':
+          attached = false;
+          return;
+        case 'H':
+          reply("OK");
+          break;
+        case 'q':
+          if (strncmp(args, "Supported", 9) == 0)
+            reply("PacketSize=1000;binary-upload+");
+          else if (strcmp(args, "Attached") == 0)
+            reply("1");
+          else
+            reply("");
+          break;
+        default:
+          reply("");
+          break;
       }
     }
-    map.rewind();
   }
-  void mapStep() {
-    map.step();
+};
+Stream         *NascomGdbStub::stream = nullptr;
+NascomDebugger *NascomGdbStub::debugger = nullptr;
+bool            NascomGdbStub::attached = false;
+char            NascomGdbStub::packet[NascomGdbStub::maxPacket + 1];
+uint8_t         NascomGdbStub::out[256];
+uint32_t        NascomGdbStub::outLen = 0;
+uint8_t         NascomGdbStub::outSum = 0;
+#endif
+
+#ifdef SCREEN_MIRROR
+// Nascom screen mirror
+// Mirrors the Nascom screen to a terminal on the serial port (UTF-8, at least 48x16).  Only
+// the characters that changed are sent, as cursor-positioned ANSI sequences, at most once per
+// frameIntervalMs, and never more than the serial transmit buffer has room for, so the CPU
+// loop doesn't wait for the serial port.  Characters that don't fit are sent in a later
+// frame.  Graphics characters (80-FF) are shown as the Unicode 2x3 block mosaic (sextant)
+// closest to their NascomFont glyph, which is exact for the block graphics C0-FF.
+class NascomScreenMirror {
+  static const uint32_t width           = 48;
+  static const uint32_t height          = 16;
+  static const uint32_t frameIntervalMs = 100;
+  static const uint32_t maxFrame        = 1024;
+  static const uint32_t maxGap          = 3;    // Unchanged characters sent instead of a cursor move
+
+  static Print         *out;
+  static NascomDisplay *display;
+  static uint8_t        shown[width*height];   // What the terminal shows
+  static uint8_t        sextants[128];         // Block pattern of 80-FF
+  static uint16_t       pendingRows;
+  static uint32_t       lastFrameMs;
+  static uint32_t       cursorX;
+  static uint32_t       cursorY;               // height if unknown
+  static char           frame[maxFrame];
+  static uint32_t       frameLen;
+
+  // Screen line y, 0 is the top line.  The top line is at 0BCA, the others from 080A
+  static const uint8_t *screenLine(uint32_t y) {
+    return &z80::ram[0x800 + ((y + height - 1) % height)*64 + 10];
   }
-  uint8_t mapCurrent() {
-    return map.current();
+  // The 2x3 blocks that are at least half set in the glyph of ch.  Bit 0 is the top left
+  // block, bit 1 the top right, and so on to bit 5, the bottom right
+  static uint8_t sextant(uint8_t ch) {
+    const uint8_t *glyph = &nascomFontPixels[ch*16];
+    uint8_t        pattern = 0;
+    for (uint32_t bi = 0; bi < 6; bi++) {
+      uint8_t  mask = (bi & 1) != 0 ? 0x0f : 0xf0;
+      uint32_t set = 0;
+      for (uint32_t row = (bi/2)*5; row < (bi/2)*5 + 5; row++)
+        set += __builtin_popcount(glyph[row] & mask);
+      if (set >= 10)
+        pattern |= 1 << bi;
+    }
+    return pattern;
   }
-
-  uint32_t mapGetIndex() {
-    return map.getMapIndex();
+  // Appends a screen character as UTF-8
+  static void appendChar(uint8_t ch) {
+    uint32_t code = ch >= 32 && ch < 127 ? ch : '.';
+    if (ch >= 0x80) {
+      uint8_t pattern = sextants[ch - 0x80];
+      if (pattern == 0)
+        code = ' ';
+      else if (pattern == 21)
+        code = 0x258c;  // Left half block
+      else if (pattern == 42)
+        code = 0x2590;  // Right half block
+      else if (pattern == 63)
+        code = 0x2588;  // Full block
+      else
+        code = 0x1fb00 + pattern - 1 - (pattern > 21) - (pattern > 42);
+    }
+    if (code < 0x80) {
+      frame[frameLen++] = code;
+    }
+    else if (code < 0x10000) {
+      frame[frameLen++] = 0xe0 | code >> 12;
+      frame[frameLen++] = 0x80 | (code >> 6 & 0x3f);
+      frame[frameLen++] = 0x80 | (code & 0x3f);
+    }
+    else {
+      frame[frameLen++] = 0xf0 | code >> 18;
+      frame[frameLen++] = 0x80 | (code >> 12 & 0x3f);
+      frame[frameLen++] = 0x80 | (code >> 6 & 0x3f);
+      frame[frameLen++] = 0x80 | (code & 0x3f);
+    }
   }
-};
-NascomKeyboard *NascomKeyboard::self = nullptr;
-
-// Nascom IO logic
-class NascomIo {
-  // Port0 Out/In bits
-  // -----------------
-  //   Bit  Out                        In
-  //   7:   ??                         ??
-  //   6:   ??                         Keyboard S6
-  //   5:   ??                         Keyboard S3
-  //   4:   Tape LED                   Keyboard S5
-  //   3:   Single step                Keyboard S4
-  //   2:   ??                         Keyboard S0
-  //   1:   Keyboard index reset       Keyboard S2
-  //   0:   Keyboard index increment   Keyboard S1
-  #define P0_OUT_KEYBOARD_INCREMENT 1 << 0
-  #define P0_OUT_KEYBOARD_RESET     1 << 1
-  #define P0_OUT_TAPE_LED           1 << 4
-  #define P2_IN_UART_TBR_EMPTY      1 << 6
-  #define P2_IN_UART_DATA_READY     1 << 7
 
-  NascomKeyboard &keyboard;
-  NascomTape     &tape;
-  uint8_t        p0LastValue;
 public:
-  NascomIo(NascomKeyboard &keyboard, NascomTape &tape) : keyboard(keyboard), tape(tape), p0LastValue(0) {}
-  uint8_t in(uint32_t port) {
-    //DEBUG_PRINTF("in(%d) called\n", port);
-    switch (port) {
-      case 0: {
-        uint8_t val = keyboard.mapCurrent();
-        return ~val;
-      }
-      case 1:
-        return tape.readByte();
-      case 2: {
-          // UART Status: Always ready to send data. Only provide input data if led is on
-          return P2_IN_UART_TBR_EMPTY | (tape.getLed() ? P2_IN_UART_DATA_READY : 0);
-      }
-      default:
-        return 0;
-    }
+  static void begin(Print &mirrorOut, NascomDisplay &mirrorDisplay) {
+    out = &mirrorOut;
+    display = &mirrorDisplay;
+    for (uint32_t ch = 0x80; ch < 0x100; ch++)
+      sextants[ch - 0x80] = sextant(ch);
+    // Hide the cursor (NAS-SYS draws its own) and clear the terminal
+    out->print("\033[?25l\033[2J");
+    memset(shown, ' ', sizeof(shown));
+    pendingRows = 0xffff;
+    cursorY = height;
   }
-  void out(uint32_t port, uint8_t value) {
-    //DEBUG_PRINTF("out(%d, %d) called \n", port, value);
-    switch (port) {
-      case 0: {
-        uint8_t zero2One = ~p0LastValue & value;
-        uint8_t one2Zero = p0LastValue & ~value;
-        if ((value & P0_OUT_KEYBOARD_RESET) != 0) {
-          keyboard.mapRewind();
-        }
-        else if ((zero2One & P0_OUT_KEYBOARD_INCREMENT) != 0) {
-          //DEBUG_PRINTF("out(0): value: %02x, zero2One: %02x\n", value, zero2One);
-          keyboard.mapStep();
-        }
-        if ((zero2One & P0_OUT_TAPE_LED) != 0) {
-          tape.setLed(true);
-          //tape.openFiles();
-          //Note: files are opened on demand during the first read or write operation
+  // Called once per slice, after NascomDisplay::updateFromMemory()
+  static void tick() {
+    if (out == nullptr)
+      return;
+    pendingRows |= display->getChangedRows();
+    uint32_t now = millis();
+    if (pendingRows == 0 || now - lastFrameMs < frameIntervalMs)
+      return;
+    lastFrameMs = now;
+    int      room = out->availableForWrite();
+    uint32_t limit = room < (int)maxFrame ? room : maxFrame;
+    frameLen = 0;
+    for (uint32_t y = 0; y < height; y++) {
+      if ((pendingRows & (1 << y)) == 0)
+        continue;
+      const uint8_t *line = screenLine(y);
+      uint8_t       *shownLine = &shown[y*width];
+      uint32_t       x;
+      for (x = 0; x < width; x++) {
+        if (line[x] == shownLine[x])
+          continue;
+        // A gap or a cursor move, and the character
+        if (frameLen + maxGap*4 + 4 > limit)
+          break;
+        if (cursorY == y && x >= cursorX && x - cursorX <= maxGap) {
+          for (; cursorX < x; cursorX++)
+            appendChar(shownLine[cursorX]);
         }
-        if ((one2Zero & P0_OUT_TAPE_LED) != 0) {
-          tape.setLed(false);
-          tape.closeFiles();
+        else {
+          frameLen += snprintf(&frame[frameLen], maxFrame - frameLen, "\033[%u;%uH", y + 1, x + 1);
         }
-        p0LastValue = value;
-        break;
+        appendChar(line[x]);
+        shownLine[x] = line[x];
+        cursorX = x + 1;
+        cursorY = y;
       }
-      case 1:
-        tape.writeByte(value);
-        break;
-      default:
+      if (x < width)
         break;
+      pendingRows &= ~(1 << y);
     }
+    if (frameLen > 0)
+      out->write((const uint8_t *)frame, frameLen);
   }
 };
+Print         *NascomScreenMirror::out = nullptr;
+NascomDisplay *NascomScreenMirror::display = nullptr;
+uint8_t        NascomScreenMirror::shown[NascomScreenMirror::width*NascomScreenMirror::height];
+uint8_t        NascomScreenMirror::sextants[128];
+uint16_t       NascomScreenMirror::pendingRows = 0;
+uint32_t       NascomScreenMirror::lastFrameMs = 0;
+uint32_t       NascomScreenMirror::cursorX = 0;
+uint32_t       NascomScreenMirror::cursorY = NascomScreenMirror::height;
+char           NascomScreenMirror::frame[NascomScreenMirror::maxFrame];
+uint32_t       NascomScreenMirror::frameLen = 0;
+#endif
 
 class NascomCpu {
-  #define Z80_FREQUENCY              4000000
-  #define UI_REFRESH_RATE            30
-  #define ESTIMATED_CYCLES_PER_INSN  8
-  #define INSN_PER_REFRESH           Z80_FREQUENCY/UI_REFRESH_RATE/ESTIMATED_CYCLES_PER_INSN
-
-  NascomDisplay &display;
-  NascomMemory  &memory;
-  NascomControl &control;
+  NascomDisplay  &display;
+  NascomMemory   &memory;
+  NascomControl  &control;
+  NascomTape     &tape;
+  NascomUart     &uart;
+  NascomSnapshot &snapshot;
+  NascomResume   &resume;
+  NascomRewind   &rewind;
+  NascomInputLog &inputLog;
+  NascomDebugger &debugger;
+  NascomBenchmark &benchmark;
+  NascomConformance &conformance;
+  NascomLockstep &lockstep;
 
   static NascomCpu *self;
 
   static int simAction() {
+    self->inputLog.tick();
     static uint32_t count   = 0;
     static uint32_t start   = millis();
     static uint32_t delayMs = 25;
@@ -1205,8 +5791,30 @@ class NascomCpu {
       count = 0;
     }
     self->display.updateFromMemory(self->memory);
-    delay(delayMs);
-    if (self->control.getIsActive()) {
+    self->uart.poll();
+#ifdef SCREEN_MIRROR
+    NascomScreenMirror::tick();
+#endif
+    bool boot = self->benchmark.tick();
+    bool conform = self->conformance.tick();
+    if (!self->benchmark.getRunning()) {
+      self->resume.tick();
+      self->rewind.tick();
+    }
+    if (self->tape.isFastLoading() || self->benchmark.getRunning()) {
+      // Run unthrottled while a tape is fast loaded or a benchmark runs, and restart the
+      // delay calibration
+      start = millis();
+      count = 0;
+    }
+    else {
+      delay(delayMs);
+    }
+#ifdef Z80_GDB
+    if (NascomGdbStub::pending())
+      return -1;
+#endif
+    if (self->control.getIsActive() || boot || conform) {
       return -1;
     }
     else {
@@ -1214,20 +5822,140 @@ class NascomCpu {
     }
   }
 
+  void handleSnapshotRequest() {
+    FS         *fs;
+    const char *fileName;
+    char        status[48 + 1];
+    NascomControl::SnapshotAction action = control.takeSnapshotRequest(&fs, &fileName);
+    if (action == NascomControl::snapshotSave) {
+      bool ok = snapshot.save(fs, fileName);
+      snprintf(status, sizeof(status), "%s: %s", fileName, ok ? "Snapshot saved" : snapshot.getError());
+      control.setStatus(status);
+    }
+    else if (action == NascomControl::snapshotRestore) {
+      bool ok = snapshot.restore(fs, fileName);
+      snprintf(status, sizeof(status), "%s: %s", fileName, ok ? "Snapshot restored" : snapshot.getError());
+      control.setStatus(status);
+      if (ok)
+        rewind.reset();
+    }
+    else if (action == NascomControl::snapshotRecord) {
+      if (inputLog.startRecording(fs, fileName))
+        rewind.reset();
+      else
+        control.setStatus("Cannot start recording");
+    }
+    else if (action == NascomControl::snapshotReplay) {
+      if (inputLog.startReplay(fs, fileName))
+        rewind.reset();
+      else
+        control.setStatus("Cannot start replay");
+    }
+  }
+  // Diagnostics are indexes into NascomControl::diagnosticsModes
+  static const int diagnosticsFeatures[5];
+  uint32_t getDiagnostics() {
+    uint32_t mode = 0;
+    for (uint32_t mi = 0; mi < sizeof(diagnosticsFeatures)/sizeof(diagnosticsFeatures[0]); mi++) {
+      if (z80::features == diagnosticsFeatures[mi])
+        mode = mi;
+    }
+    return mode;
+  }
+  void setDiagnostics(uint32_t mode) {
+    int  features = diagnosticsFeatures[mode];
+    bool ok = NascomProfiler::setEnabled(features & FEATURE_PROFILE);
+    ok = NascomOpStats::setEnabled(features & FEATURE_OPSTATS) && ok;
+    ok = NascomTrace::setEnabled(features & FEATURE_TRACE) && ok;
+    if (!ok)
+      control.setStatus("Diagnostics: Out of memory");
+  }
+  void dumpDiagnostics() {
+    if (z80::features & FEATURE_PROFILE)
+      NascomProfiler::dump(control.getHasSd());
+    if (z80::features & FEATURE_OPSTATS)
+      NascomOpStats::dump(control.getHasSd());
+    if (z80::features & FEATURE_TRACE)
+      NascomTrace::dump(control.getHasSd());
+  }
+  void handleRewindRequest() {
+    uint32_t seconds;
+    rewind.setEnabled(control.takeRewindRequest(&seconds));
+    if (control.takeMemoryChanged())
+      rewind.reset();
+    if (seconds != 0) {
+      char status[48 + 1];
+      snprintf(status, sizeof(status), "Rewind: Back %d s", rewind.rewind(seconds));
+      control.setStatus(status);
+    }
+  }
+
 public:
-  NascomCpu(NascomDisplay &display, NascomMemory &memory, NascomControl &control) : display(display), memory(memory), control(control) {
+  NascomCpu(NascomDisplay &display, NascomMemory &memory, NascomControl &control, NascomTape &tape, NascomUart &uart,
+            NascomSnapshot &snapshot, NascomResume &resume, NascomRewind &rewind, NascomInputLog &inputLog,
+            NascomDebugger &debugger, NascomBenchmark &benchmark, NascomConformance &conformance,
+            NascomLockstep &lockstep) :
+    display(display), memory(memory), control(control), tape(tape), uart(uart), snapshot(snapshot), resume(resume), rewind(rewind),
+    inputLog(inputLog), debugger(debugger), benchmark(benchmark), conformance(conformance), lockstep(lockstep) {
     self = this;
   }
+  // Runs from the current z80::pc, which is 0 after a cold boot
   void run() {
     bool controlScreen = false;
-    z80::pc = 0;
+    resume.start();
     while (true) {
       if (!control.getIsActive()) {
+        if (controlScreen) {
+          resume.setMode((NascomResume::Mode)control.getResumeMode());
+          // The lockstep checker owns the diagnostics buffers of the Full instance
+          if (!lockstep.getActive())
+            setDiagnostics(control.getDiagnostics());
+          else if (control.getDiagnostics() != getDiagnostics())
+            control.setStatus("Diagnostics: Busy with the lockstep check");
+          handleRewindRequest();
+          handleSnapshotRequest();
+        }
         controlScreen = false;
-        z80::simz80(z80::pc, INSN_PER_REFRESH, simAction);
+        if (benchmark.boot() || conformance.run())
+          rewind.reset();
+        bool checked = lockstep.getActive();
+        z80::FASTWORK stop = checked ? lockstep.run(INSN_PER_REFRESH, simAction) :
+                                       z80::simz80(z80::pc, INSN_PER_REFRESH, simAction);
+        if (checked && !lockstep.getActive())
+          rewind.reset();
+        if ((stop & DEBUG_STOP) != 0) {
+          debugger.stopped(z80::pc);
+#ifdef Z80_GDB
+          if (NascomGdbStub::getAttached()) {
+            NascomGdbStub::serve(true);
+            continue;
+          }
+#endif
+          control.activate(NascomControl::debugView);
+        }
+        else if ((stop & 0x10000) == 0) {
+          // HALT.  Execution continues after the HALT instruction
+          DEBUG_PRINTF("HALT at %04x, sp = %04x\n", (z80::pc - 1) & 0xffff, z80::sp);
+          if (z80::features & FEATURE_TRACE)
+            NascomTrace::dump(control.getHasSd());
+        }
+#ifdef Z80_GDB
+        if (NascomGdbStub::pending())
+          NascomGdbStub::serve(false);
+#endif
       }
       else {
         if (!controlScreen) {
+          inputLog.stop();
+          if (!lockstep.getActive())
+            dumpDiagnostics();
+          control.setDiagnostics(getDiagnostics());
+          if (resume.getMode() == NascomResume::onControl)
+            resume.save();
+          control.setResumeMode(resume.getMode());
+          char stats[22 + 1];
+          rewind.getStatsText(stats, sizeof(stats));
+          control.setRewind(rewind.getEnabled(), stats);
           control.showScreen();
           controlScreen = true;
         }
@@ -1236,26 +5964,82 @@ public:
   }
 };
 NascomCpu *NascomCpu::self = nullptr;
+const int  NascomCpu::diagnosticsFeatures[5] = {0, FEATURE_PROFILE, FEATURE_OPSTATS, FEATURE_TRACE,
+                                                FEATURE_PROFILE | FEATURE_OPSTATS | FEATURE_TRACE};
 
 NascomDisplay   nascomDisplay;
 NascomTape      nascomTape;
-NascomControl   nascomControl(nascomDisplay, nascomTape);
-NascomKeyboard  nascomKeyboard(nascomControl, startText);
+NascomUart      nascomUart(UI_REFRESH_RATE);
 NascomMemory    nascomMemory(z80::ram);
-NascomIo        nascomIo(nascomKeyboard, nascomTape);
-NascomCpu       nascomCpu(nascomDisplay, nascomMemory, nascomControl);
+NascomDebugger  nascomDebugger;
+NascomControl   nascomControl(nascomDisplay, nascomTape, nascomUart, nascomMemory, nascomDebugger);
+NascomKeyboard  nascomKeyboard(nascomControl, startText);
+NascomIo        nascomIo(nascomKeyboard, nascomTape, nascomUart);
+NascomFastLoad  nascomFastLoad(nascomTape, nascomUart);
+NascomSnapshot  nascomSnapshot(nascomKeyboard, nascomIo, nascomTape);
+NascomResume    nascomResume(nascomSnapshot);
+NascomRewind    nascomRewind(nascomSnapshot);
+NascomInputLog  nascomInputLog(nascomKeyboard, nascomSnapshot, nascomControl, INSN_PER_REFRESH);
+NascomLockstep  nascomLockstep(nascomIo, nascomFastLoad);
+NascomBenchmark nascomBenchmark(nascomDisplay, nascomMemory, nascomKeyboard, nascomTape, nascomUart, nascomFastLoad,
+                                nascomSnapshot, nascomControl, nascomLockstep, INSN_PER_REFRESH);
+NascomConformance nascomConformance(nascomKeyboard, nascomIo, nascomSnapshot, nascomControl, INSN_PER_REFRESH);
+NascomCpu       nascomCpu(nascomDisplay, nascomMemory, nascomControl, nascomTape, nascomUart, nascomSnapshot, nascomResume,
+                          nascomRewind, nascomInputLog, nascomDebugger, nascomBenchmark, nascomConformance, nascomLockstep);
 
 namespace z80 {
   int in(uint32_t port) {
+    if (nascomLockstep.getActive())
+      return nascomLockstep.in(port);
     return nascomIo.in(port);
   }
   void out(uint32_t port, uint8_t value) {
-    nascomIo.out(port, value);
+    if (nascomLockstep.getActive())
+      nascomLockstep.out(port, value);
+    else
+      nascomIo.out(port, value);
+  }
+  void trap(uint32_t addr) {
+    if (nascomLockstep.getActive())
+      nascomLockstep.trap(addr);
+    else
+      nascomFastLoad.trap(addr);
+  }
+  void firstPageWrite(uint32_t page) {
+    if (nascomLockstep.getActive())
+      nascomLockstep.pageWrite(page);
+    else
+      nascomRewind.pageWrite(page);
+  }
+  int isBreakpoint(uint32_t pc) {
+    return nascomDebugger.isBreakpoint(pc);
+  }
+  void watchAccess(uint32_t addr, int kind) {
+    nascomDebugger.watchAccess(addr, kind);
+  }
+  void opPair(uint32_t op) {
+    NascomOpStats::pair(op);
   }
 }
 
 void setup() {
+#ifdef SCREEN_MIRROR
+  Serial.setTxBufferSize(1024);
+#endif
+#ifdef UART_BRIDGE
+  // Room for the backlog above the XOFF level while the host reacts
+  Serial.setRxBufferSize(4096);
+#endif
   Serial.begin(115200);
+#ifdef Z80_GDB
+  NascomGdbStub::begin(Serial, nascomDebugger);
+#endif
+#ifdef SCREEN_MIRROR
+  NascomScreenMirror::begin(Serial, nascomDisplay);
+#endif
+#ifdef UART_BRIDGE
+  nascomUart.begin(Serial, NascomUart::instant);
+#endif
   DEBUG_PRINTF("Mount LittleFS\n");
   if (!LittleFS.begin()) {
     DEBUG_PRINTF("LittleFS mount failed\n");
@@ -1266,36 +6050,58 @@ void setup() {
     DEBUG_PRINTF("SD card mount failed\n");
   }
 
-  DEBUG_PRINTF("Internal files:\n");
-  File dir = LittleFS.open("/");
-  while (File file = dir.openNextFile()) {
-    DEBUG_PRINTF("Name: %s, Size: %d\n", file.name(), file.size());
-    file.close();
-  }
-  dir.close();
+  // Restore the last session before the display and keyboard are started
+  nascomTape.init();
+  nascomResume.init();
+  bool resumed = nascomResume.restore();
 
-  if (hasSd) {
-    DEBUG_PRINTF("External files:\n");
-    dir = SD.open("/");
+  if (!resumed) {
+    DEBUG_PRINTF("Internal files:\n");
+    File dir = LittleFS.open("/");
     while (File file = dir.openNextFile()) {
       DEBUG_PRINTF("Name: %s, Size: %d\n", file.name(), file.size());
       file.close();
     }
     dir.close();
+
+    if (hasSd) {
+      DEBUG_PRINTF("External files:\n");
+      dir = SD.open("/");
+      while (File file = dir.openNextFile()) {
+        DEBUG_PRINTF("Name: %s, Size: %d\n", file.name(), file.size());
+        file.close();
+      }
+      dir.close();
+    }
   }
 
-  nascomTape.init();
   nascomDisplay.init();
   nascomKeyboard.init();
   nascomControl.init(hasSd);
-  nascomTape.setInputFile(&LittleFS, "/blspascal13.cas");
-//  nascomTape.setInputFile(&SD, "/Nip.cas");
-  nascomTape.setOutputFile(&LittleFS, "/tape-out.cas");
-  nascomMemory.nasFileLoad("/nassys3.nal");
-  nascomMemory.nasFileLoad("/basic.nal");
-  nascomMemory.nasFileLoad("/skakur.nas");
-  nascomMemory.nasFileLoad("/BLS-maanelander.nas");
-  nascomTape.setLed(false);
+  uint32_t memStart = millis();
+  if (resumed) {
+    nascomFastLoad.install(nascomMemory);
+  }
+  else {
+    nascomTape.setInputFile(&LittleFS, "/blspascal13.cas");
+//    nascomTape.setInputFile(&SD, "/Nip.cas");
+    nascomTape.setOutputFile(&LittleFS, "/tape-out.cas");
+    nascomMemory.load("/nassys3.nal");
+    nascomFastLoad.install(nascomMemory);
+    nascomMemory.load("/basic.nal");
+    nascomMemory.load("/skakur.nas");
+    nascomMemory.load("/BLS-maanelander.nas");
+    nascomTape.setLed(false);
+    z80::pc = 0;
+  }
+  uint32_t memEnd = millis();
+  if (resumed)
+    DEBUG_PRINTF("Boot: %d ms after power on (resumed at %04x)\n", memEnd, z80::pc);
+  else
+    DEBUG_PRINTF("Boot: %d ms after power on (memory images: %d ms)\n", memEnd, memEnd - memStart);
+  // Headless batch jobs, one at a time
+  if (hasSd && SD.exists("/jobs.txt"))
+    nascomBenchmark.start("/jobs.txt", "/jobs.jsonl");
   nascomCpu.run();
   DEBUG_PRINTF("pc = %04x, sp = %04x\n", z80::pc, z80::sp);
 }
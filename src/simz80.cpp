@@ -54,14 +54,121 @@ static const unsigned char partab[256] = {
 volatile int stopsim;
 #endif
 
+/* Feature policies for the interpreter instances, see simz80.h.  Full
+   is used for any combination of features, and for the lockstep
+   checker, so it skips the diagnostics whose buffers are not allocated.
+   FlatRam takes precedence over the other features */
+#define FEATURE_DEBUG	8
+
+struct Plain {
+    static const bool profile = false;
+    static const bool opstats = false;
+    static const bool trace = false;
+    static const bool debug = false;
+    static const bool flat = false;
+};
+struct Profiled : Plain { static const bool profile = true; };
+struct OpStats : Plain { static const bool opstats = true; };
+struct Traced : Plain { static const bool trace = true; };
+struct Debug : Plain { static const bool debug = true; };
+struct FlatRam : Plain { static const bool flat = true; };
+struct Full {
+    static const bool profile = true;
+    static const bool opstats = true;
+    static const bool trace = true;
+    static const bool debug = true;
+    static const bool flat = false;
+};
+
+static inline int
+variant()
+{
+    return features | (debugArmed ? FEATURE_DEBUG : 0);
+}
+
+#define PROFILE(pc)							\
+	if (F::profile && --profileCountdown == 0) {			\
+		profileCountdown = PROFILE_PERIOD;			\
+		if (prof)						\
+			prof[((pc) & 0xffff) >> PROFILE_SHIFT] += PROFILE_PERIOD; \
+	}
+
+#define OPSTAT(table, op)						\
+	if (F::opstats && opCounts)					\
+		opCounts[table][(op) & 0xff]++
+
+#define OPPAIR(op)							\
+	if (F::opstats && opCounts)					\
+		opPair((op) & 0xff)
+
+#define TRACE() if (F::trace && trace) {				\
+	struct traceRecord *t = &trace[traceIndex++ & (TRACE_SIZE-1)];	\
+	t->pc = PC; t->op[0] = RAM(PC) | RAM(PC+1) << 8;		\
+	t->op[1] = RAM(PC+2) | RAM(PC+3) << 8;				\
+	t->af = AF; t->bc = BC; t->de = DE; t->hl = HL; t->sp = SP;	\
+}
+
+/* Memory access in the interpreter instances.  The debug instance
+   reports accesses to watched pages, see simz80.h */
+#define WATCH(a, kind)							\
+	if (F::debug && (debugPages[((a) & 0xffff) >> 8] & (kind)))	\
+		watchAccess((a) & 0xffff, kind)
+
+template <class F> static inline unsigned char
+dbgGetBYTE(uint16_t a)
+{
+    WATCH(a, DEBUG_READ);
+    return GetBYTE(a);
+}
+
+template <class F> static inline void
+dbgPutBYTE(uint16_t a, uint16_t v)
+{
+    WATCH(a, DEBUG_WRITE);
+    if (F::flat) {
+	MarkDirty(a);
+	ram[a] = v;
+	if (a == 0)
+	    ram[0x10000] = v;
+	return;
+    }
+    PutBYTE(a, v);
+}
+
+template <class F> static inline uint16_t
+dbgGetWORD(uint16_t a)
+{
+    WATCH(a, DEBUG_READ);
+    WATCH(a + 1, DEBUG_READ);
+    return GetWORD(a);
+}
+
+template <class F> static inline void
+dbgPutWORD(unsigned a, uint16_t v)
+{
+    WATCH(a, DEBUG_WRITE);
+    WATCH(a + 1, DEBUG_WRITE);
+    if (F::flat) {
+	dbgPutBYTE<F>(a, v);
+	dbgPutBYTE<F>((a + 1) & 0xffff, v >> 8);
+	return;
+    }
+    PutWORD(a, v);
+}
+
+#define GetBYTE(a)	dbgGetBYTE<F>(a)
+#define PutBYTE(a, v)	dbgPutBYTE<F>(a, v)
+#define GetWORD(a)	dbgGetWORD<F>(a)
+#define PutWORD(a, v)	dbgPutWORD<F>(a, v)
+
 #define POP(x)	do {							\
-	FASTREG y = RAM(SP); SP++;					\
-	x = y + (RAM(SP) << 8); SP++;					\
+	WATCH(SP, DEBUG_READ); FASTREG y = RAM(SP); SP++;		\
+	WATCH(SP, DEBUG_READ); x = y + (RAM(SP) << 8); SP++;		\
 } while (0)
 
 #define PUSH(x) do {							\
-	--SP; RAM(SP) = (x) >> 8;					\
-	--SP; RAM(SP) = x;						\
+	--SP; WATCH(SP, DEBUG_WRITE); MarkDirty(SP); RAM(SP) = (x) >> 8; \
+	--SP; WATCH(SP, DEBUG_WRITE); MarkDirty(SP); RAM(SP) = x;	\
 } while (0)
 
 #define JPC(cond) PC = cond ? GetWORD(PC) : PC+2
@@ -103,7 +210,7 @@ volatile int stopsim;
     regs[regs_sel].hl = HL;						\
     sp = SP
 
-static void
+template <class F> static void
 cb_prefix(FASTREG adr)
 {
     DECLARE_STATE();
@@ -189,7 +296,7 @@ cb_prefix(FASTREG adr)
     SAVE_STATE();
 }
 
-static FASTREG
+template <class F> static FASTREG
 dfd_prefix(FASTREG IXY)
 {
     DECLARE_STATE();
@@ -641,8 +748,9 @@ dfd_prefix(FASTREG IXY)
 			break;
 		case 0xCB:			/* CB prefix */
 			adr = IXY + (signed char) GetBYTE(PC); ++PC;
+			OPSTAT(OPS_XYCB, RAM(PC));
 			SAVE_STATE();
-			cb_prefix(adr);
+			cb_prefix<F>(adr);
 			LOAD_STATE();
 			break;
 		case 0xE1:			/* POP IXY */
@@ -666,8 +774,10 @@ dfd_prefix(FASTREG IXY)
     return(IXY);
 }
 
-FASTWORK
-simz80(FASTREG PC, int count, int (*fnc)())
+/* The interpreter, compiled for the features in F.  Returns, as if fnc
+   had returned -1, when the features change */
+template <class F> static FASTWORK
+simz80_run(FASTREG PC, int count, int (*fnc)())
 {
     FASTREG AF = af[af_sel];
     FASTREG BC = regs[regs_sel].bc;
@@ -677,6 +787,10 @@ simz80(FASTREG PC, int count, int (*fnc)())
     FASTWORK temp, acu, sum, cbits;
     FASTWORK op;
     int n = count;
+    int first = 1;
+    int v = variant();
+    uint32_t *prof = F::profile ? profile : 0;
+    int profileCountdown = PROFILE_PERIOD;
 #ifdef DEBUG
     while (!stopsim) {
 #else
@@ -686,11 +800,27 @@ simz80(FASTREG PC, int count, int (*fnc)())
 	  n = count;
 		SAVE_STATE();
 	  int r = (*fnc)();
-	  if (r == -1)
+	  if (r == -1 || variant() != v)
 	      break;
 	  else if (r != 0)
               PC = 0;
+	  prof = F::profile ? profile : 0;
+      }
+      if (F::debug) {
+	  /* Stop after a watched access, or before a breakpoint.  The
+	     breakpoint at the pc simz80() was called with is skipped */
+	  if (debugHit || (!first && (debugPages[(PC & 0xffff) >> 8] & DEBUG_BREAK) &&
+			   isBreakpoint(PC & 0xffff))) {
+	      SAVE_STATE();
+	      return (PC & 0xffff) | DEBUG_STOP;
+	  }
+	  first = 0;
+	  debugPC = PC & 0xffff;
       }
+      PROFILE(PC);
+      OPSTAT(OPS_MAIN, RAM(PC));
+      OPPAIR(RAM(PC));
+      TRACE();
 
     switch(++PC,RAM(PC-1)) {
 	case 0x00:			/* NOP */
@@ -1780,8 +1910,9 @@ simz80(FASTREG PC, int count, int (*fnc)())
 		JPC(TSTFLAG(Z));
 		break;
 	case 0xCB:			/* CB prefix */
+		OPSTAT(OPS_CB, RAM(PC));
 		SAVE_STATE();
-		cb_prefix(HL);
+		cb_prefix<F>(HL);
 		LOAD_STATE();
 		break;
 	case 0xCC:			/* CALL Z,nnnn */
@@ -1858,8 +1989,9 @@ simz80(FASTREG PC, int count, int (*fnc)())
 		CALLC(TSTFLAG(C));
 		break;
 	case 0xDD:			/* DD prefix */
+		OPSTAT(OPS_DD, RAM(PC));
 		SAVE_STATE();
-		ix = dfd_prefix(ix);
+		ix = dfd_prefix<F>(ix);
 		LOAD_STATE();
 		break;
 	case 0xDE:			/* SBC A,nn */
@@ -1919,6 +2051,7 @@ simz80(FASTREG PC, int count, int (*fnc)())
 		CALLC(TSTFLAG(P));
 		break;
 	case 0xED:			/* ED prefix */
+		OPSTAT(OPS_ED, RAM(PC));
 		switch (++PC, op = GetBYTE(PC-1)) {
 		case 0x40:			/* IN B,(C) */
 			temp = Input(lreg(BC));
@@ -2327,6 +2460,11 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			SETFLAG(N, 1);
 			SETFLAG(Z, 1);
 			break;
+		case 0xFE:			/* emulator trap (patched into ROM) */
+			SAVE_STATE();
+			Trap(PC-2);
+			LOAD_STATE();
+			break;
 		default: if (0x40 <= op && op <= 0x7f) PC--;		/* ignore ED */
 		}
 		break;
@@ -2380,8 +2518,9 @@ simz80(FASTREG PC, int count, int (*fnc)())
 		CALLC(TSTFLAG(S));
 		break;
 	case 0xFD:			/* FD prefix */
+		OPSTAT(OPS_FD, RAM(PC));
 		SAVE_STATE();
-		iy = dfd_prefix(iy);
+		iy = dfd_prefix<F>(iy);
 		LOAD_STATE();
 		break;
 	case 0xFE:			/* CP nn */
@@ -2404,4 +2543,40 @@ simz80(FASTREG PC, int count, int (*fnc)())
     SAVE_STATE();
     return (PC&0xffff)|0x10000;	/* flag non-bios stop */
 }
+
+FASTWORK
+simz80(FASTREG PC, int count, int (*fnc)())
+{
+    if (features & FEATURE_FLAT_RAM)
+	return simz80_run<FlatRam>(PC, count, fnc);
+    switch (variant()) {
+    case 0:
+	return simz80_run<Plain>(PC, count, fnc);
+    case FEATURE_PROFILE:
+	return simz80_run<Profiled>(PC, count, fnc);
+    case FEATURE_OPSTATS:
+	return simz80_run<OpStats>(PC, count, fnc);
+    case FEATURE_TRACE:
+	return simz80_run<Traced>(PC, count, fnc);
+    case FEATURE_DEBUG:
+	return simz80_run<Debug>(PC, count, fnc);
+    default:
+	return simz80_run<Full>(PC, count, fnc);
+    }
+}
+
+FASTWORK
+simz80_engine(int engine, FASTREG PC, int count, int (*fnc)())
+{
+    switch (engine) {
+    case ENGINE_DEBUG:
+	return simz80_run<Debug>(PC, count, fnc);
+    case ENGINE_FULL:
+	return simz80_run<Full>(PC, count, fnc);
+    case ENGINE_FLAT_RAM:
+	return simz80_run<FlatRam>(PC, count, fnc);
+    default:
+	return simz80_run<Plain>(PC, count, fnc);
+    }
+}
 } // end namespace z80
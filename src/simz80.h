@@ -84,6 +84,12 @@ extern volatile int stopsim;
 
 extern FASTWORK simz80(FASTREG PC, int, int (*)());
 
+/* Runs one interpreter instance regardless of features and debugArmed,
+   for the lockstep checker.  ENGINE_PLAIN is the reference.  The
+   buffers of the features an instance has must be allocated */
+enum { ENGINE_PLAIN, ENGINE_DEBUG, ENGINE_FULL, ENGINE_FLAT_RAM, NUM_ENGINES };
+extern FASTWORK simz80_engine(int engine, FASTREG PC, int, int (*)());
+
 #define FLAG_C	1
 #define FLAG_N	2
 #define FLAG_P	4
@@ -120,12 +126,94 @@ GetBYTE(uint16_t a)
    is present
 */
 
+/* Dirty page tracking for the rewind buffer.  The first write to a 1K
+   page after its dirty flag is cleared calls firstPageWrite() before the
+   write.  The handler must set the flag.  All flags are kept set when
+   the tracking is off, so writes only pay for the test */
+#define PAGE_SHIFT	10
+#define NUM_PAGES	(MEMSIZE*1024 >> PAGE_SHIFT)
+extern BYTE dirty[NUM_PAGES];
+extern void firstPageWrite(unsigned int page);
+
+static inline void
+MarkDirty(uint16_t a)
+{
+    if (!dirty[a >> PAGE_SHIFT])
+        firstPageWrite(a >> PAGE_SHIFT);
+}
+
+/* Interpreter variants.  The interpreter is compiled once per feature
+   policy, and simz80() runs the instance for the bits in features and
+   for debugArmed.  The choice is made again after every call of fnc,
+   so features can be switched at slice boundaries, and the plain
+   instance has no feature tests at all.  The buffers for a feature
+   must be allocated before its bit is set.
+   FEATURE_FLAT_RAM makes all of the 64K writable, as a CP/M machine
+   needs, and runs without the other features */
+#define FEATURE_PROFILE	1
+#define FEATURE_OPSTATS	2
+#define FEATURE_TRACE	4
+#define FEATURE_FLAT_RAM	16
+extern int features;
+
+/* Execution profile: Instructions executed per 16 byte block of code.
+   Every PROFILE_PERIOD-th instruction is counted, as PROFILE_PERIOD
+   instructions, so most instructions only pay for a countdown.  The
+   period is prime, so few loops run in step with it */
+#define PROFILE_SHIFT	4
+#define PROFILE_PERIOD	13
+#define NUM_PROFILE_BLOCKS	(0x10000 >> PROFILE_SHIFT)
+extern uint32_t *profile;
+
+/* Opcode statistics: Executions per opcode for the main table and each
+   prefix table (NUM_OPS_TABLES rows), and for pairs of consecutive main
+   opcodes */
+enum { OPS_MAIN, OPS_CB, OPS_DD, OPS_ED, OPS_FD, OPS_XYCB, NUM_OPS_TABLES };
+extern uint32_t (*opCounts)[256];
+extern void opPair(unsigned int op);
+
+/* Instruction trace: The last TRACE_SIZE instructions executed, with the
+   registers before the instruction */
+#define TRACE_SIZE	1024	/* Must be a power of 2 */
+struct traceRecord {
+	WORD pc;
+	WORD op[2];		/* The 4 bytes at pc */
+	WORD af;
+	WORD bc;
+	WORD de;
+	WORD hl;
+	WORD sp;
+};
+extern struct traceRecord *trace;
+extern uint32_t traceIndex;
+
+/* Breakpoints and watchpoints.  simz80() runs a debug instance of the
+   interpreter while debugArmed is set.  debugPages has DEBUG_* bits for each 256 byte
+   page with a breakpoint or a watched address, and only accesses to
+   those pages call the handlers.  Reads include operand fetches, but
+   not opcode fetches (use a breakpoint).
+   watchAccess() sets debugHit on a hit, and the debug instance stops
+   after the instruction.  debugPC is the address of that instruction.
+   On a stop, simz80() returns DEBUG_STOP | pc */
+#define DEBUG_BREAK	1
+#define DEBUG_READ	2
+#define DEBUG_WRITE	4
+#define DEBUG_STOP	0x20000
+extern int debugArmed;
+extern int debugHit;
+extern WORD debugPC;
+extern BYTE debugPages[256];
+extern int isBreakpoint(unsigned int pc);
+extern void watchAccess(unsigned int addr, int kind);
+
 void slow_write(unsigned int a, unsigned char v);
 static inline void
 PutBYTE(uint16_t a, uint16_t v)
 {
-    if (0x800 <= a && a < 0xE000)
+    if (0x800 <= a && a < 0xE000) {
+        MarkDirty(a);
         ram[a] = v;
+    }
 }
 
 /*#define PutBYTE(a, v)	RAM(a) = v*/
@@ -141,19 +229,27 @@ static inline uint16_t GetWORD(uint16_t a)
 
 static inline void PutWORD(unsigned a, uint16_t v)
 {
-    if (0x800 <= a && a < 0xE000 - 1)
+    if (0x800 <= a && a < 0xE000 - 1) {
+        MarkDirty(a);
+        MarkDirty(a + 1);
         memcpy(ram+a, &v, 2);
+    }
 }
 
 #ifndef BIOS
 extern int in(unsigned int);
 extern void out(unsigned int, unsigned char);
+/* Called for the ED FE trap opcode with the address of the opcode.
+   The handler must leave the Z80 state, including pc, in the globals */
+extern void trap(unsigned int);
 #define Input(port) in(port)
 #define Output(port, value) out(port,value)
+#define Trap(adr) trap(adr)
 #else
 /* Define these as macros or functions if you really want to simulate I/O */
 #define Input(port)	0
 #define Output(port, value)
+#define Trap(adr)	pc = (adr)+2
 #endif
 
 }
\ No newline at end of file
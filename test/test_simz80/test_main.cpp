@@ -0,0 +1,704 @@
+// Host tests of the Z80 core (src/simz80.cpp), for the PlatformIO test runner:
+//   pio test -e native
+// Every change to the interpreter should pass them before it goes to the device.
+//
+// The per-opcode cases run a few instructions, ending with a HALT, on each interpreter instance
+// (see simz80_engine()) from the same state.  The registers, the documented flags, the memory
+// word at addr and the port output must match the expected values.
+//
+// test_exercisers runs the CP/M instruction set exercisers prelim.com, zexdoc.com and zexall.com
+// from this directory, or from $ZEX_DIR, if they are there (they are not included).  The machine
+// is the one of NascomConformance: All of the 64K is RAM (FEATURE_FLAT_RAM), 0000 holds a HALT
+// that ends the program, and 0005 jumps to a BDOS shim at FF00 that writes to the console port.
+// Each test group prints a JSON line like /conform.jsonl on the device:
+//   {"program":"zexdoc","group":"aluop a,nn","result":"ok","instructions":...,"wall_ms":...,
+//    "mips":...}
+// instructions and wall_ms are measured from the previous result, with a resolution of one
+// slice of sliceInstructions instructions.
+//
+// test_throughput runs a loop on the instance of each feature set and prints its speed:
+//   {"instance":"profile","instructions":...,"wall_ms":...,"mips":...}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unity.h>
+#include "simz80.h"
+
+namespace z80 {
+  // Z80 state, as in nascom-esp.cpp
+  WORD af[2];
+  int af_sel;
+  struct ddregs regs[2];
+  int regs_sel;
+  WORD ir;
+  WORD ix;
+  WORD iy;
+  WORD sp;
+  WORD pc;
+  WORD IFF;
+  BYTE ram[MEMSIZE*1024+1];
+  BYTE dirty[NUM_PAGES];
+  int  debugArmed;
+  int  debugHit;
+  WORD debugPC;
+  BYTE debugPages[256];
+  int  features;
+  uint32_t *profile;
+  uint32_t (*opCounts)[256];
+  struct traceRecord *trace;
+  uint32_t traceIndex;
+}
+
+static const unsigned int consolePort = 0xff;
+static const uint16_t     codeAddr = 0x1000;
+static const uint16_t     dataAddr = 0x2000;   // 00 01 02 ... ff before each case
+
+// Port output of the last run, as "port:value" pairs
+static char     output[256];
+// Console output of the exercisers
+static void   (*console)(char c) = nullptr;
+static uint32_t pageWrites;
+static uint32_t lastPageWrite;
+
+namespace z80 {
+  // Input is the port number xor 5a
+  int in(unsigned int port) {
+    return (port & 0xff) ^ 0x5a;
+  }
+  void out(unsigned int port, unsigned char value) {
+    if (console != nullptr && (port & 0xff) == consolePort) {
+      console(value);
+      return;
+    }
+    size_t len = strlen(output);
+    snprintf(&output[len], sizeof(output) - len, "%s%02x:%02x", len == 0 ? "" : " ", port & 0xff, value);
+  }
+  void trap(unsigned int addr) {
+    pc = addr + 2;
+  }
+  void firstPageWrite(unsigned int page) {
+    dirty[page] = 1;
+    pageWrites++;
+    lastPageWrite = page;
+  }
+  int isBreakpoint(unsigned int) {
+    return 0;
+  }
+  void watchAccess(unsigned int, int) {
+  }
+  void opPair(unsigned int) {
+  }
+}
+
+// Diagnostic buffers, so the Full instance does all of its work
+static uint32_t           profileCounts[NUM_PROFILE_BLOCKS];
+static uint32_t           opCountTable[z80::NUM_OPS_TABLES][256];
+static z80::traceRecord   traceRecords[TRACE_SIZE];
+
+static const char *const engineNames[z80::NUM_ENGINES] = {"plain", "debug", "full", "flat_ram"};
+
+static int stop() {
+  return -1;
+}
+
+// Registers of a case.  SAME in the expected values: As before the run.  pc 0 in the expected
+// values: After the HALT that ends the code
+#define SAME -1
+struct Registers {
+  int32_t af, bc, de, hl, ix, iy, sp, pc;
+};
+struct Memory {
+  uint16_t addr;         // 0 for none
+  int32_t  before;       // SAME for the data pattern
+  uint16_t after;
+};
+struct Case {
+  const char *name;
+  const char *code;      // Hex bytes at codeAddr
+  Registers   in;
+  Registers   out;
+  Memory      memory;
+  const char *output;    // Expected port output, nullptr for none
+};
+
+static void resetState() {
+  memset(z80::ram, 0, sizeof(z80::ram));
+  memset(z80::dirty, 1, sizeof(z80::dirty));
+  z80::af[0] = z80::af[1] = 0;
+  z80::af_sel = 0;
+  memset(z80::regs, 0, sizeof(z80::regs));
+  z80::regs_sel = 0;
+  z80::ir = z80::ix = z80::iy = 0;
+  z80::sp = 0;
+  z80::IFF = 0;
+  z80::debugArmed = 0;
+  z80::debugHit = 0;
+  memset(z80::debugPages, 0, sizeof(z80::debugPages));
+  z80::features = 0;
+  output[0] = 0;
+  console = nullptr;
+  pageWrites = 0;
+}
+
+// Writes the hex bytes at addr, and a HALT after them.  Returns the address after the HALT
+static uint16_t loadCode(uint16_t addr, const char *code) {
+  char *end;
+  for (unsigned long value = strtoul(code, &end, 16); end != code; value = strtoul(code, &end, 16)) {
+    z80::ram[addr++] = value;
+    code = end;
+  }
+  z80::ram[addr++] = 0x76;
+  return addr;
+}
+
+static void runCase(const Case &c, int engine) {
+  char message[96];
+  snprintf(message, sizeof(message), "%s on %s", c.name, engineNames[engine]);
+  resetState();
+  for (uint32_t i = 0; i < 256; i++)
+    z80::ram[dataAddr + i] = i;
+  if (c.memory.addr != 0 && c.memory.before != SAME) {
+    z80::ram[c.memory.addr] = c.memory.before & 0xff;
+    z80::ram[c.memory.addr + 1] = c.memory.before >> 8;
+  }
+  uint16_t end = loadCode(codeAddr, c.code);
+  z80::af[0] = c.in.af;
+  z80::regs[0].bc = c.in.bc;
+  z80::regs[0].de = c.in.de;
+  z80::regs[0].hl = c.in.hl;
+  z80::ix = c.in.ix;
+  z80::iy = c.in.iy;
+  z80::sp = c.in.sp;
+  z80::FASTWORK result = z80::simz80_engine(engine, codeAddr, 10000, stop);
+  TEST_ASSERT_TRUE_MESSAGE((result & 0x10000) == 0, message);
+  const Registers &out = c.out;
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(out.pc != 0 ? out.pc : end, z80::pc, message);
+  int32_t af = out.af == SAME ? c.in.af : out.af;
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(af & 0xffd7, z80::af[0] & 0xffd7, message);
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(out.bc == SAME ? c.in.bc : out.bc, z80::regs[0].bc, message);
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(out.de == SAME ? c.in.de : out.de, z80::regs[0].de, message);
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(out.hl == SAME ? c.in.hl : out.hl, z80::regs[0].hl, message);
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(out.ix == SAME ? c.in.ix : out.ix, z80::ix, message);
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(out.iy == SAME ? c.in.iy : out.iy, z80::iy, message);
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(out.sp == SAME ? c.in.sp : out.sp, z80::sp, message);
+  if (c.memory.addr != 0) {
+    uint16_t word = z80::ram[c.memory.addr] | z80::ram[c.memory.addr + 1] << 8;
+    TEST_ASSERT_EQUAL_HEX16_MESSAGE(c.memory.after, word, message);
+  }
+  TEST_ASSERT_TRUE_MESSAGE(strcmp(c.output != nullptr ? c.output : "", output) == 0, message);
+}
+
+static void runCases(const Case *cases, uint32_t numCases) {
+  for (uint32_t ci = 0; ci < numCases; ci++) {
+    for (int engine = 0; engine < z80::NUM_ENGINES; engine++)
+      runCase(cases[ci], engine);
+  }
+}
+
+#define RUN_CASES(cases) runCases(cases, sizeof(cases)/sizeof(cases[0]))
+
+//                 AF      BC      DE      HL      IX      IY      SP
+#define REGS(...) {__VA_ARGS__}
+#define S SAME
+
+static const Case loadCases[] = {
+  {"LD BC,nn",       "01 34 12",          REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      0x1234, S,      S,      S,      S,      S)},
+  {"LD A,(HL)",      "7e",                REGS(0x0000, 0x0000, 0x0000, 0x205a, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x5a00, S,      S,      S,      S,      S,      S)},
+  {"LD (HL),n",      "36 77",             REGS(0x0000, 0x0000, 0x0000, 0x2100, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S),
+                                          {0x2100, 0x0000, 0x0077}},
+  {"LD (nn),HL",     "22 00 21",          REGS(0x0000, 0x0000, 0x0000, 0xbeef, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S),
+                                          {0x2100, 0x0000, 0xbeef}},
+  {"LD HL,(nn)",     "2a 10 20",          REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      0x1110, S,      S,      S)},
+  {"LD DE,(nn)",     "ed 5b 10 20",       REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      0x1110, S,      S,      S,      S)},
+  {"LD (nn),A",      "32 00 21 3a 20 20", REGS(0x7700, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x2000, S,      S,      S,      S,      S,      S),
+                                          {0x2100, 0x0000, 0x0077}},
+  {"LD SP,HL",       "f9",                REGS(0x0000, 0x0000, 0x0000, 0x1234, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      0x1234)},
+  {"PUSH BC/POP DE", "c5 d1",             REGS(0x0000, 0x1234, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      0x1234, S,      S,      S,      S),
+                                          {0x20fe, S,      0x1234}},
+  {"LD IX,nn",       "dd 21 34 12",       REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      0x1234, S,      S)},
+  {"LD A,(IX+d)",    "dd 7e 05",          REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x2010, 0x0000, 0x2100),
+                                          REGS(0x1500, S,      S,      S,      S,      S,      S)},
+  {"LD (IY+d),n",    "fd 36 fe 99",       REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2102, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S),
+                                          {0x2100, 0x0000, 0x0099}},
+  {"LD IXH,n",       "dd 26 12",          REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0034, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      0x1234, S,      S)},
+};
+
+static const Case exchangeCases[] = {
+  {"EX DE,HL",       "eb",                REGS(0x0000, 0x0000, 0x1111, 0x2222, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      0x2222, 0x1111, S,      S,      S)},
+  {"EX (SP),HL",     "e3",                REGS(0x0000, 0x0000, 0x0000, 0xabcd, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      0x1234, S,      S,      S),
+                                          {0x2100, 0x1234, 0xabcd}},
+  {"EX (SP),IX",     "dd e3",             REGS(0x0000, 0x0000, 0x0000, 0x0000, 0xabcd, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      0x1234, S,      S),
+                                          {0x2100, 0x1234, 0xabcd}},
+  {"EXX",            "01 11 11 d9 01 22 22 d9",
+                                          REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      0x1111, S,      S,      S,      S,      S)},
+  {"EX AF,AF'",      "3e 11 08 3e 22 08", REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x1100, S,      S,      S,      S,      S,      S)},
+};
+
+static const Case alu8Cases[] = {
+  {"ADD A,B",        "80",                REGS(0x7f00, 0x0100, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x8094, S,      S,      S,      S,      S,      S)},
+  {"ADD A,n carry",  "c6 01",             REGS(0xff00, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0051, S,      S,      S,      S,      S,      S)},
+  {"ADC A,n",        "ce 00",             REGS(0xff01, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0051, S,      S,      S,      S,      S,      S)},
+  {"ADD A,(IY+d)",   "fd 86 01",          REGS(0x0100, 0x0000, 0x0000, 0x0000, 0x0000, 0x200f, 0x2100),
+                                          REGS(0x1100, S,      S,      S,      S,      S,      S)},
+  {"SUB n borrow",   "d6 01",             REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0xff93, S,      S,      S,      S,      S,      S)},
+  {"SUB n overflow", "d6 01",             REGS(0x8000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x7f16, S,      S,      S,      S,      S,      S)},
+  {"SBC A,n",        "de 01",             REGS(0x0101, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0xff93, S,      S,      S,      S,      S,      S)},
+  {"CP n",           "fe 05",             REGS(0x0500, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0542, S,      S,      S,      S,      S,      S)},
+  {"CP (HL)",        "be",                REGS(0x1000, 0x0000, 0x0000, 0x2020, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x1083, S,      S,      S,      S,      S,      S)},
+  {"AND n",          "e6 0f",             REGS(0xf000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0054, S,      S,      S,      S,      S,      S)},
+  {"OR n",           "f6 01",             REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0100, S,      S,      S,      S,      S,      S)},
+  {"XOR A",          "af",                REGS(0x5a00, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0044, S,      S,      S,      S,      S,      S)},
+  {"INC A",          "3c",                REGS(0x7f01, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x8095, S,      S,      S,      S,      S,      S)},
+  {"DEC B",          "05",                REGS(0x0000, 0x0100, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0042, 0x0000, S,      S,      S,      S,      S)},
+  {"INC (HL)",       "34",                REGS(0x0000, 0x0000, 0x0000, 0x2100, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0050, S,      S,      S,      S,      S,      S),
+                                          {0x2100, 0x00ff, 0x0000}},
+  {"DEC (IX+d)",     "dd 35 01",          REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x20ff, 0x0000, 0x2100),
+                                          REGS(0x0042, S,      S,      S,      S,      S,      S),
+                                          {0x2100, 0x0001, 0x0000}},
+  {"NEG",            "ed 44",             REGS(0x0100, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0xff93, S,      S,      S,      S,      S,      S)},
+  {"NEG 80",         "ed 44",             REGS(0x8000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x8087, S,      S,      S,      S,      S,      S)},
+  {"DAA after ADD",  "c6 27 27",          REGS(0x1500, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x4214, S,      S,      S,      S,      S,      S)},
+  {"DAA after SUB",  "d6 09 27",          REGS(0x2000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x1106, S,      S,      S,      S,      S,      S)},
+  {"CPL",            "2f",                REGS(0x5a00, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0xa512, S,      S,      S,      S,      S,      S)},
+  {"SCF",            "37",                REGS(0x0012, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0001, S,      S,      S,      S,      S,      S)},
+  {"CCF",            "3f",                REGS(0x0001, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0010, S,      S,      S,      S,      S,      S)},
+};
+
+static const Case alu16Cases[] = {
+  {"ADD HL,BC",      "09",                REGS(0x00c4, 0x0001, 0x0000, 0xffff, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x00d5, S,      S,      0x0000, S,      S,      S)},
+  {"ADC HL,DE",      "ed 5a",             REGS(0x0001, 0x0000, 0x0000, 0x7fff, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0094, S,      S,      0x8000, S,      S,      S)},
+  {"SBC HL,DE",      "ed 52",             REGS(0x0000, 0x0000, 0x0001, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0093, S,      S,      0xffff, S,      S,      S)},
+  {"SBC HL,HL",      "ed 62",             REGS(0x0000, 0x0000, 0x0000, 0x1234, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0042, S,      S,      0x0000, S,      S,      S)},
+  {"INC BC",         "03",                REGS(0x00d7, 0xffff, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      0x0000, S,      S,      S,      S,      S)},
+  {"DEC SP",         "3b",                REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000),
+                                          REGS(S,      S,      S,      S,      S,      S,      0xffff)},
+  {"ADD IX,SP",      "dd 39",             REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x1000, 0x0000, 0x2000),
+                                          REGS(S,      S,      S,      S,      0x3000, S,      S)},
+};
+
+static const Case rotateCases[] = {
+  {"RLCA",           "07",                REGS(0x8100, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0301, S,      S,      S,      S,      S,      S)},
+  {"RRA",            "1f",                REGS(0x0100, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0001, S,      S,      S,      S,      S,      S)},
+  {"RLC B",          "cb 00",             REGS(0x0000, 0x8000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0001, 0x0100, S,      S,      S,      S,      S)},
+  {"SRL A",          "cb 3f",             REGS(0x0100, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0045, S,      S,      S,      S,      S,      S)},
+  {"SRA (HL)",       "cb 2e",             REGS(0x0000, 0x0000, 0x0000, 0x2100, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0084, S,      S,      S,      S,      S,      S),
+                                          {0x2100, 0x0080, 0x00c0}},
+  {"RL (IX+d)",      "dd cb 01 16",       REGS(0x0001, 0x0000, 0x0000, 0x0000, 0x20ff, 0x0000, 0x2100),
+                                          REGS(0x0001, S,      S,      S,      S,      S,      S),
+                                          {0x2100, 0x0080, 0x0001}},
+  {"RLD",            "ed 6f",             REGS(0x1200, 0x0000, 0x0000, 0x2100, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x1300, S,      S,      S,      S,      S,      S),
+                                          {0x2100, 0x0034, 0x0042}},
+  {"RRD",            "ed 67",             REGS(0x1200, 0x0000, 0x0000, 0x2100, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x1404, S,      S,      S,      S,      S,      S),
+                                          {0x2100, 0x0034, 0x0023}},
+};
+
+static const Case bitCases[] = {
+  {"BIT 7,A",        "cb 7f",             REGS(0x8000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x8090, S,      S,      S,      S,      S,      S)},
+  {"BIT 0,B",        "cb 40",             REGS(0x0001, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0055, S,      S,      S,      S,      S,      S)},
+  {"BIT 1,(IX+d)",   "dd cb 02 4e",       REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x2010, 0x0000, 0x2100),
+                                          REGS(0x0010, S,      S,      S,      S,      S,      S)},
+  {"SET 3,(HL)",     "cb de",             REGS(0x0000, 0x0000, 0x0000, 0x2100, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S),
+                                          {0x2100, 0x0000, 0x0008}},
+  {"RES 0,(IY+d)",   "fd cb 00 86",       REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S),
+                                          {0x2100, 0x00ff, 0x00fe}},
+};
+
+static const Case blockCases[] = {
+  {"LDI",            "ed a0",             REGS(0x0000, 0x0002, 0x2100, 0x2010, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0004, 0x0001, 0x2101, 0x2011, S,      S,      S),
+                                          {0x2100, 0x0000, 0x0010}},
+  {"LDIR",           "ed b0",             REGS(0x0000, 0x0003, 0x2100, 0x2010, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0000, 0x0000, 0x2103, 0x2013, S,      S,      S),
+                                          {0x2101, 0x0000, 0x1211}},
+  {"LDDR",           "ed b8",             REGS(0x0000, 0x0003, 0x2102, 0x2012, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0000, 0x0000, 0x20ff, 0x200f, S,      S,      S),
+                                          {0x2101, 0x0000, 0x1211}},
+  {"CPI",            "ed a1",             REGS(0x0000, 0x0001, 0x0000, 0x2010, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0082, 0x0000, S,      0x2011, S,      S,      S)},
+  {"CPIR",           "ed b1",             REGS(0x1300, 0x0010, 0x0000, 0x2010, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x1346, 0x000c, S,      0x2014, S,      S,      S)},
+};
+
+static const Case jumpCases[] = {
+  {"JP nn",          "c3 04 10 76",       REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S)},
+  {"JR NZ taken",    "20 01 76",          REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S)},
+  {"JR NZ not taken", "20 01 76",         REGS(0x0040, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S,      0x1003)},
+  {"DJNZ",           "06 03 10 fe",       REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      0x0000, S,      S,      S,      S,      S)},
+  {"JP (HL)",        "e9 76",             REGS(0x0000, 0x0000, 0x0000, 0x1002, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S)},
+  {"JP (IX)",        "dd e9 76",          REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x1003, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S)},
+  {"CALL/RET",       "cd 05 10 76 76 c9", REGS(0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S,      0x1004),
+                                          {0x20fe, S,      0x1003}},
+  {"CALL NC not taken", "d4 00 30",       REGS(0x0001, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S)},
+  {"RET Z taken",    "cd 05 10 76 76 c8 76",
+                                          REGS(0x0040, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S,      0x1004)},
+};
+
+static const Case ioCases[] = {
+  {"IN A,(n)",       "db 10",             REGS(0x0001, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x4a01, S,      S,      S,      S,      S,      S)},
+  {"IN A,(C)",       "ed 78",             REGS(0x0001, 0x0010, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x4a01, S,      S,      S,      S,      S,      S)},
+  {"OUT (n),A",      "d3 10",             REGS(0x4200, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S),
+                                          {0, 0, 0}, "10:42"},
+  {"OUT (C),A",      "ed 79",             REGS(0x4200, 0x0020, 0x0000, 0x0000, 0x0000, 0x0000, 0x2100),
+                                          REGS(S,      S,      S,      S,      S,      S,      S),
+                                          {0, 0, 0}, "20:42"},
+  {"OTIR",           "ed b3",             REGS(0x0000, 0x0310, 0x0000, 0x2010, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0042, 0x0010, S,      0x2013, S,      S,      S),
+                                          {0, 0, 0}, "10:10 10:11 10:12"},
+  {"INIR",           "ed b2",             REGS(0x0000, 0x0210, 0x0000, 0x2100, 0x0000, 0x0000, 0x2100),
+                                          REGS(0x0042, 0x0010, S,      0x2102, S,      S,      S),
+                                          {0x2100, 0x0000, 0x4a4a}},
+};
+
+#undef S
+
+void setUp() {
+  resetState();
+  z80::profile = profileCounts;
+  z80::opCounts = opCountTable;
+  z80::trace = traceRecords;
+}
+
+void tearDown() {
+  z80::profile = nullptr;
+  z80::opCounts = nullptr;
+  z80::trace = nullptr;
+}
+
+void test_load() {
+  RUN_CASES(loadCases);
+}
+
+void test_exchange() {
+  RUN_CASES(exchangeCases);
+}
+
+void test_alu8() {
+  RUN_CASES(alu8Cases);
+}
+
+void test_alu16() {
+  RUN_CASES(alu16Cases);
+}
+
+void test_rotate() {
+  RUN_CASES(rotateCases);
+}
+
+void test_bit() {
+  RUN_CASES(bitCases);
+}
+
+void test_block() {
+  RUN_CASES(blockCases);
+}
+
+void test_jump() {
+  RUN_CASES(jumpCases);
+}
+
+void test_io() {
+  RUN_CASES(ioCases);
+}
+
+// Only FEATURE_FLAT_RAM writes below 0800 and from E000 (the Nascom ROMs)
+void test_rom_protection() {
+  for (int engine = 0; engine < z80::NUM_ENGINES; engine++) {
+    resetState();
+    loadCode(codeAddr, "3e 55 32 00 01 32 00 e0");
+    z80::simz80_engine(engine, codeAddr, 10000, stop);
+    uint8_t expected = engine == z80::ENGINE_FLAT_RAM ? 0x55 : 0x00;
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(expected, z80::ram[0x0100], engineNames[engine]);
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(expected, z80::ram[0xe000], engineNames[engine]);
+  }
+}
+
+// The first write to a page after its dirty flag is cleared calls firstPageWrite(), for the
+// rewind buffer and the lockstep checker
+void test_dirty_pages() {
+  for (int engine = 0; engine < z80::NUM_ENGINES; engine++) {
+    resetState();
+    loadCode(codeAddr, "32 00 24 32 01 24 c5");
+    z80::sp = 0x2100;
+    memset(z80::dirty, 0, sizeof(z80::dirty));
+    z80::simz80_engine(engine, codeAddr, 10000, stop);
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(2, pageWrites, engineNames[engine]);
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(0x20fe >> PAGE_SHIFT, lastPageWrite, engineNames[engine]);
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(1, z80::dirty[0x2400 >> PAGE_SHIFT], engineNames[engine]);
+  }
+}
+
+static uint32_t elapsedUs(const timespec &start) {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec)*1000000 + (now.tv_nsec - start.tv_nsec)/1000;
+}
+
+// The exerciser runner, with the console line parsing of NascomConformance
+class Exerciser {
+public:
+  static const uint32_t sliceInstructions = 100000;
+  static const uint32_t maxLine = 80;
+  static const uint16_t bdos = 0xff00;
+
+  static char     program[12 + 1];
+  static char     line[maxLine + 1];
+  static uint32_t lineLen;
+  static uint32_t slices;
+  static timespec start;
+  static uint32_t numGroups;
+  static uint32_t numFailed;
+
+  static int slice() {
+    slices++;
+    return 0;
+  }
+  static void report(const char *group, const char *result) {
+    uint32_t us = elapsedUs(start);
+    uint64_t instructions = (uint64_t)slices*sliceInstructions;
+    printf("{\"program\":\"%s\",\"group\":\"%s\",\"result\":\"%s\",\"instructions\":%llu,\"wall_ms\":%u,"
+           "\"mips\":%.2f}\n",
+           program, group, result, (unsigned long long)instructions, us/1000,
+           us == 0 ? 0.0 : (double)instructions/us);
+    fflush(stdout);
+    numGroups++;
+    numFailed += strcmp(result, "ok") == 0 ? 0 : 1;
+    slices = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+  }
+  static void endLine() {
+    line[lineLen] = 0;
+    bool ok = lineLen >= 2 && strcmp(&line[lineLen - 2], "OK") == 0;
+    const char *error = strstr(line, "ERROR");
+    if (!ok && error == nullptr)
+      return;
+    const char *end = strstr(line, "..");
+    if (end == nullptr)
+      end = error != nullptr ? error : &line[lineLen - 2];
+    while (end > line && end[-1] == ' ')
+      end--;
+    char group[maxLine + 1];
+    if (end == line)
+      strcpy(group, program);
+    else
+      snprintf(group, sizeof(group), "%.*s", (int)(end - line), line);
+    for (char *c = group; *c != 0; c++) {
+      if (*c == '"' || *c == '\\')
+        *c = '\'';
+    }
+    report(group, error != nullptr ? "error" : "ok");
+  }
+  static void write(char c) {
+    if (c == '\n') {
+      endLine();
+      lineLen = 0;
+    }
+    else if (c != '\r' && lineLen < maxLine) {
+      line[lineLen++] = c;
+    }
+  }
+  // Returns false if the program is not there
+  static bool run(const char *dir, const char *name) {
+    char fileName[256];
+    snprintf(fileName, sizeof(fileName), "%s/%s.com", dir, name);
+    FILE *file = fopen(fileName, "rb");
+    if (file == nullptr)
+      return false;
+    resetState();
+    fread(&z80::ram[0x100], 1, bdos - 0x100, file);
+    fclose(file);
+    // BDOS functions 2 and 9 at FF00, as in NascomConformance
+    static const char *bdosCode = "79 fe 02 28 0c fe 09 c0 1a fe 24 c8 d3 ff 13 18 f7 7b d3 ff c9";
+    loadCode(bdos, bdosCode);
+    z80::ram[0x0000] = 0x76;                  // HALT
+    z80::ram[0x10000] = z80::ram[0x0000];
+    z80::ram[0x0005] = 0xc3;                  // JP bdos, also the top of the memory
+    z80::ram[0x0006] = bdos & 0xff;
+    z80::ram[0x0007] = bdos >> 8;
+    z80::sp = bdos;
+    z80::features = FEATURE_FLAT_RAM;
+    snprintf(program, sizeof(program), "%s", name);
+    console = write;
+    lineLen = 0;
+    slices = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    z80::simz80_engine(z80::ENGINE_FLAT_RAM, 0x100, sliceInstructions, slice);
+    console = nullptr;
+    if (z80::pc != 0x0001) {
+      char group[24];
+      snprintf(group, sizeof(group), "HALT at %04x", (z80::pc - 1) & 0xffff);
+      report(group, "halt");
+    }
+    return true;
+  }
+};
+char     Exerciser::program[12 + 1];
+char     Exerciser::line[maxLine + 1];
+uint32_t Exerciser::lineLen;
+uint32_t Exerciser::slices;
+timespec Exerciser::start;
+uint32_t Exerciser::numGroups;
+uint32_t Exerciser::numFailed;
+
+void test_exercisers() {
+  static const char *const programs[3] = {"prelim", "zexdoc", "zexall"};
+  const char *dir = getenv("ZEX_DIR") != nullptr ? getenv("ZEX_DIR") : "test/test_simz80";
+  uint32_t    numPrograms = 0;
+  Exerciser::numGroups = 0;
+  Exerciser::numFailed = 0;
+  for (uint32_t pi = 0; pi < sizeof(programs)/sizeof(programs[0]); pi++)
+    numPrograms += Exerciser::run(dir, programs[pi]) ? 1 : 0;
+  if (numPrograms == 0)
+    TEST_IGNORE_MESSAGE("No exercisers (prelim.com, zexdoc.com, zexall.com) in test/test_simz80 or $ZEX_DIR");
+  printf("{\"suite\":\"conformance\",\"programs\":%u,\"groups\":%u,\"failed\":%u}\n",
+         numPrograms, Exerciser::numGroups, Exerciser::numFailed);
+  TEST_ASSERT_EQUAL_UINT_MESSAGE(0, Exerciser::numFailed, "Exerciser groups failed");
+}
+
+// A loop of loads, stores, arithmetic, a shift and a jump
+static const char *throughputCode =
+  "21 00 20"        // LOOP: LD   HL,2000
+  " 06 00"          //       LD   B,0
+  " 7e"             // BYTE: LD   A,(HL)
+  " c6 01"          //       ADD  A,1
+  " 77"             //       LD   (HL),A
+  " 23"             //       INC  HL
+  " cb 3f"          //       SRL  A
+  " 10 f7"          //       DJNZ BYTE
+  " c3 00 10";      //       JP   LOOP
+static const uint32_t throughputSlice = 1000000;
+static const uint32_t throughputSlices = 50;
+static const uint32_t throughputRuns = 3;
+static uint32_t       throughputCount;
+
+static int throughputAction() {
+  return ++throughputCount == throughputSlices ? -1 : 0;
+}
+
+// The instance for each feature set of simz80(), and its speed relative to the plain one.  The
+// fastest of throughputRuns runs counts
+void test_throughput() {
+  static const struct {
+    const char *name;
+    int         features;
+    int         debugArmed;
+  } instances[] = {
+    {"plain", 0, 0},
+    {"profile", FEATURE_PROFILE, 0},
+    {"opstats", FEATURE_OPSTATS, 0},
+    {"trace", FEATURE_TRACE, 0},
+    {"debug", 0, 1},
+    {"full", FEATURE_PROFILE | FEATURE_OPSTATS | FEATURE_TRACE, 1},
+    {"flat_ram", FEATURE_FLAT_RAM, 0},
+  };
+  double plainMips = 0;
+  for (uint32_t ii = 0; ii < sizeof(instances)/sizeof(instances[0]); ii++) {
+    uint32_t us = UINT32_MAX;
+    for (uint32_t ri = 0; ri < throughputRuns; ri++) {
+      resetState();
+      loadCode(codeAddr, throughputCode);
+      z80::features = instances[ii].features;
+      z80::debugArmed = instances[ii].debugArmed;
+      throughputCount = 0;
+      timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      z80::FASTWORK result = z80::simz80(codeAddr, throughputSlice, throughputAction);
+      uint32_t runUs = elapsedUs(start);
+      TEST_ASSERT_TRUE_MESSAGE((result & 0x10000) != 0, instances[ii].name);
+      if (runUs < us)
+        us = runUs;
+    }
+    uint64_t instructions = (uint64_t)throughputSlices*throughputSlice;
+    double   mips = us == 0 ? 0.0 : (double)instructions/us;
+    if (ii == 0)
+      plainMips = mips;
+    printf("{\"instance\":\"%s\",\"instructions\":%llu,\"wall_ms\":%u,\"mips\":%.2f,\"relative\":%.3f}\n",
+           instances[ii].name, (unsigned long long)instructions, us/1000, mips,
+           plainMips == 0 ? 0.0 : mips/plainMips);
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_load);
+  RUN_TEST(test_exchange);
+  RUN_TEST(test_alu8);
+  RUN_TEST(test_alu16);
+  RUN_TEST(test_rotate);
+  RUN_TEST(test_bit);
+  RUN_TEST(test_block);
+  RUN_TEST(test_jump);
+  RUN_TEST(test_io);
+  RUN_TEST(test_rom_protection);
+  RUN_TEST(test_dirty_pages);
+  RUN_TEST(test_throughput);
+  RUN_TEST(test_exercisers);
+  return UNITY_END();
+}
@@ -0,0 +1,74 @@
+# Author: Peter Jensen
+#
+# Converts the .nal/.nas memory images in data/ to binary .nmi images, so they can be
+# loaded at boot with a few bulk reads instead of parsing hex text.
+#
+# Used as a PlatformIO pre-script (see platformio.ini), so the images are regenerated
+# before the file system image is built.  Can also be run by hand:
+#
+#   python tools/nas2nmi.py [data-dir]
+#
+# .nmi format (all values little endian):
+#   "NMI1"                 magic
+#   u16 numRanges, u16 0   header
+#   numRanges times:
+#     u16 addr, u16 length
+#     length bytes
+#   u32 crc32              zlib CRC-32 of everything above
+
+import os
+import struct
+import sys
+import zlib
+
+def parseNas(fileName):
+    mem = {}
+    with open(fileName, "rb") as f:
+        for line in f:
+            fields = line.replace(b"\x08", b"").split()
+            if len(fields) == 0:
+                continue
+            if fields[0].startswith(b"."):
+                break
+            # Address, data bytes, checksum
+            addr = int(fields[0], 16)
+            for i, byte in enumerate(fields[1:-1]):
+                mem[(addr + i) & 0xffff] = int(byte, 16)
+    return mem
+
+def makeRanges(mem):
+    ranges = []
+    for addr in sorted(mem):
+        if ranges and ranges[-1][0] + len(ranges[-1][1]) == addr and len(ranges[-1][1]) < 0xffff:
+            ranges[-1][1].append(mem[addr])
+        else:
+            ranges.append((addr, bytearray([mem[addr]])))
+    return ranges
+
+def convert(srcName, dstName):
+    ranges = makeRanges(parseNas(srcName))
+    image = bytearray(b"NMI1") + struct.pack("<HH", len(ranges), 0)
+    for addr, data in ranges:
+        image += struct.pack("<HH", addr, len(data)) + data
+    image += struct.pack("<I", zlib.crc32(image) & 0xffffffff)
+    with open(dstName, "wb") as f:
+        f.write(image)
+    print("nas2nmi: %s -> %s (%d ranges, %d bytes)" %
+          (os.path.basename(srcName), os.path.basename(dstName), len(ranges), len(image)))
+
+def convertDir(dataDir):
+    for name in sorted(os.listdir(dataDir)):
+        base, ext = os.path.splitext(name)
+        if ext.lower() not in (".nal", ".nas"):
+            continue
+        srcName = os.path.join(dataDir, name)
+        dstName = os.path.join(dataDir, base + ".nmi")
+        if not os.path.exists(dstName) or os.path.getmtime(dstName) < os.path.getmtime(srcName):
+            convert(srcName, dstName)
+
+try:
+    Import("env")
+    convertDir(os.path.join(env.subst("$PROJECT_DIR"), "data"))
+except NameError:
+    if __name__ == "__main__":
+        convertDir(sys.argv[1] if len(sys.argv) > 1 else "data")
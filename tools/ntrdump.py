@@ -0,0 +1,160 @@
+# Author: Peter Jensen
+#
+# Decodes an instruction trace (.ntr) written by the emulator when Diagnostics is set
+# to Trace or All on the debug screen (see NascomTrace in src/nascom-esp.cpp):
+#
+#   python tools/ntrdump.py trace.ntr [count]
+#
+# Prints the last 'count' instructions (default: all), oldest first, with the
+# registers before each instruction.
+#
+# .ntr format (all values little endian):
+#   "NTR1"                 magic
+#   u16 version, u16 recordSize, u32 numRecords, u32 numInstructions
+#   numRecords times:
+#     u16 pc, 4 bytes at pc, u16 af, bc, de, hl, sp
+
+import struct
+import sys
+
+R   = ["B", "C", "D", "E", "H", "L", "(HL)", "A"]
+RP  = ["BC", "DE", "HL", "SP"]
+RP2 = ["BC", "DE", "HL", "AF"]
+CC  = ["NZ", "Z", "NC", "C", "PO", "PE", "P", "M"]
+ALU = ["ADD A,", "ADC A,", "SUB ", "SBC A,", "AND ", "XOR ", "OR ", "CP "]
+ROT = ["RLC", "RRC", "RL", "RR", "SLA", "SRA", "SLL", "SRL"]
+BLI = {(4, 0): "LDI", (4, 1): "CPI", (4, 2): "INI", (4, 3): "OUTI",
+       (5, 0): "LDD", (5, 1): "CPD", (5, 2): "IND", (5, 3): "OUTD",
+       (6, 0): "LDIR", (6, 1): "CPIR", (6, 2): "INIR", (6, 3): "OTIR",
+       (7, 0): "LDDR", (7, 1): "CPDR", (7, 2): "INDR", (7, 3): "OTDR"}
+
+def signed(b):
+    return b - 256 if b >= 128 else b
+
+def disCb(op, reg):
+    x, y, z = op >> 6, (op >> 3) & 7, op & 7
+    r = reg if reg else R[z]
+    if x == 0:
+        return "%s %s" % (ROT[y], r)
+    return "%s %d,%s" % (["", "BIT", "RES", "SET"][x], y, r)
+
+# b starts with the ED prefix
+def disEd(b):
+    op = b[1]
+    x, y, z, p, q = op >> 6, (op >> 3) & 7, op & 7, (op >> 4) & 3, (op >> 3) & 1
+    if op == 0xfe:
+        return "TRAP"
+    if x == 2 and (y, z) in BLI:
+        return BLI[(y, z)]
+    if x != 1:
+        return "NOP*"
+    if z == 0:
+        return "IN %s(C)" % ("" if y == 6 else R[y] + ",")
+    if z == 1:
+        return "OUT (C),%s" % ("0" if y == 6 else R[y])
+    if z == 2:
+        return "%s HL,%s" % (["SBC", "ADC"][q], RP[p])
+    if z == 3:
+        nn = "%04X" % (b[2] | b[3] << 8)
+        return "LD (%s),%s" % (nn, RP[p]) if q == 0 else "LD %s,(%s)" % (RP[p], nn)
+    if z == 4:
+        return "NEG"
+    if z == 5:
+        return "RETI" if y == 1 else "RETN"
+    if z == 6:
+        return "IM %s" % ["0", "0/1", "1", "2"][y & 3]
+    return ["LD I,A", "LD R,A", "LD A,I", "LD A,R", "RRD", "RLD", "NOP*", "NOP*"][y]
+
+# Returns the mnemonic for the instruction in b (4 bytes).  Immediate operands that
+# don't fit in the 4 bytes are shown as nn
+def dis(b, ixy=None):
+    op = b[0]
+    x, y, z, p, q = op >> 6, (op >> 3) & 7, op & 7, (op >> 4) & 3, (op >> 3) & 1
+    n   = "%02X" % b[1]
+    nn  = "%04X" % (b[1] | b[2] << 8)
+    hl  = ixy or "HL"
+    r   = list(R)
+    if ixy:
+        r[4], r[5], r[6] = ixy + "H", ixy + "L", "(%s%+d)" % (ixy, signed(b[1]))
+        if op & 0xc7 == 0x46 or op & 0xf8 == 0x70 or op in (0x34, 0x35, 0x36) or (x == 2 and z == 6):
+            n = "%02X" % b[2]
+            r[4], r[5] = "H", "L"
+    if op == 0xcb:
+        if ixy:
+            # b starts after the DD/FD prefix: CB, displacement, operation
+            return disCb(b[2], "(%s%+d)" % (ixy, signed(b[1])))
+        return disCb(b[1], None)
+    if op == 0xed:
+        return disEd(b)
+    if op in (0xdd, 0xfd):
+        return dis(b[1:] + [0], "IX" if op == 0xdd else "IY")
+    if x == 0:
+        if z == 0:
+            return ["NOP", "EX AF,AF'", "DJNZ", "JR", "JR NZ,", "JR Z,", "JR NC,", "JR C,"][y] + \
+                   ("" if y < 2 else " %+d" % (signed(b[1]) + 2))
+        if z == 1:
+            return "LD %s,%s" % (RP[p] if p != 2 else hl, nn) if q == 0 else "ADD %s,%s" % (hl, RP[p] if p != 2 else hl)
+        if z == 2:
+            return ["LD (BC),A", "LD A,(BC)", "LD (DE),A", "LD A,(DE)",
+                    "LD (%s),%s" % (nn, hl), "LD %s,(%s)" % (hl, nn), "LD (%s),A" % nn, "LD A,(%s)" % nn][y]
+        if z == 3:
+            return "%s %s" % (["INC", "DEC"][q], RP[p] if p != 2 else hl)
+        if z == 4:
+            return "INC %s" % r[y]
+        if z == 5:
+            return "DEC %s" % r[y]
+        if z == 6:
+            return "LD %s,%s" % (r[y], n)
+        return ["RLCA", "RRCA", "RLA", "RRA", "DAA", "CPL", "SCF", "CCF"][y]
+    if x == 1:
+        if op == 0x76:
+            return "HALT"
+        if ixy and (y == 6 or z == 6):
+            return "LD %s,%s" % (r[y] if y == 6 else R[y], r[z] if z == 6 else R[z])
+        return "LD %s,%s" % (r[y], r[z])
+    if x == 2:
+        return ALU[y] + r[z]
+    if z == 0:
+        return "RET %s" % CC[y]
+    if z == 1:
+        if q == 0:
+            return "POP %s" % (RP2[p] if p != 2 else hl)
+        return ["RET", "EXX", "JP (%s)" % hl, "LD SP,%s" % hl][p]
+    if z == 2:
+        return "JP %s,%s" % (CC[y], nn)
+    if z == 3:
+        return ["JP %s" % nn, "CB", "OUT (%s),A" % n, "IN A,(%s)" % n,
+                "EX (SP),%s" % hl, "EX DE,HL", "DI", "EI"][y]
+    if z == 4:
+        return "CALL %s,%s" % (CC[y], nn)
+    if z == 5:
+        if q == 0:
+            return "PUSH %s" % (RP2[p] if p != 2 else hl)
+        return "CALL %s" % nn
+    if z == 6:
+        return ALU[y] + n
+    return "RST %02XH" % (y*8)
+
+def main():
+    if len(sys.argv) < 2:
+        print("Usage: ntrdump.py <trace.ntr> [count]")
+        return 1
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+    magic, version, recordSize, numRecords, numInstructions = struct.unpack_from("<4sHHII", data, 0)
+    if magic != b"NTR1" or version != 1 or recordSize != 16:
+        print("%s: Not a version 1 trace file" % sys.argv[1])
+        return 1
+    count = int(sys.argv[2]) if len(sys.argv) > 2 else numRecords
+    first = max(0, numRecords - count)
+    print("%d instructions executed, last %d traced" % (numInstructions, numRecords))
+    print("PC    Bytes        Instruction          AF   BC   DE   HL   SP")
+    for ri in range(first, numRecords):
+        pc, b0, b1, b2, b3, af, bc, de, hl, sp = struct.unpack_from("<H4B5H", data, 16 + ri*16)
+        b = [b0, b1, b2, b3]
+        print("%04X  %02X %02X %02X %02X  %-20s %04X %04X %04X %04X %04X" %
+              (pc, b0, b1, b2, b3, dis(b), af, bc, de, hl, sp))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())